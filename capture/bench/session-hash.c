@@ -0,0 +1,169 @@
+/* session-hash.c  -- Session table microbenchmark
+ *
+ * Compares lookups per second of the old HASHP/HASH_FIND_HASH session table
+ * with the ohash.h open addressing table using session.c style keys.
+ *
+ * make bench; bench/session-hash [count ...]   (default 1M 5M 20M)
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dll.h"
+#include "hash.h"
+#include "ohash.h"
+
+#define KEY_LEN 13
+
+/* Roughly the size and layout of the start of a MolochSession_t */
+typedef struct bench_session {
+    struct bench_session *q_next, *q_prev;
+    struct bench_session *h_next, *h_prev;
+    int                   h_bucket;
+    uint32_t              h_hash;
+    char                  sessionId[37];
+    char                  pad[256];
+} BenchSession_t;
+
+typedef struct {
+    struct bench_session *q_next, *q_prev;
+    struct bench_session *h_next, *h_prev;
+    int                   h_bucket;
+    int                   h_count;
+} BenchSessionHead_t;
+
+typedef HASHP_VAR(h_, BenchSessionHash_t, BenchSessionHead_t);
+
+/******************************************************************************/
+/* Same as moloch_session_hash was with the 13 byte string keys */
+uint32_t bench_hash(const void *key)
+{
+    unsigned char *p = (unsigned char *)key;
+    return (((p[1]<<24) ^ (p[2]<<18) ^ (p[3]<<12) ^ (p[4]<<6) ^ p[5]) * 13) ^ (p[8]<<24|p[9]<<16 | p[10]<<8 | p[11]);
+}
+/******************************************************************************/
+int bench_cmp(const void *keyv, const void *elementv)
+{
+    const BenchSession_t *session = (BenchSession_t *)elementv;
+    return memcmp(keyv, session->sessionId, KEY_LEN) == 0;
+}
+/******************************************************************************/
+double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+/******************************************************************************/
+void bench_run(uint32_t num)
+{
+    BenchSession_t     *sessions = calloc(num, sizeof(BenchSession_t));
+    uint32_t           *order = malloc(num * sizeof(uint32_t));
+    BenchSessionHash_t  hashp;
+    OHash_t             ohash;
+    BenchSession_t     *session;
+    uint32_t            i, found;
+    double              start;
+
+    if (!sessions || !order) {
+        printf("%u: not enough memory\n", num);
+        exit(1);
+    }
+
+    // Keys look like moloch_session_id v4 keys, mostly internal 10/8 hosts
+    for (i = 0; i < num; i++) {
+        char *key = sessions[i].sessionId;
+        key[0] = KEY_LEN;
+        uint32_t a1 = 0x0a000000 | (random() & 0xffffff);
+        uint32_t a2 = random();
+        uint16_t p1 = random(), p2 = random();
+        memcpy(key+1, &a1, 4);
+        memcpy(key+5, &p1, 2);
+        memcpy(key+7, &a2, 4);
+        memcpy(key+11, &p2, 2);
+        order[i] = i;
+    }
+
+    // Random lookup order so neither table gets help from the allocator
+    for (i = num - 1; i > 0; i--) {
+        uint32_t j = random() % (i + 1);
+        uint32_t t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+
+    // Old table, sized like moloch_session_init did for maxStreams == num
+    uint32_t buckets = (num/2) | 1;
+    HASHP_INIT(h_, hashp, buckets, bench_hash, bench_cmp);
+    for (i = 0; i < num; i++) {
+        session = &sessions[i];
+        HASH_ADD(h_, hashp, session->sessionId, session);
+    }
+
+    start = bench_now();
+    for (i = found = 0; i < num; i++) {
+        const char *key = sessions[order[i]].sessionId;
+        HASH_FIND_HASH(h_, hashp, bench_hash(key), key, session);
+        found += (session != 0);
+    }
+    double hashpSecs = bench_now() - start;
+
+    ohash_init(&ohash, 0x10000, bench_cmp);
+    start = bench_now();
+    for (i = 0; i < num; i++) {
+        session = &sessions[i];
+        ohash_add(&ohash, bench_hash(session->sessionId), session);
+    }
+    double ohashAddSecs = bench_now() - start;
+
+    start = bench_now();
+    for (i = 0; i < num; i++) {
+        const char *key = sessions[order[i]].sessionId;
+        session = ohash_find(&ohash, bench_hash(key), key);
+        found += (session != 0);
+    }
+    double ohashSecs = bench_now() - start;
+
+    if (found != num * 2)
+        printf("ERROR - only found %u of %u\n", found, num * 2);
+
+    printf("%9u sessions: HASH_FIND_HASH %7.2f M/s  ohash_find %7.2f M/s  (%.2fx)  ohash build with resizes %.2fs\n",
+           num, num/hashpSecs/1000000.0, num/ohashSecs/1000000.0, hashpSecs/ohashSecs, ohashAddSecs);
+
+    ohash_free(&ohash);
+    free(hashp.buckets);
+    free(order);
+    free(sessions);
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    int i;
+
+    srandom(42);
+
+    if (argc == 1) {
+        bench_run(1000000);
+        bench_run(5000000);
+        bench_run(20000000);
+    } else {
+        for (i = 1; i < argc; i++) {
+            bench_run(atoi(argv[i]));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/* session-layout.c  -- MolochSession_t layout dump and per packet microbenchmark
+ *
+ * Prints a pahole style layout of MolochSession_t with cache line markers, then
+ * compares packets per second for the per packet session updates done by
+ * packet.c using the current layout and the layout before the hot/cold split.
+ * Packets hit sessions in random order so every packet is a cache miss, which
+ * is what a busy capture box with millions of sessions looks like, and each
+ * packet waits on the one before like the real packet thread does, so the
+ * cpu can't hide the misses by running ahead.
+ *
+ * make bench; bench/session-layout [sessions [packets]]   (default 1M 20M)
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include "moloch.h"
+
+/* MolochSession_t in the order it was before the hot/cold split, tcpData is
+ * the pointer to the per direction queues in both so only the order differs
+ */
+typedef struct old_session {
+    struct old_session    *tcp_next, *tcp_prev;
+    struct old_session    *q_next, *q_prev;
+    struct old_session    *tw_next, *tw_prev;
+    uint32_t               h_hash;
+    uint32_t               twExpire;
+    uint16_t               twSlot;
+
+    char                   sessionId[37];
+
+    MolochField_t        **fields;
+
+    void                  **pluginData;
+
+    struct moloch_session_arena *arena;
+
+    MolochParserInfo_t    *parserInfo;
+
+    MolochTcpDataHead_t   *tcpData;
+    uint32_t              tcpSeq[2];
+    char                  tcpState[2];
+
+    GArray                *filePosArray;
+    GArray                *fileLenArray;
+    GArray                *fileNumArray;
+    char                  *rootId;
+
+    struct timeval         firstPacket;
+    struct timeval         lastPacket;
+    char                   firstBytes[2][8];
+
+    uint64_t               bytes[2];
+    uint64_t               databytes[2];
+    uint64_t               totalDatabytes[2];
+
+
+    uint32_t               lastFileNum;
+    uint32_t               saveTime;
+    struct in6_addr        addr1;
+    struct in6_addr        addr2;
+    uint32_t               packets[2];
+
+    uint16_t               port1;
+    uint16_t               port2;
+    uint16_t               offsets[2];
+    uint16_t               outstandingQueries;
+    uint16_t               segments;
+    uint16_t               stopSaving;
+
+    uint8_t                consumed[2];
+    uint8_t                protocol;
+    uint8_t                firstBytesLen[2];
+    uint8_t                ip_tos;
+    uint8_t                tcp_flags;
+    uint8_t                parserLen;
+    uint8_t                parserNum;
+    uint8_t                minSaving;
+    uint8_t                maxFields;
+    uint8_t                thread;
+
+    uint16_t               haveTcpSession:1;
+    uint16_t               needSave:1;
+    uint16_t               stopSPI:1;
+    uint16_t               closingQ:1;
+    uint16_t               stopTCP:1;
+    uint16_t               ses:3;
+    uint16_t               midSave:1;
+} OldSession_t;
+
+typedef struct {
+    const char *name;
+    size_t      offset;
+    size_t      size;
+} BenchMember_t;
+
+#define M(f) {#f, offsetof(MolochSession_t, f), sizeof(((MolochSession_t *)0)->f)}
+LOCAL BenchMember_t members[] = {
+    M(tcp_next), M(tcp_prev), M(q_next), M(q_prev), M(tw_next), M(tw_prev),
+    M(h_hash), M(sessionId), M(protocol), M(thread), M(tcp_flags), M(ip_tos),
+    M(port1), M(port2), M(stopSaving), M(tcpState), M(parserNum), M(consumed),
+    M(firstBytesLen), M(minSaving), M(packets), M(tcpSeq), M(addr1), M(addr2),
+    M(lastPacket), M(bytes), M(databytes), M(totalDatabytes), M(tcpData),
+    M(parserInfo), M(filePosArray), M(fileLenArray), M(fileNumArray),
+    M(lastFileNum), M(saveTime), M(twExpire), M(twSlot), M(offsets),
+    M(outstandingQueries), M(segments), M(parserLen), M(fieldsNum), M(fieldsSize),
+    M(firstPacket), M(firstBytes), M(rootId), M(fieldsBits), M(fieldsValues),
+    M(pluginData), M(arena)
+};
+
+/******************************************************************************/
+LOCAL void bench_layout()
+{
+    size_t   end = 0;
+    uint32_t i;
+
+    printf("struct moloch_session {\n");
+    for (i = 0; i < sizeof(members)/sizeof(members[0]); i++) {
+        if (members[i].offset > end)
+            printf("    /* %3zu bytes of bitfields or padding */\n", members[i].offset - end);
+        if (members[i].offset / 64 != (members[i].offset + members[i].size - 1) / 64 || members[i].offset % 64 == 0)
+            printf("    /* --- cacheline %zu boundary (%zu bytes) --- */\n",
+                   (members[i].offset + members[i].size - 1) / 64, (members[i].offset + members[i].size - 1) / 64 * 64);
+        printf("    %-22s /* %4zu %4zu */\n", members[i].name, members[i].offset, members[i].size);
+        end = members[i].offset + members[i].size;
+    }
+    if (sizeof(MolochSession_t) > end)
+        printf("    /* %3zu bytes of bitfields or padding */\n", sizeof(MolochSession_t) - end);
+    printf("}; /* size: %zu, cachelines: %zu, old size: %zu */\n\n",
+           sizeof(MolochSession_t), (sizeof(MolochSession_t) + 63) / 64, sizeof(OldSession_t));
+}
+/******************************************************************************/
+LOCAL double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+/******************************************************************************/
+/* The session fields packet.c looks at or changes for a udp or tcp packet */
+#define BENCH_PACKET(type) \
+LOCAL uint64_t bench_packets_##type(type *sessions, uint32_t *order, uint32_t packets) \
+{ \
+    uint64_t sum = 0; \
+    uint32_t i, chain = 0; \
+    for (i = 0; i < packets; i++) { \
+        type *session = &sessions[order[i] ^ chain]; \
+        if (session->h_hash != order[i] || *(uint8_t *)&session->sessionId != 13) \
+            continue; \
+        int dir = (session->addr1.s6_addr[15] == (i & 1)); \
+        session->q_prev = session; \
+        session->lastPacket.tv_sec = i; \
+        session->bytes[dir] += 100; \
+        session->databytes[dir] += 60; \
+        session->totalDatabytes[dir] += 60; \
+        session->packets[dir]++; \
+        session->tcp_flags |= i; \
+        if (session->protocol == 6) { \
+            session->tcpSeq[dir] = i; \
+            sum += session->tcpState[dir] + (session->tcpData?session->tcpData->q[dir].num:0); \
+        } \
+        if (session->stopSaving == 0 && session->lastFileNum != 1) \
+            sum += (long)session->filePosArray + session->parserNum + session->port1 + session->firstBytesLen[dir]; \
+        chain = session->packets[dir] >> 31; \
+    } \
+    return sum; \
+}
+
+BENCH_PACKET(MolochSession_t)
+BENCH_PACKET(OldSession_t)
+
+#define BENCH_INIT(sessions, num) \
+    do { \
+        uint32_t _i; \
+        for (_i = 0; _i < num; _i++) { \
+            sessions[_i].h_hash = _i; \
+            *(uint8_t *)&sessions[_i].sessionId = 13; \
+            sessions[_i].protocol = (_i & 3)?17:6; \
+        } \
+    } while (0)
+
+/******************************************************************************/
+LOCAL void bench_run(uint32_t num, uint32_t packets)
+{
+    MolochSession_t *sessions = calloc(num, sizeof(MolochSession_t));
+    OldSession_t    *oldSessions = calloc(num, sizeof(OldSession_t));
+    uint32_t        *order = malloc(packets * sizeof(uint32_t));
+    uint64_t         sum;
+    uint32_t         i;
+    double           start;
+
+    if (!sessions || !oldSessions || !order) {
+        printf("%u: not enough memory\n", num);
+        exit(1);
+    }
+
+    BENCH_INIT(sessions, num);
+    BENCH_INIT(oldSessions, num);
+    for (i = 0; i < packets; i++) {
+        order[i] = random() % num;
+    }
+
+    start = bench_now();
+    sum = bench_packets_OldSession_t(oldSessions, order, packets);
+    double oldSecs = bench_now() - start;
+
+    start = bench_now();
+    sum -= bench_packets_MolochSession_t(sessions, order, packets);
+    double newSecs = bench_now() - start;
+
+    if (sum != 0)
+        printf("ERROR - layouts disagree\n");
+
+    printf("%9u sessions %9u packets: old layout %6.2f Mpps  new layout %6.2f Mpps  (%.2fx)\n",
+           num, packets, packets/oldSecs/1000000.0, packets/newSecs/1000000.0, oldSecs/newSecs);
+
+    free(order);
+    free(oldSessions);
+    free(sessions);
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    srandom(42);
+
+    bench_layout();
+    bench_run(argc > 1?atoi(argv[1]):1000000, argc > 2?atoi(argv[2]):20000000);
+    return 0;
+}
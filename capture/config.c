@@ -387,6 +387,8 @@ void moloch_config_load()
     config.timeouts[SESSION_UDP] = moloch_config_int(keyfile, "udpTimeout", 60, 1, 0xffff);
     config.timeouts[SESSION_TCP] = moloch_config_int(keyfile, "tcpTimeout", 60*8, 10, 0xffff);
     config.tcpSaveTimeout        = moloch_config_int(keyfile, "tcpSaveTimeout", 60*8, 10, 60*120);
+    config.tcpGapTimeout         = moloch_config_int(keyfile, "tcpGapTimeout", 5, 0, 0xffff);
+    config.maxTcpQueueBytes      = moloch_config_int(keyfile, "maxTcpQueueBytes", 1000000, 10000, 0x7fffffff);
     config.maxStreams            = moloch_config_int(keyfile, "maxStreams", 1500000, 1, 16777215);
     config.maxPackets            = moloch_config_int(keyfile, "maxPackets", 10000, 1, 1000000);
     config.maxPacketsInQueue     = moloch_config_int(keyfile, "maxPacketsInQueue", 200000, 10000, 5000000);
@@ -400,6 +402,24 @@ void moloch_config_load()
     config.maxFreeOutputBuffers  = moloch_config_int(keyfile, "maxFreeOutputBuffers", 50, 0, 0xffff);
     config.fragsTimeout          = moloch_config_int(keyfile, "fragsTimeout", 60*8, 60, 0xffff);
     config.maxFrags              = moloch_config_int(keyfile, "maxFrags", 50000, 1000, 0xffffff);
+    config.fragsThreads          = moloch_config_int(keyfile, "fragsThreads", 1, 1, MOLOCH_MAX_FRAGS_THREADS);
+    config.dedupWindowMs         = moloch_config_int(keyfile, "dedupWindowMs", 0, 0, 60000);
+    config.dedupSize             = moloch_config_int(keyfile, "dedupSize", 65536, 1024, 0x1000000);
+    config.bypassSize            = moloch_config_int(keyfile, "bypassSize", 65536, 0, 0x1000000);
+    config.rebalanceInterval     = moloch_config_int(keyfile, "rebalanceInterval", 0, 0, 3600);
+    config.maxSessionMemory      = (uint64_t)moloch_config_int(keyfile, "maxSessionMemory", 0, 0, 0x100000) * 1024 * 1024;
+    config.statsSample           = moloch_config_int(keyfile, "statsSample", 64, 0, 0x100000);
+    config.statsInterval         = moloch_config_int(keyfile, "statsInterval", 10, 1, 3600);
+    config.statsSocket           = moloch_config_str(keyfile, "statsSocket", NULL);
+    config.statsFile             = moloch_config_str(keyfile, "statsFile", NULL);
+    config.sessionCheckpoint     = moloch_config_str(keyfile, "sessionCheckpoint", NULL);
+
+    // Sampling is a mask check, so keep it a power of 2
+    if (config.statsSample & (config.statsSample - 1)) {
+        uint32_t sample;
+        for (sample = 1; sample < config.statsSample; sample <<= 1);
+        config.statsSample = sample;
+    }
 
     config.packetThreads         = moloch_config_int(keyfile, "packetThreads", 1, 1, MOLOCH_MAX_PACKET_THREADS);
 
@@ -643,4 +663,10 @@ void moloch_config_exit()
         g_strfreev(config.rootPlugins);
     if (config.smtpIpHeaders)
         g_strfreev(config.smtpIpHeaders);
+    if (config.statsSocket)
+        g_free(config.statsSocket);
+    if (config.statsFile)
+        g_free(config.statsFile);
+    if (config.sessionCheckpoint)
+        g_free(config.sessionCheckpoint);
 }
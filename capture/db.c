@@ -266,6 +266,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     unsigned char         *dataPtr;
     uint32_t               jsonSize;
     int                    pos;
+    MolochField_t         *field;
     gpointer               ikey;
 
     /* Let the plugins finish */
@@ -274,9 +275,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
     /* jsonSize is an estimate of how much space it will take to encode the session */
     jsonSize = 1100 + session->filePosArray->len*12 + 10*session->fileNumArray->len + 10*session->fileLenArray->len;
-    for (pos = 0; pos < session->maxFields; pos++) {
-        if (session->fields[pos]) {
-            jsonSize += session->fields[pos]->jsonSize;
+    for (pos = moloch_field_next(session, 0); pos != -1; pos = moloch_field_next(session, pos + 1)) {
+        if ((field = moloch_field_get(session, pos))) {
+            jsonSize += field->jsonSize;
         }
     }
 
@@ -561,9 +562,10 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     BSB_EXPORT_cstr(jbsb, "],");
 
     int inGroupNum = 0;
-    for (pos = 0; pos < session->maxFields; pos++) {
+    // Only the set fields, in pos order so each dbGroup is still together
+    for (pos = moloch_field_next(session, 0); pos != -1; pos = moloch_field_next(session, pos + 1)) {
         const int flags = config.fields[pos]->flags;
-        if (!session->fields[pos] || flags & MOLOCH_FIELD_FLAG_DISABLED)
+        if (!(field = moloch_field_get(session, pos)) || flags & MOLOCH_FIELD_FLAG_DISABLED)
             continue;
 
         const int freeField = final || ((flags & MOLOCH_FIELD_FLAG_LINKED_SESSIONS) == 0);
@@ -582,40 +584,40 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
         switch(config.fields[pos]->type) {
         case MOLOCH_FIELD_TYPE_INT:
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":%d", config.fields[pos]->dbField, session->fields[pos]->i);
+            BSB_EXPORT_sprintf(jbsb, "\"%s\":%d", config.fields[pos]->dbField, field->i);
             BSB_EXPORT_u08(jbsb, ',');
             break;
         case MOLOCH_FIELD_TYPE_STR:
             BSB_EXPORT_sprintf(jbsb, "\"%s\":", config.fields[pos]->dbField);
             moloch_db_js0n_str(&jbsb,
-                               (unsigned char *)session->fields[pos]->str,
+                               (unsigned char *)field->str,
                                flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
             BSB_EXPORT_u08(jbsb, ',');
             if (freeField) {
-                g_free(session->fields[pos]->str);
+                g_free(field->str);
             }
             break;
         case MOLOCH_FIELD_TYPE_STR_ARRAY:
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, session->fields[pos]->sarray->len);
+                BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, field->sarray->len);
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\":%d,", config.fields[pos]->dbField, session->fields[pos]->sarray->len);
+                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\":%d,", config.fields[pos]->dbField, field->sarray->len);
             }
             BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
-            for(i = 0; i < session->fields[pos]->sarray->len; i++) {
+            for(i = 0; i < field->sarray->len; i++) {
                 moloch_db_js0n_str(&jbsb,
-                                   g_ptr_array_index(session->fields[pos]->sarray, i),
+                                   g_ptr_array_index(field->sarray, i),
                                    flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
                 BSB_EXPORT_u08(jbsb, ',');
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
             if (freeField) {
-                g_ptr_array_free(session->fields[pos]->sarray, TRUE);
+                g_ptr_array_free(field->sarray, TRUE);
             }
             break;
         case MOLOCH_FIELD_TYPE_STR_HASH:
-            shash = session->fields[pos]->shash;
+            shash = field->shash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
                 BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(s_, *shash));
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
@@ -631,13 +633,12 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     g_free(hstring->str);
                     MOLOCH_TYPE_FREE(MolochString_t, hstring);
                 );
-                MOLOCH_TYPE_FREE(MolochStringHashStd_t, shash);
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         case MOLOCH_FIELD_TYPE_INT_HASH:
-            ihash = session->fields[pos]->ihash;
+            ihash = field->ihash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
                 BSB_EXPORT_sprintf(jbsb, "\"%scnt\": %d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
@@ -652,13 +653,12 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                 HASH_FORALL_POP_HEAD(i_, *ihash, hint,
                     MOLOCH_TYPE_FREE(MolochInt_t, hint);
                 );
-                MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         case MOLOCH_FIELD_TYPE_INT_GHASH:
-            ghash = session->fields[pos]->ghash;
+            ghash = field->ghash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
                 BSB_EXPORT_sprintf(jbsb, "\"%scnt\": %d,", config.fields[pos]->dbField, g_hash_table_size(ghash));
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
@@ -678,7 +678,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         case MOLOCH_FIELD_TYPE_IP: {
-            const int             value = session->fields[pos]->i;
+            const int             value = field->i;
             const MolochIpInfo_t *ii = ipTree?moloch_db_get_local_ip4(session, value):0;
             char                 *as = NULL;
             const char           *g = NULL;
@@ -741,7 +741,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             break;
         case MOLOCH_FIELD_TYPE_IP_HASH: {
             const int post = (flags & MOLOCH_FIELD_FLAG_IPPRE) == 0;
-            ihash = session->fields[pos]->ihash;
+            ihash = field->ihash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
                 BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
@@ -848,7 +848,6 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                 HASH_FORALL_POP_HEAD(i_, *ihash, hint,
                     MOLOCH_TYPE_FREE(MolochInt_t, hint);
                 );
-                MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
 
@@ -857,7 +856,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         }
         case MOLOCH_FIELD_TYPE_IP_GHASH: {
             const int post = (flags & MOLOCH_FIELD_FLAG_IPPRE) == 0;
-            ghash = session->fields[pos]->ghash;
+            ghash = field->ghash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
                 BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, g_hash_table_size(ghash));
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
@@ -976,7 +975,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             break;
         }
         case MOLOCH_FIELD_TYPE_CERTSINFO: {
-            MolochCertsInfoHashStd_t *cihash = session->fields[pos]->cihash;
+            MolochCertsInfoHashStd_t *cihash = field->cihash;
 
             BSB_EXPORT_sprintf(jbsb, "\"tlscnt\":%d,", HASH_COUNT(t_, *cihash));
             BSB_EXPORT_cstr(jbsb, "\"tls\":[");
@@ -1066,15 +1065,14 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                 BSB_EXPORT_u08(jbsb, '}');
                 BSB_EXPORT_u08(jbsb, ',');
             );
-            MOLOCH_TYPE_FREE(MolochCertsInfoHashStd_t, cihash);
 
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
         }
         } /* switch */
         if (freeField) {
-            MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
-            session->fields[pos] = 0;
+            MOLOCH_TYPE_FREE(MolochField_t, field);
+            moloch_field_clear(session, pos);
         }
     }
 
@@ -433,21 +433,75 @@ void moloch_field_exit()
     );
 }
 /******************************************************************************/
+/* Set the bit for pos and make room for it in fieldsValues, which lives in
+ * the session arena and doubles when full.  Returns where to put the field,
+ * a pos that was cleared keeps its old slot.
+ */
+LOCAL MolochField_t **moloch_field_slot(MolochSession_t *session, int pos)
+{
+    int num = moloch_field_index(session, pos);
+
+    if (session->fieldsBits[pos >> 6] & (1ULL << (pos & 63)))
+        return &session->fieldsValues[num];
+
+    if (session->fieldsNum == session->fieldsSize) {
+        int            size = session->fieldsSize?MIN(session->fieldsSize * 2, 255):4;
+        MolochField_t **values = moloch_session_arena_alloc(session, sizeof(MolochField_t *) * size);
+        if (session->fieldsNum)
+            memcpy(values, session->fieldsValues, sizeof(MolochField_t *) * session->fieldsNum);
+        session->fieldsValues = values;
+        session->fieldsSize = size;
+    }
+
+    if (num < session->fieldsNum)
+        memmove(session->fieldsValues + num + 1, session->fieldsValues + num, sizeof(MolochField_t *) * (session->fieldsNum - num));
+    session->fieldsBits[pos >> 6] |= 1ULL << (pos & 63);
+    session->fieldsNum++;
+    return &session->fieldsValues[num];
+}
+/******************************************************************************/
+/* The next set pos at or after pos, -1 when there are no more */
+int moloch_field_next(MolochSession_t *session, int pos)
+{
+    int word = pos >> 6;
+
+    if (word >= MOLOCH_FIELDS_WORDS)
+        return -1;
+
+    uint64_t bits = session->fieldsBits[word] & (~0ULL << (pos & 63));
+    while (!bits) {
+        if (++word >= MOLOCH_FIELDS_WORDS)
+            return -1;
+        bits = session->fieldsBits[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+/******************************************************************************/
+/* Forget a field's value without freeing it, the pos stays set but
+ * moloch_field_get returns NULL from now on.
+ */
+void moloch_field_clear(MolochSession_t *session, int pos)
+{
+    if (session->fieldsBits[pos >> 6] & (1ULL << (pos & 63)))
+        session->fieldsValues[moloch_field_index(session, pos)] = NULL;
+}
+/******************************************************************************/
 gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *string, int len, gboolean copy)
 {
     MolochField_t         *field;
     MolochStringHashStd_t *hash;
     MolochString_t        *hstring;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED)
         return FALSE;
 
-    if (!session->fields[pos]) {
+    if (!(field = moloch_field_get(session, pos))) {
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
-        session->fields[pos] = field;
+        *moloch_field_slot(session, pos) = field;
         if (len == -1)
             len = strlen(string);
         field->jsonSize = 6 + config.fields[pos]->dbFieldLen + 2*len;
+        moloch_session_mem_fields(session, sizeof(MolochField_t) + sizeof(MolochString_t) + len);
         if (copy)
             string = g_strndup(string, len);
         switch (config.fields[pos]->type) {
@@ -459,7 +513,7 @@ gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *
             g_ptr_array_add(field->sarray, (char*)string);
             return TRUE;
         case MOLOCH_FIELD_TYPE_STR_HASH:
-            hash = MOLOCH_TYPE_ALLOC(MolochStringHashStd_t);
+            hash = moloch_session_arena_alloc(session, sizeof(MolochStringHashStd_t));
             HASH_INIT(s_, *hash, moloch_string_hash, moloch_string_ncmp);
             field->shash = hash;
             hstring = MOLOCH_TYPE_ALLOC(MolochString_t);
@@ -477,8 +531,8 @@ gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *
     if (len == -1)
         len = strlen(string);
 
-    field = session->fields[pos];
     field->jsonSize += (6 + 2*len);
+    moloch_session_mem_fields(session, sizeof(MolochString_t) + len);
 
     if (field->jsonSize > 20000)
         session->midSave = 1;
@@ -500,6 +554,7 @@ gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *
 
         if (hstring) {
             field->jsonSize -= (6 + 2*len);
+            moloch_session_mem_fields(session, -(int)(sizeof(MolochString_t) + len));
             return FALSE;
         }
         hstring = MOLOCH_TYPE_ALLOC(MolochString_t);
@@ -526,13 +581,14 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
     MolochIntHashStd_t   *hash;
     MolochInt_t          *hint;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED)
         return FALSE;
 
-    if (!session->fields[pos]) {
+    if (!(field = moloch_field_get(session, pos))) {
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
-        session->fields[pos] = field;
+        *moloch_field_slot(session, pos) = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 10;
+        moloch_session_mem_fields(session, sizeof(MolochField_t) + sizeof(MolochInt_t));
         switch (config.fields[pos]->type) {
         case MOLOCH_FIELD_TYPE_IP:
             field->jsonSize += 100;
@@ -546,7 +602,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
         case MOLOCH_FIELD_TYPE_IP_HASH:
             field->jsonSize += 100;
         case MOLOCH_FIELD_TYPE_INT_HASH:
-            hash = MOLOCH_TYPE_ALLOC(MolochIntHashStd_t);
+            hash = moloch_session_arena_alloc(session, sizeof(MolochIntHashStd_t));
             HASH_INIT(i_, *hash, moloch_int_hash, moloch_int_cmp);
             field->ihash = hash;
             hint = MOLOCH_TYPE_ALLOC(MolochInt_t);
@@ -564,8 +620,8 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
         }
     }
 
-    field = session->fields[pos];
     field->jsonSize += (3 + 10);
+    moloch_session_mem_fields(session, sizeof(MolochInt_t));
     switch (config.fields[pos]->type) {
     case MOLOCH_FIELD_TYPE_IP:
         field->jsonSize += 100;
@@ -581,6 +637,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
         HASH_FIND_INT(i_, *(field->ihash), i, hint);
         if (hint) {
             field->jsonSize -= (3 + 10);
+            moloch_session_mem_fields(session, -(int)sizeof(MolochInt_t));
             return FALSE;
         }
         hint = MOLOCH_TYPE_ALLOC(MolochInt_t);
@@ -589,6 +646,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
     case MOLOCH_FIELD_TYPE_IP_GHASH:
         if (!g_hash_table_insert(field->ghash, (void *)(long)i, NULL)) {
             field->jsonSize -= 13;
+            moloch_session_mem_fields(session, -(int)sizeof(MolochInt_t));
             return FALSE;
         } else {
             field->jsonSize += 100;
@@ -597,6 +655,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
     case MOLOCH_FIELD_TYPE_INT_GHASH:
         if (!g_hash_table_insert(field->ghash, (void *)(long)i, NULL)) {
             field->jsonSize -= 13;
+            moloch_session_mem_fields(session, -(int)sizeof(MolochInt_t));
             return FALSE;
         }
         return TRUE;
@@ -662,13 +721,14 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
     MolochCertsInfoHashStd_t   *hash;
     MolochCertsInfo_t          *hci;
 
-    if (!session->fields[pos]) {
+    if (!(field = moloch_field_get(session, pos))) {
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
-        session->fields[pos] = field;
+        *moloch_field_slot(session, pos) = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + len;
+        moloch_session_mem_fields(session, sizeof(MolochField_t) + len);
         switch (config.fields[pos]->type) {
         case MOLOCH_FIELD_TYPE_CERTSINFO:
-            hash = MOLOCH_TYPE_ALLOC(MolochCertsInfoHashStd_t);
+            hash = moloch_session_arena_alloc(session, sizeof(MolochCertsInfoHashStd_t));
             HASH_INIT(t_, *hash, moloch_field_certsinfo_hash, moloch_field_certsinfo_cmp);
             field->cihash = hash;
             HASH_ADD(t_, *hash, certs, certs);
@@ -679,13 +739,13 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
         }
     }
 
-    field = session->fields[pos];
     switch (config.fields[pos]->type) {
     case MOLOCH_FIELD_TYPE_CERTSINFO:
         HASH_FIND(t_, *(field->cihash), certs, hci);
         if (hci)
             return FALSE;
         field->jsonSize += 3 + len;
+        moloch_session_mem_fields(session, len);
         HASH_ADD(t_, *(field->cihash), certs, certs);
         return TRUE;
     default:
@@ -705,8 +765,8 @@ void moloch_field_free(MolochSession_t *session)
     MolochCertsInfo_t        *hci;
     MolochCertsInfoHashStd_t *cihash;
 
-    for (pos = 0; pos < session->maxFields; pos++) {
-        if (!(field = session->fields[pos]))
+    for (pos = moloch_field_next(session, 0); pos != -1; pos = moloch_field_next(session, pos + 1)) {
+        if (!(field = moloch_field_get(session, pos)))
             continue;
 
         switch (config.fields[pos]->type) {
@@ -717,12 +777,11 @@ void moloch_field_free(MolochSession_t *session)
             g_ptr_array_free(field->sarray, TRUE);
             break;
         case MOLOCH_FIELD_TYPE_STR_HASH:
-            shash = session->fields[pos]->shash;
+            shash = field->shash;
             HASH_FORALL_POP_HEAD(s_, *shash, hstring,
                 g_free(hstring->str);
                 MOLOCH_TYPE_FREE(MolochString_t, hstring);
             );
-            MOLOCH_TYPE_FREE(MolochStringHashStd_t, shash);
             break;
         case MOLOCH_FIELD_TYPE_INT:
             break;
@@ -731,28 +790,183 @@ void moloch_field_free(MolochSession_t *session)
             break;
         case MOLOCH_FIELD_TYPE_IP_HASH:
         case MOLOCH_FIELD_TYPE_INT_HASH:
-            ihash = session->fields[pos]->ihash;
+            ihash = field->ihash;
             HASH_FORALL_POP_HEAD(i_, *ihash, hint,
                 MOLOCH_TYPE_FREE(MolochInt_t, hint);
             );
-            MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
             break;
         case MOLOCH_FIELD_TYPE_IP_GHASH:
         case MOLOCH_FIELD_TYPE_INT_GHASH:
-            g_hash_table_destroy(session->fields[pos]->ghash);
+            g_hash_table_destroy(field->ghash);
             break;
         case MOLOCH_FIELD_TYPE_CERTSINFO:
-            cihash = session->fields[pos]->cihash;
+            cihash = field->cihash;
             HASH_FORALL_POP_HEAD(t_, *cihash, hci,
                 moloch_field_certsinfo_free(hci);
             );
-            MOLOCH_TYPE_FREE(MolochCertsInfoHashStd_t, cihash);
             break;
         } // switch
-        MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
+        MOLOCH_TYPE_FREE(MolochField_t, field);
+    }
+    // fieldsValues and the hash heads live in the session arena
+    memset(session->fieldsBits, 0, sizeof(session->fieldsBits));
+    session->fieldsValues = 0;
+    session->fieldsNum = session->fieldsSize = 0;
+}
+/******************************************************************************/
+/* Fields go in a session checkpoint by db name, since positions can change
+ * between runs.  Each is the name, type and the values for that type.
+ * Certs aren't supported, FALSE tells the caller to save the session.
+ */
+gboolean moloch_field_checkpoint(MolochSession_t *session, BSB *bsb)
+{
+    MolochField_t  *field;
+    MolochString_t *hstring;
+    MolochInt_t    *hint;
+    GHashTableIter  iter;
+    gpointer        ikey;
+    int             pos, num = 0;
+    uint32_t        i;
+
+    unsigned char *numPtr = BSB_WORK_PTR(*bsb);
+    BSB_EXPORT_u16(*bsb, 0);
+
+    for (pos = moloch_field_next(session, 0); pos != -1; pos = moloch_field_next(session, pos + 1)) {
+        if (!(field = moloch_field_get(session, pos)))
+            continue;
+
+        const int type = config.fields[pos]->type;
+        if (type == MOLOCH_FIELD_TYPE_CERTSINFO)
+            return FALSE;
+
+        BSB_EXPORT_u08(*bsb, config.fields[pos]->dbFieldLen);
+        BSB_EXPORT_ptr(*bsb, config.fields[pos]->dbField, config.fields[pos]->dbFieldLen);
+        BSB_EXPORT_u08(*bsb, type);
+
+        switch (type) {
+        case MOLOCH_FIELD_TYPE_INT:
+        case MOLOCH_FIELD_TYPE_IP:
+            BSB_EXPORT_u32(*bsb, field->i);
+            break;
+        case MOLOCH_FIELD_TYPE_STR:
+            i = strlen(field->str);
+            BSB_EXPORT_u32(*bsb, 1);
+            BSB_EXPORT_u32(*bsb, i);
+            BSB_EXPORT_ptr(*bsb, field->str, i);
+            break;
+        case MOLOCH_FIELD_TYPE_STR_ARRAY:
+            BSB_EXPORT_u32(*bsb, field->sarray->len);
+            for (i = 0; i < field->sarray->len; i++) {
+                const char *str = g_ptr_array_index(field->sarray, i);
+                uint32_t    len = strlen(str);
+                BSB_EXPORT_u32(*bsb, len);
+                BSB_EXPORT_ptr(*bsb, str, len);
+            }
+            break;
+        case MOLOCH_FIELD_TYPE_STR_HASH:
+            BSB_EXPORT_u32(*bsb, HASH_COUNT(s_, *field->shash));
+            HASH_FORALL(s_, *field->shash, hstring,
+                BSB_EXPORT_u32(*bsb, hstring->len);
+                BSB_EXPORT_ptr(*bsb, hstring->str, hstring->len);
+            );
+            break;
+        case MOLOCH_FIELD_TYPE_INT_ARRAY:
+            BSB_EXPORT_u32(*bsb, field->iarray->len);
+            for (i = 0; i < field->iarray->len; i++) {
+                BSB_EXPORT_u32(*bsb, g_array_index(field->iarray, uint32_t, i));
+            }
+            break;
+        case MOLOCH_FIELD_TYPE_INT_HASH:
+        case MOLOCH_FIELD_TYPE_IP_HASH:
+            BSB_EXPORT_u32(*bsb, HASH_COUNT(i_, *field->ihash));
+            HASH_FORALL(i_, *field->ihash, hint,
+                BSB_EXPORT_u32(*bsb, hint->i_hash);
+            );
+            break;
+        case MOLOCH_FIELD_TYPE_INT_GHASH:
+        case MOLOCH_FIELD_TYPE_IP_GHASH:
+            BSB_EXPORT_u32(*bsb, g_hash_table_size(field->ghash));
+            g_hash_table_iter_init(&iter, field->ghash);
+            while (g_hash_table_iter_next(&iter, &ikey, NULL)) {
+                BSB_EXPORT_u32(*bsb, (uint32_t)(long)ikey);
+            }
+            break;
+        default:
+            return FALSE;
+        }
+        num++;
+    }
+
+    if (BSB_IS_ERROR(*bsb))
+        return FALSE;
+
+    numPtr[0] = num >> 8;
+    numPtr[1] = num;
+    return TRUE;
+}
+/******************************************************************************/
+/* Values are added back with the normal add functions, fields that no longer
+ * exist or changed type are skipped.
+ */
+void moloch_field_restore(MolochSession_t *session, BSB *bsb)
+{
+    int      num = 0, f;
+    uint32_t count, i, value, len;
+
+    BSB_IMPORT_u16(*bsb, num);
+    for (f = 0; f < num && BSB_NOT_ERROR(*bsb); f++) {
+        char           dbField[256];
+        int            dbFieldLen = 0, type = 0;
+        unsigned char *str;
+
+        BSB_IMPORT_u08(*bsb, dbFieldLen);
+        BSB_IMPORT_ptr(*bsb, str, dbFieldLen);
+        BSB_IMPORT_u08(*bsb, type);
+        if (BSB_IS_ERROR(*bsb))
+            return;
+
+        memcpy(dbField, str, dbFieldLen);
+        dbField[dbFieldLen] = 0;
+
+        int pos = moloch_field_by_db(dbField);
+        if (pos != -1 && config.fields[pos]->type != type)
+            pos = -1;
+
+        switch (type) {
+        case MOLOCH_FIELD_TYPE_INT:
+        case MOLOCH_FIELD_TYPE_IP:
+            BSB_IMPORT_u32(*bsb, value);
+            if (pos != -1 && BSB_NOT_ERROR(*bsb))
+                moloch_field_int_add(pos, session, value);
+            break;
+        case MOLOCH_FIELD_TYPE_STR:
+        case MOLOCH_FIELD_TYPE_STR_ARRAY:
+        case MOLOCH_FIELD_TYPE_STR_HASH:
+            BSB_IMPORT_u32(*bsb, count);
+            for (i = 0; i < count && BSB_NOT_ERROR(*bsb); i++) {
+                BSB_IMPORT_u32(*bsb, len);
+                BSB_IMPORT_ptr(*bsb, str, len);
+                if (pos != -1 && BSB_NOT_ERROR(*bsb))
+                    moloch_field_string_add(pos, session, (char *)str, len, TRUE);
+            }
+            break;
+        case MOLOCH_FIELD_TYPE_INT_ARRAY:
+        case MOLOCH_FIELD_TYPE_INT_HASH:
+        case MOLOCH_FIELD_TYPE_IP_HASH:
+        case MOLOCH_FIELD_TYPE_INT_GHASH:
+        case MOLOCH_FIELD_TYPE_IP_GHASH:
+            BSB_IMPORT_u32(*bsb, count);
+            for (i = 0; i < count && BSB_NOT_ERROR(*bsb); i++) {
+                BSB_IMPORT_u32(*bsb, value);
+                if (pos != -1 && BSB_NOT_ERROR(*bsb))
+                    moloch_field_int_add(pos, session, value);
+            }
+            break;
+        default:
+            // Don't know how long it is, nothing after it can be trusted
+            return;
+        }
     }
-    MOLOCH_SIZE_FREE(fields, session->fields);
-    session->fields = 0;
 }
 /******************************************************************************/
 void moloch_field_certsinfo_free (MolochCertsInfo_t *certs)
@@ -788,11 +1002,9 @@ int moloch_field_count(int pos, MolochSession_t *session)
 {
     MolochField_t         *field;
 
-    if (!session->fields[pos])
+    if (!(field = moloch_field_get(session, pos)))
         return 0;
 
-    field = session->fields[pos];
-
     switch (config.fields[pos]->type) {
     case MOLOCH_FIELD_TYPE_INT:
     case MOLOCH_FIELD_TYPE_STR:
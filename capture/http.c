@@ -66,7 +66,7 @@ typedef struct molochhttpconn_t {
     uint32_t                 h_hash;
     short                    h_bucket;
 
-    char                     sessionId[MOLOCH_SESSIONID_LEN];
+    MolochSessionId_t        sessionId;
 } MolochHttpConn_t;
 
 typedef struct molochhttpconnhead_t {
@@ -114,7 +114,7 @@ int moloch_http_conn_cmp(const void *keyv, const void *elementv)
 {
     MolochHttpConn_t *conn = (MolochHttpConn_t *)elementv;
 
-    return memcmp(keyv, conn->sessionId, MIN(((uint8_t *)keyv)[0], conn->sessionId[0])) == 0;
+    return moloch_session_id_cmp(keyv, &conn->sessionId);
 }
 /******************************************************************************/
 static size_t moloch_http_curl_write_callback(void *contents, size_t size, size_t nmemb, void *requestP)
@@ -389,8 +389,8 @@ static gboolean moloch_http_curl_watch_open_callback(int fd, GIOCondition condit
     if (rc != 0)
         return FALSE;
 
-    char sessionId[MOLOCH_SESSIONID_LEN];
-    moloch_session_id(sessionId, localAddress.sin_addr.s_addr, localAddress.sin_port,
+    MolochSessionId_t sessionId;
+    moloch_session_id(&sessionId, localAddress.sin_addr.s_addr, localAddress.sin_port,
                       remoteAddress.sin_addr.s_addr, remoteAddress.sin_port);
 
     LOG("Connected %d/%d - %s   %d->%s:%d - fd:%d", 
@@ -406,16 +406,16 @@ static gboolean moloch_http_curl_watch_open_callback(int fd, GIOCondition condit
 
     MOLOCH_LOCK(connections);
     BIT_SET(fd, connectionsSet);
-    HASH_FIND(h_, connections, sessionId, conn);
+    HASH_FIND(h_, connections, &sessionId, conn);
     if (!conn) {
         conn = MOLOCH_TYPE_ALLOC0(MolochHttpConn_t);
 
-        HASH_ADD(h_, connections, sessionId, conn);
-        memcpy(&conn->sessionId, sessionId, sessionId[0]);
+        conn->sessionId = sessionId;
+        HASH_ADD(h_, connections, &conn->sessionId, conn);
         server->connections++;
     } else {
         char buf[1000];
-        LOG("ERROR - Already added %x %s", condition, moloch_session_id_string(sessionId, buf));
+        LOG("ERROR - Already added %x %s", condition, moloch_session_id_string(&sessionId, buf));
     }
     MOLOCH_UNLOCK(connections);
 
@@ -450,16 +450,16 @@ int moloch_http_curl_close_callback(void *serverV, curl_socket_t fd)
     addressLength = sizeof(remoteAddress);
     getpeername(fd, (struct sockaddr*)&remoteAddress, &addressLength);
 
-    char sessionId[MOLOCH_SESSIONID_LEN];
+    MolochSessionId_t sessionId;
 
-    moloch_session_id(sessionId, localAddress.sin_addr.s_addr, localAddress.sin_port,
+    moloch_session_id(&sessionId, localAddress.sin_addr.s_addr, localAddress.sin_port,
                       remoteAddress.sin_addr.s_addr, remoteAddress.sin_port);
 
     MolochHttpConn_t *conn;
     BIT_CLR(fd, connectionsSet);
 
     MOLOCH_LOCK(connections);
-    HASH_FIND(h_, connections, sessionId, conn);
+    HASH_FIND(h_, connections, &sessionId, conn);
     if (conn) {
         HASH_REMOVE(h_, connections, conn);
         MOLOCH_TYPE_FREE(MolochHttpConn_t, conn);
@@ -672,7 +672,7 @@ void moloch_http_free_server(void *serverV)
     MOLOCH_TYPE_FREE(MolochHttpServer_t, server);
 }
 /******************************************************************************/
-gboolean moloch_http_is_moloch(uint32_t hash, char *key)
+gboolean moloch_http_is_moloch(uint32_t hash, MolochSessionId_t *key)
 {
     MolochHttpConn_t *conn;
 
@@ -482,18 +482,33 @@ void moloch_quit()
  */
 gboolean moloch_ready_gfunc (gpointer UNUSED(user_data))
 {
+    static int restoring = 0;
+
     if (moloch_db_tags_loading() || moloch_http_queue_length(esServer))
         return TRUE;
 
+    // Checkpointed sessions have to be back before their packets show up
+    if (!restoring) {
+        restoring = 1;
+        moloch_session_restore();
+    }
+    if (moloch_session_restore_outstanding())
+        return TRUE;
+
     if (config.debug)
         LOG("maxField = %d", config.maxField);
 
     if (config.pcapReadOffline) {
-        if (config.dryRun || !config.copyPcap) {
+        char *method = moloch_config_str(NULL, "pcapWriteMethod", "simple");
+        if (config.dryRun && strcmp(method, "null") == 0) {
+            // Benchmarks don't want even the inplace bookkeeping
+            moloch_writers_start("null");
+        } else if (config.dryRun || !config.copyPcap) {
             moloch_writers_start("inplace");
         } else {
             moloch_writers_start(NULL);
         }
+        g_free(method);
 
     } else {
         if (config.dryRun) {
@@ -601,6 +616,7 @@ int main(int argc, char **argv)
     moloch_yara_init();
     moloch_parsers_init();
     moloch_session_init();
+    moloch_stats_init();
     moloch_plugins_load(config.plugins);
     g_timeout_add(1, moloch_ready_gfunc, 0);
 
@@ -613,6 +629,8 @@ int main(int argc, char **argv)
     moloch_db_exit();
     moloch_http_exit();
     moloch_field_exit();
+    moloch_stats_exit();
+    moloch_slab_exit();
     moloch_config_exit();
 
     g_main_loop_unref(mainLoop);
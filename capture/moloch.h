@@ -37,9 +37,10 @@
 #define UNUSED(x) x __attribute((unused))
 
 
-#define MOLOCH_API_VERSION 16
+#define MOLOCH_API_VERSION 17
 
-#define MOLOCH_SESSIONID_LEN 37
+#define MOLOCH_SESSIONID4_LEN 16
+#define MOLOCH_SESSIONID6_LEN 40
 
 #define MOLOCH_V6_TO_V4(_addr) (((uint32_t *)(_addr).s6_addr)[3])
 
@@ -225,6 +226,9 @@ typedef struct {
 #define MOLOCH_COND_SIGNAL(var)         pthread_cond_signal(&var##_cond)
 
 #define MOLOCH_MAX_PACKET_THREADS 24
+#define MOLOCH_MAX_READER_THREADS 32
+#define MOLOCH_MAX_READER_POS     16
+#define MOLOCH_MAX_FRAGS_THREADS 8
 
 #ifndef LOCAL
 #define LOCAL static
@@ -309,6 +313,8 @@ typedef struct moloch_config {
     uint32_t  maxFileTimeM;
     uint32_t  timeouts[SESSION_MAX];
     uint32_t  tcpSaveTimeout;
+    uint32_t  tcpGapTimeout;
+    uint32_t  maxTcpQueueBytes;
     uint32_t  maxStreams;
     uint32_t  maxPackets;
     uint32_t  maxPacketsInQueue;
@@ -323,6 +329,17 @@ typedef struct moloch_config {
     uint32_t  maxFreeOutputBuffers;
     uint32_t  fragsTimeout;
     uint32_t  maxFrags;
+    uint32_t  dedupWindowMs;
+    uint32_t  dedupSize;
+    uint32_t  bypassSize;
+    uint32_t  rebalanceInterval;
+    uint64_t  maxSessionMemory;
+    int       fragsThreads;
+    uint32_t  statsSample;
+    uint32_t  statsInterval;
+    char     *statsSocket;
+    char     *statsFile;
+    char     *sessionCheckpoint;
 
     int       packetThreads;
 
@@ -357,12 +374,16 @@ struct moloch_session;
 typedef int  (* MolochParserFunc) (struct moloch_session *session, void *uw, const unsigned char *data, int remaining, int which);
 typedef void (* MolochParserFreeFunc) (struct moloch_session *session, void *uw);
 typedef void (* MolochParserSaveFunc) (struct moloch_session *session, void *uw, int final);
+typedef int  (* MolochParserCheckpointFunc) (struct moloch_session *session, void *uw, BSB *bsb);
+typedef void (* MolochParserRestoreFunc) (struct moloch_session *session, BSB *bsb);
 
 typedef struct {
     MolochParserFunc      parserFunc;
     void                 *uw;
     MolochParserFreeFunc  parserFreeFunc;
     MolochParserSaveFunc  parserSaveFunc;
+    MolochParserCheckpointFunc parserCheckpointFunc;
+    const char           *parserName;     // finds the MolochParserRestoreFunc after a restart
 
 } MolochParserInfo_t;
 
@@ -376,20 +397,33 @@ typedef struct molochpacket_t
     uint64_t       writerFilePos;  // where in output file
     uint64_t       readerFilePos;  // where in input file
     char          *readerName;     // file name reader used
+    void          *readerData;     // reader memory a borrowed pkt points into
     uint32_t       writerFileNum;  // file number in db
+    uint32_t       hash;           // moloch_session_hash of the session id
+    uint64_t       statsTsc;       // when queued, if sampled for stats
     uint16_t       pktlen;         // length of packet
     uint16_t       payloadLen;     // length of ip payload
     uint16_t       payloadOffset;  // offset to ip payload from start
-    uint8_t        ipOffset;       // offset to ip header from start
-    uint8_t        vpnIpOffset;    // offset to vpn ip header from start
+    uint16_t       ipOffset;       // offset to ip header from start
+    uint16_t       vpnIpOffset;    // offset to outer ip header of the tunnel from start
     uint8_t        protocol;       // ip protocol
+    uint8_t        readerPos;      // which reader thread, keeps files read at the same time apart, < MOLOCH_MAX_READER_POS
+    uint8_t        tunnel;         // MOLOCH_PACKET_TUNNEL_* decapsulated to get to ipOffset
     uint8_t        direction:1;    // direction of packet
     uint8_t        ses:3;          // type of session
     uint8_t        v6:1;           // v6 or not
-    uint8_t        copied:1;       // don't need to copy
+    uint8_t        copied:1;       // pkt is a packet buffer we own
+    uint8_t        borrowed:1;     // pkt is reader memory, given back with moloch_reader_release
     uint8_t        wasfrag:1;      // was a fragment
 } MolochPacket_t;
 
+#define MOLOCH_PACKET_TUNNEL_GRE    0x01
+#define MOLOCH_PACKET_TUNNEL_VXLAN  0x02
+#define MOLOCH_PACKET_TUNNEL_GENEVE 0x04
+#define MOLOCH_PACKET_TUNNEL_GTP    0x08
+#define MOLOCH_PACKET_TUNNEL_MPLS   0x10
+#define MOLOCH_PACKET_TUNNEL_ERSPAN 0x20
+
 typedef struct
 {
     struct molochpacket_t   *packet_next, *packet_prev;
@@ -397,103 +431,173 @@ typedef struct
     MOLOCH_LOCK_EXTERN(lock);
     MOLOCH_COND_EXTERN(lock);
 } MolochPacketHead_t;
+
+typedef struct
+{
+    MolochPacketHead_t       packetQ[MOLOCH_MAX_PACKET_THREADS];
+    int                      count;
+} MolochPacketBatch_t;
 /******************************************************************************/
 typedef struct moloch_tcp_data {
-    struct moloch_tcp_data *td_next, *td_prev;
-
-    MolochPacket_t *packet;
+    uint8_t        *pkt;            // packet buffer, holds a reference
     uint32_t        seq;
     uint32_t        ack;
+    uint32_t        arrived;        // orders segments of the two directions
     uint16_t        len;
     uint16_t        dataOffset;
 } MolochTcpData_t;
 
+/* Segments waiting for an earlier hole to fill, one ring per direction sorted
+ * by seq so inserting is a binary search instead of a list walk and taking
+ * the head doesn't move the rest
+ */
+typedef struct {
+    MolochTcpData_t **td;
+    uint32_t          head;         // index in td of the first segment
+    uint32_t          num;
+    uint32_t          size;         // power of 2
+    uint32_t          gapSecs;      // when we started waiting on the hole at the head
+} MolochTcpDataQ_t;
+
+#define MOLOCH_TCP_DATA_Q(q, i) ((q)->td[((q)->head + (i)) & ((q)->size - 1)])
+
 typedef struct {
-    struct moloch_tcp_data *td_next, *td_prev;
-    int td_count;
+    MolochTcpDataQ_t  q[2];
+    uint32_t          bytes;        // payload bytes held in both directions
+    uint32_t          arrived;
 } MolochTcpDataHead_t;
 
 #define MOLOCH_TCP_STATE_FIN     1
 #define MOLOCH_TCP_STATE_FIN_ACK 2
 
+/******************************************************************************/
+/*
+ * Binary session key, the lower address/port is always first so both
+ * directions match.  Hashed and compared as 64 bit words, v4 keys are the
+ * first MOLOCH_SESSIONID4_LEN bytes, v6 keys all MOLOCH_SESSIONID6_LEN.
+ */
+typedef union {
+    uint64_t               w[MOLOCH_SESSIONID6_LEN/8];
+    struct {
+        uint8_t            len;
+        uint8_t            pad[3];         // pad[0] is the packet's readerPos
+        uint16_t           port1;
+        uint16_t           port2;
+        union {
+            struct {
+                uint32_t   addr1;
+                uint32_t   addr2;
+            } v4;
+            struct {
+                uint8_t    addr1[16];
+                uint8_t    addr2[16];
+            } v6;
+        };
+    };
+} MolochSessionId_t;
+
+static inline int moloch_session_id_cmp(const MolochSessionId_t *a, const MolochSessionId_t *b)
+{
+    // The first word has the len so v4 and v6 keys never match
+    if (a->w[0] != b->w[0] || a->w[1] != b->w[1])
+        return 0;
+    if (a->len == MOLOCH_SESSIONID4_LEN)
+        return 1;
+    return a->w[2] == b->w[2] && a->w[3] == b->w[3] && a->w[4] == b->w[4];
+}
+
 /******************************************************************************/
 /*
  * SPI Data Storage
  */
+
+/* Sessions only set a few of the fields, so a bit per pos says which are set
+ * and fieldsValues only has those, the index is the number of set bits
+ * before pos.
+ */
+#define MOLOCH_FIELDS_WORDS 4
+
 typedef struct moloch_session {
+    /* Hot, looked at or updated for most packets.  The list linkages must
+     * stay first to match MolochSessionHead_t.  Keep the hot part within
+     * the first five cache lines, session.c checks at compile time and
+     * bench/session-layout prints the layout.
+     */
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
+    struct moloch_session *tw_next, *tw_prev;
     uint32_t               h_hash;
+    MolochSessionId_t      sessionId;
 
-    char                   sessionId[MOLOCH_SESSIONID_LEN];
-
-    MolochField_t        **fields;
+    uint8_t                protocol;
+    uint8_t                thread;
+    uint8_t                tcp_flags;
+    uint8_t                ip_tos;
+    uint16_t               haveTcpSession:1;
+    uint16_t               needSave:1;
+    uint16_t               stopSPI:1;
+    uint16_t               closingQ:1;
+    uint16_t               stopTCP:1;
+    uint16_t               ses:3;
+    uint16_t               midSave:1;
+    uint16_t               bypassed:1;
+    uint16_t               port1;
+    uint16_t               port2;
+    uint16_t               stopSaving;
+    char                   tcpState[2];
+    uint8_t                parserNum;
+    uint8_t                consumed[2];
+    uint8_t                firstBytesLen[2];
+    uint8_t                minSaving;
+    uint32_t               packets[2];
+    uint32_t               tcpSeq[2];
 
-    void                  **pluginData;
+    struct in6_addr        addr1;
+    struct in6_addr        addr2;
+    struct timeval         lastPacket;
+    uint64_t               bytes[2];
 
+    uint64_t               databytes[2];
+    uint64_t               totalDatabytes[2];
+    MolochTcpDataHead_t   *tcpData;
     MolochParserInfo_t    *parserInfo;
 
-    MolochTcpDataHead_t   tcpData;
-    uint32_t              tcpSeq[2];
-    char                  tcpState[2];
-
     GArray                *filePosArray;
     GArray                *fileLenArray;
     GArray                *fileNumArray;
-    char                  *rootId;
-
-    struct timeval         firstPacket;
-    struct timeval         lastPacket;
-    char                   firstBytes[2][8];
-
-    uint64_t               bytes[2];
-    uint64_t               databytes[2];
-    uint64_t               totalDatabytes[2];
-
-
     uint32_t               lastFileNum;
-    uint32_t               saveTime;
-    struct in6_addr        addr1;
-    struct in6_addr        addr2;
-    uint32_t               packets[2];
 
-    uint16_t               port1;
-    uint16_t               port2;
+    /* Cold, only needed when adding fields, timing out or saving */
+    uint32_t               saveTime;
+    uint32_t               twExpire;
+    uint16_t               twSlot;
     uint16_t               offsets[2];
     uint16_t               outstandingQueries;
     uint16_t               segments;
-    uint16_t               stopSaving;
-
-    uint8_t                consumed[2];
-    uint8_t                protocol;
-    uint8_t                firstBytesLen[2];
-    uint8_t                ip_tos;
-    uint8_t                tcp_flags;
     uint8_t                parserLen;
-    uint8_t                parserNum;
-    uint8_t                minSaving;
-    uint8_t                maxFields;
-    uint8_t                thread;
+    uint8_t                fieldsNum;
+    uint8_t                fieldsSize;
+    uint32_t               bypassSlot;
+    uint32_t               memSize;        // estimate of everything below, including memFields
+    uint32_t               memFields;
 
-    uint16_t               haveTcpSession:1;
-    uint16_t               needSave:1;
-    uint16_t               stopSPI:1;
-    uint16_t               closingQ:1;
-    uint16_t               stopTCP:1;
-    uint16_t               ses:3;
-    uint16_t               midSave:1;
+    struct timeval         firstPacket;
+    char                   firstBytes[2][8];
+    char                  *rootId;
+
+    uint64_t               fieldsBits[MOLOCH_FIELDS_WORDS];
+    MolochField_t        **fieldsValues;   // one per set bit, in pos order
+    void                 **pluginData;
+    struct moloch_session_arena *arena;
 } MolochSession_t;
 
 typedef struct moloch_session_head {
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
+    struct moloch_session *tw_next, *tw_prev;
     int                    tcp_count;
     int                    q_count;
-    int                    h_count;
+    int                    tw_count;
 } MolochSessionHead_t;
 
 
@@ -508,9 +612,18 @@ typedef struct moloch_session_head {
 #define MOLOCH_SIZE_ALLOC0(name, s) calloc(s, 1)
 #define MOLOCH_SIZE_FREE(name, mem) free(mem)
 #else
-#define MOLOCH_TYPE_ALLOC(type) (type *)(g_slice_alloc(sizeof(type)))
-#define MOLOCH_TYPE_ALLOC0(type) (type *)(g_slice_alloc0(sizeof(type)))
-#define MOLOCH_TYPE_FREE(type,mem) g_slice_free1(sizeof(type),mem)
+/* The types every session creates lots of come from slab.c, the rest from g_slice */
+#define MOLOCH_SLAB_IS(type, t, slab, other) __builtin_choose_expr(__builtin_types_compatible_p(type, t), slab, other)
+#define MOLOCH_SLAB_OF(type) \
+    MOLOCH_SLAB_IS(type, MolochSession_t, MOLOCH_SLAB_SESSION, \
+    MOLOCH_SLAB_IS(type, MolochTcpData_t, MOLOCH_SLAB_TCPDATA, \
+    MOLOCH_SLAB_IS(type, MolochString_t,  MOLOCH_SLAB_STRING, \
+    MOLOCH_SLAB_IS(type, MolochInt_t,     MOLOCH_SLAB_INT, \
+    MOLOCH_SLAB_IS(type, MolochField_t,   MOLOCH_SLAB_FIELD, -1)))))
+
+#define MOLOCH_TYPE_ALLOC(type) (type *)(MOLOCH_SLAB_OF(type) >= 0?moloch_slab_alloc(MOLOCH_SLAB_OF(type), 0):g_slice_alloc(sizeof(type)))
+#define MOLOCH_TYPE_ALLOC0(type) (type *)(MOLOCH_SLAB_OF(type) >= 0?moloch_slab_alloc(MOLOCH_SLAB_OF(type), 1):g_slice_alloc0(sizeof(type)))
+#define MOLOCH_TYPE_FREE(type,mem) (MOLOCH_SLAB_OF(type) >= 0?moloch_slab_free(MOLOCH_SLAB_OF(type), mem):g_slice_free1(sizeof(type),mem))
 
 void *moloch_size_alloc(int size, int zero);
 int   moloch_size_free(void *mem);
@@ -568,6 +681,101 @@ extern MOLOCH_LOCK_EXTERN(LOG);
 } while(0) /* no trailing ; */
 
 
+/******************************************************************************/
+/*
+ * stats.c
+ */
+enum {
+    MOLOCH_STATS_QUEUE,        // moloch_packet_ip until the packet thread dequeues it
+    MOLOCH_STATS_PARSE,        // reader side link and ip parsing
+    MOLOCH_STATS_SESSION,      // session lookup or create
+    MOLOCH_STATS_PARSERS,      // tcp reassembly and parser dispatch
+    MOLOCH_STATS_WRITER,       // handing the packet to the writer
+    MOLOCH_STATS_DB,           // building the session json
+    MOLOCH_STATS_MAX
+};
+
+enum {
+    MOLOCH_STATS_PACKETS,
+    MOLOCH_STATS_BYTES,
+    MOLOCH_STATS_SESSIONS,
+    MOLOCH_STATS_SAVES,
+    MOLOCH_STATS_DEDUPS,
+    MOLOCH_STATS_BYPASSED,
+    MOLOCH_STATS_EVICT_STREAMS,
+    MOLOCH_STATS_EVICT_OLDEST,
+    MOLOCH_STATS_EVICT_LARGEST,
+    MOLOCH_STATS_EVICT_MIDSAVE,
+    MOLOCH_STATS_COUNTERS
+};
+
+#define MOLOCH_STATS_BUCKETS 256
+
+typedef struct {
+    char                   name[16];
+    uint64_t               counters[MOLOCH_STATS_COUNTERS];
+    uint64_t               histCount[MOLOCH_STATS_MAX];
+    uint64_t               histSum[MOLOCH_STATS_MAX];
+    uint64_t               histMax[MOLOCH_STATS_MAX];
+    uint64_t               hist[MOLOCH_STATS_MAX][MOLOCH_STATS_BUCKETS];
+} MolochStatsThread_t;
+
+extern __thread MolochStatsThread_t *statsThread;
+extern __thread uint32_t             statsSampleCount;
+
+static inline uint64_t moloch_stats_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+MolochStatsThread_t *moloch_stats_thread_init();
+void     moloch_stats_record(int stage, uint64_t start);
+GString *moloch_stats_json();
+void     moloch_stats_init();
+void     moloch_stats_exit();
+
+/* Returns a tsc start value for one of every statsSample calls, otherwise 0 */
+#define MOLOCH_STATS_SAMPLE() \
+    (likely(config.statsSample == 0 || (++statsSampleCount & (config.statsSample - 1)))?0:moloch_stats_tsc())
+
+#define MOLOCH_STATS_RECORD(stage, start) \
+    do { \
+        if (unlikely(start)) \
+            moloch_stats_record(stage, start); \
+    } while (0)
+
+#define MOLOCH_STATS_COUNT(counter, value) \
+    do { \
+        if (unlikely(!statsThread)) \
+            moloch_stats_thread_init(); \
+        statsThread->counters[counter] += (value); \
+    } while (0)
+
+/******************************************************************************/
+/*
+ * slab.c
+ */
+enum {
+    MOLOCH_SLAB_SESSION,
+    MOLOCH_SLAB_TCPDATA,
+    MOLOCH_SLAB_STRING,
+    MOLOCH_SLAB_INT,
+    MOLOCH_SLAB_FIELD,
+    MOLOCH_SLAB_MAX
+};
+
+void *moloch_slab_alloc(int slab, int zero);
+void  moloch_slab_free(int slab, void *mem);
+void  moloch_slab_exit();
+
 /******************************************************************************/
 /*
  * main.c
@@ -660,6 +868,10 @@ void moloch_parsers_magic(MolochSession_t *session, int field, const char *data,
 typedef void (* MolochClassifyFunc) (MolochSession_t *session, const unsigned char *data, int remaining, int which, void *uw);
 
 void  moloch_parsers_unregister(MolochSession_t *session, void *uw);
+void  moloch_parsers_checkpoint_register(MolochSession_t *session, void *uw, const char *name, MolochParserCheckpointFunc func);
+void  moloch_parsers_restore_register(const char *name, MolochParserRestoreFunc func);
+gboolean moloch_parsers_checkpoint(MolochSession_t *session, BSB *bsb);
+void  moloch_parsers_restore(MolochSession_t *session, BSB *bsb);
 void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc);
 #define moloch_parsers_register(session, func, uw, ffunc) moloch_parsers_register2(session, func, uw, ffunc, NULL)
 
@@ -699,7 +911,7 @@ void *moloch_http_create_server(const char *hostnames, int defaultPort, int maxC
 void moloch_http_set_header_cb(void *server, MolochHttpHeader_cb cb);
 void moloch_http_free_server(void *server);
 
-gboolean moloch_http_is_moloch(uint32_t hash, char *key);
+gboolean moloch_http_is_moloch(uint32_t hash, MolochSessionId_t *key);
 
 /******************************************************************************/
 /*
@@ -707,15 +919,23 @@ gboolean moloch_http_is_moloch(uint32_t hash, char *key);
  */
 
 
-void     moloch_session_id (char *buf, uint32_t addr1, uint16_t port1, uint32_t addr2, uint16_t port2);
-void     moloch_session_id6 (char *buf, uint8_t *addr1, uint16_t port1, uint8_t *addr2, uint16_t port2);
-char    *moloch_session_id_string (char *sessionId, char *buf);
+void     moloch_session_id (MolochSessionId_t *id, uint32_t addr1, uint16_t port1, uint32_t addr2, uint16_t port2);
+void     moloch_session_id6 (MolochSessionId_t *id, uint8_t *addr1, uint16_t port1, uint8_t *addr2, uint16_t port2);
+char    *moloch_session_id_string (MolochSessionId_t *id, char *buf);
 
 uint32_t moloch_session_hash(const void *key);
+/* High bits pick a bucket that is mapped to a packet thread, the session
+ * tables use the low bits.  Buckets without sessions can be moved at runtime.
+ */
+#define  MOLOCH_SESSION_BUCKETS      1024
+#define  MOLOCH_SESSION_BUCKET(hash) ((uint32_t)(hash) >> 22)
+extern volatile uint8_t sessionThreadMap[MOLOCH_SESSION_BUCKETS];
+#define  MOLOCH_SESSION_THREAD(hash) (sessionThreadMap[MOLOCH_SESSION_BUCKET(hash)])
+uint32_t moloch_session_bucket_sessions(int bucket);
 int      moloch_session_cmp(const void *keyv, const void *elementv);
 
-MolochSession_t *moloch_session_find(int ses, char *sessionId);
-MolochSession_t *moloch_session_find_or_create(int ses, char *sessionId, int *isNew);
+MolochSession_t *moloch_session_find(int ses, MolochSessionId_t *sessionId);
+MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, MolochSessionId_t *sessionId, int *isNew);
 
 void     moloch_session_init();
 void     moloch_session_exit();
@@ -737,21 +957,32 @@ int      moloch_session_idle_seconds(int ses);
 int      moloch_session_close_outstanding();
 
 void     moloch_session_flush();
+void     moloch_session_restore();
+int      moloch_session_restore_outstanding();
 void     moloch_session_flush_internal(int thread);
 uint32_t moloch_session_monitoring();
 void     moloch_session_process_commands(int thread);
 
 int      moloch_session_need_save_outstanding();
 int      moloch_session_thread_outstanding(int thread);
+int      moloch_session_thread_cmds(int thread);
+void     moloch_session_mem_add(MolochSession_t *session, int size);
+void     moloch_session_mem_fields(MolochSession_t *session, int size);
+uint64_t moloch_session_mem_size();
 int      moloch_session_cmd_outstanding();
 
 typedef enum { 
     MOLOCH_SES_CMD_ADD_TAG,
-    MOLOCH_SES_CMD_FUNC
+    MOLOCH_SES_CMD_FUNC,
+    MOLOCH_SES_CMD_THREAD
 } MolochSesCmd;
 typedef void (*MolochCmd_func)(MolochSession_t *session, gpointer uw1, gpointer uw2);
+typedef void (*MolochThreadCmd_func)(int thread, gpointer uw1, gpointer uw2);
 
 void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd cmd, gpointer uw1, gpointer uw2, MolochCmd_func func);
+void moloch_session_add_thread_cmd(int thread, MolochThreadCmd_func func, gpointer uw1, gpointer uw2);
+
+void *moloch_session_arena_alloc(MolochSession_t *session, int size);
 
 /******************************************************************************/
 /*
@@ -762,14 +993,22 @@ void     moloch_packet_init();
 uint64_t moloch_packet_dropped_packets();
 void     moloch_packet_exit();
 void     moloch_packet_tcp_free(MolochSession_t *session);
+void     moloch_packet_bypass_sync(MolochSession_t *session, int remove);
 int      moloch_packet_outstanding();
 int      moloch_packet_frags_outstanding();
 int      moloch_packet_frags_size();
 uint64_t moloch_packet_dropped_frags();
 uint64_t moloch_packet_dropped_overload();
+void     moloch_packet_load_json(GString *json);
 void     moloch_packet_thread_wake(int thread);
 void     moloch_packet_flush();
 void     moloch_packet(MolochPacket_t * const packet);
+void     moloch_packet_batch_init(MolochPacketBatch_t *batch);
+void     moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const packet);
+void     moloch_packet_batch_flush(MolochPacketBatch_t *batch);
+uint8_t *moloch_packet_buf_alloc(int len);
+void     moloch_packet_buf_ref(uint8_t *data);
+void     moloch_packet_buf_unref(uint8_t *data);
 void     moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, int len, int which);
 
 /******************************************************************************/
@@ -891,10 +1130,31 @@ gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *
 gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i);
 gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCertsInfo_t *info, int len);
 int  moloch_field_count(int pos, MolochSession_t *session);
+int  moloch_field_next(MolochSession_t *session, int pos);
+void moloch_field_clear(MolochSession_t *session, int pos);
 void moloch_field_certsinfo_free (MolochCertsInfo_t *certs);
 void moloch_field_free(MolochSession_t *session);
+gboolean moloch_field_checkpoint(MolochSession_t *session, BSB *bsb);
+void moloch_field_restore(MolochSession_t *session, BSB *bsb);
 void moloch_field_exit();
 
+/* Index into fieldsValues for pos, the number of set bits before it */
+static inline int moloch_field_index(const MolochSession_t *session, int pos)
+{
+    int i, num = __builtin_popcountll(session->fieldsBits[pos >> 6] & ((1ULL << (pos & 63)) - 1));
+
+    for (i = 0; i < (pos >> 6); i++)
+        num += __builtin_popcountll(session->fieldsBits[i]);
+    return num;
+}
+
+static inline MolochField_t *moloch_field_get(const MolochSession_t *session, int pos)
+{
+    if (!(session->fieldsBits[pos >> 6] & (1ULL << (pos & 63))))
+        return NULL;
+    return session->fieldsValues[moloch_field_index(session, pos)];
+}
+
 /******************************************************************************/
 /*
  * writers.c
@@ -929,17 +1189,22 @@ typedef int  (*MolochReaderStats)(MolochReaderStats_t *stats);
 typedef void (*MolochReaderStart)();
 typedef int  (*MolochReaderFilter)(const MolochPacket_t *packet, enum MolochFilterType *type, int *index);
 typedef void (*MolochReaderStop)();
+typedef void (*MolochReaderRelease)(MolochPacket_t *packet);
+typedef void (*MolochReaderBypass)(const MolochSessionId_t *sessionId);
 
 extern MolochReaderStart moloch_reader_start;
 extern MolochReaderStats moloch_reader_stats;
 extern MolochReaderFilter moloch_reader_should_filter;
 extern MolochReaderStop moloch_reader_stop;
+extern MolochReaderRelease moloch_reader_release;
+extern MolochReaderBypass  moloch_reader_bypass;
 
 
 void moloch_readers_init();
 void moloch_readers_set(char *name);
 void moloch_readers_start();
 void moloch_readers_add(char *name, MolochReaderInit func);
+void moloch_readers_filters_init(int dlt, int snaplen);
 void moloch_readers_exit();
 
 /******************************************************************************/
@@ -0,0 +1,179 @@
+/******************************************************************************/
+/* ohash.h  -- Open addressing hashtable
+ *
+ * Robin Hood hashtable of element pointers for tables that get very large,
+ * like the session table.  Each slot keeps the full 32 bit hash next to the
+ * element pointer, so a probe only touches the element itself when the hashes
+ * match, and slots are contiguous so probing is cache friendly instead of a
+ * pointer chase per bucket entry.
+ *
+ * Deletes use backward shifting so there are never tombstones, the table
+ * doubles when 7/8 full and since the hash is stored resizing never calls the
+ * hash function.
+ *
+ * To Use:
+ * Declare an OHash_t, call ohash_init with an initial size and a cmp func.
+ * The caller computes the hash and must not add an element twice.
+ * Use OHASH_FORALL_POP to empty the table.
+ */
+
+#ifndef _OHASH_HEADER
+#define _OHASH_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Given a key does it match the element */
+typedef int (* OHASH_CMP_FUNC)(const void *key, const void *element);
+
+typedef struct {
+    uint32_t        hash;
+    void           *element;
+} OHashSlot_t;
+
+typedef struct {
+    OHashSlot_t    *slots;
+    uint32_t        mask;
+    uint32_t        count;
+    OHASH_CMP_FUNC  cmp;
+} OHash_t;
+
+#define OHASH_DIST(ht, i, h) (((i) - ((h) & (ht)->mask)) & (ht)->mask)
+#define OHASH_COUNT(ht)      ((ht).count)
+
+/******************************************************************************/
+static inline void ohash_init(OHash_t *ht, uint32_t size, OHASH_CMP_FUNC cmp)
+{
+    uint32_t s;
+    for (s = 16; s < size; s <<= 1);
+
+    ht->slots = calloc(s, sizeof(OHashSlot_t));
+    ht->mask  = s - 1;
+    ht->count = 0;
+    ht->cmp   = cmp;
+}
+/******************************************************************************/
+static inline void ohash_free(OHash_t *ht)
+{
+    free(ht->slots);
+    ht->slots = 0;
+    ht->count = 0;
+}
+/******************************************************************************/
+static inline void *ohash_find(OHash_t *ht, uint32_t hash, const void *key)
+{
+    uint32_t i = hash & ht->mask;
+    uint32_t d;
+
+    for (d = 0; ; d++, i = (i + 1) & ht->mask) {
+        const OHashSlot_t *slot = &ht->slots[i];
+
+        // Empty or a richer slot means the key can't be further along
+        if (!slot->element || OHASH_DIST(ht, i, slot->hash) < d)
+            return 0;
+
+        if (slot->hash == hash && ht->cmp(key, slot->element))
+            return slot->element;
+    }
+}
+/******************************************************************************/
+static inline void ohash_insert(OHash_t *ht, uint32_t hash, void *element)
+{
+    OHashSlot_t cur = {hash, element};
+    uint32_t    i = hash & ht->mask;
+    uint32_t    d;
+
+    for (d = 0; ; d++, i = (i + 1) & ht->mask) {
+        OHashSlot_t *slot = &ht->slots[i];
+
+        if (!slot->element) {
+            *slot = cur;
+            return;
+        }
+
+        uint32_t sd = OHASH_DIST(ht, i, slot->hash);
+        if (sd < d) {
+            OHashSlot_t tmp = *slot;
+            *slot = cur;
+            cur = tmp;
+            d = sd;
+        }
+    }
+}
+/******************************************************************************/
+static inline void ohash_resize(OHash_t *ht, uint32_t size)
+{
+    OHashSlot_t *old = ht->slots;
+    uint32_t     oldSize = ht->mask + 1;
+    uint32_t     i;
+
+    ht->slots = calloc(size, sizeof(OHashSlot_t));
+    ht->mask  = size - 1;
+
+    for (i = 0; i < oldSize; i++) {
+        if (old[i].element)
+            ohash_insert(ht, old[i].hash, old[i].element);
+    }
+    free(old);
+}
+/******************************************************************************/
+static inline void ohash_add(OHash_t *ht, uint32_t hash, void *element)
+{
+    if (ht->count + 1 > (ht->mask + 1) - ((ht->mask + 1) >> 3))
+        ohash_resize(ht, (ht->mask + 1) << 1);
+
+    ohash_insert(ht, hash, element);
+    ht->count++;
+}
+/******************************************************************************/
+static inline void ohash_remove_slot(OHash_t *ht, uint32_t i)
+{
+    uint32_t j = (i + 1) & ht->mask;
+
+    // Shift following displaced entries back one
+    while (ht->slots[j].element && OHASH_DIST(ht, j, ht->slots[j].hash) > 0) {
+        ht->slots[i] = ht->slots[j];
+        i = j;
+        j = (j + 1) & ht->mask;
+    }
+    ht->slots[i].element = 0;
+    ht->count--;
+}
+/******************************************************************************/
+static inline int ohash_remove(OHash_t *ht, uint32_t hash, void *element)
+{
+    uint32_t i = hash & ht->mask;
+    uint32_t d;
+
+    for (d = 0; ; d++, i = (i + 1) & ht->mask) {
+        const OHashSlot_t *slot = &ht->slots[i];
+
+        if (!slot->element || OHASH_DIST(ht, i, slot->hash) < d)
+            return 0;
+
+        if (slot->element == element) {
+            ohash_remove_slot(ht, i);
+            return 1;
+        }
+    }
+}
+/******************************************************************************/
+/* Remove every element, running code on each.  Safe for code to remove other
+ * elements from the table.
+ */
+#define OHASH_FORALL_POP(ht, var, code) \
+    do { \
+        uint32_t _i; \
+        for (_i = 0; _i <= (ht).mask; ) { \
+            if (!(ht).slots[_i].element) { \
+                _i++; \
+                continue; \
+            } \
+            var = (ht).slots[_i].element; \
+            ohash_remove_slot(&(ht), _i); \
+            code \
+        } \
+    } while (0)
+
+#endif
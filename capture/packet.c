@@ -40,23 +40,102 @@ LOCAL int                    mac1Field;
 LOCAL int                    mac2Field;
 LOCAL int                    vlanField;
 LOCAL int                    greIpField;
+LOCAL int                    tunnelIpField;
 
-LOCAL uint64_t               droppedFrags;
-
-time_t                       lastPacketSecs[MOLOCH_MAX_PACKET_THREADS];
+time_t                       lastPacketSecs[MOLOCH_MAX_PACKET_THREADS][MOLOCH_MAX_READER_POS];
 
 /******************************************************************************/
 extern MolochSessionHead_t   tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 
+/* Every thread that calls moloch_packet (readers, frags) gets its own single
+ * producer/single consumer ring to each packet thread, so handing off a packet
+ * never takes a lock.  packetQ is now only used to park and wake idle packet
+ * threads.
+ */
+typedef struct {
+    volatile uint32_t        head;           // next slot the packet thread reads
+    char                     pad1[60];
+    volatile uint32_t        tail;           // next slot the reader writes
+    char                     pad2[60];
+    uint32_t                 mask;
+    MolochPacket_t         **packets;
+} MolochPacketRing_t;
+
+#define MOLOCH_PACKET_BATCH    64
+#define MOLOCH_PACKET_MIN_SPIN 16
+#define MOLOCH_PACKET_MAX_SPIN 16384
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOLOCH_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define MOLOCH_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
 LOCAL  MolochPacketHead_t    packetQ[MOLOCH_MAX_PACKET_THREADS];
+/* Packet threads pass on packets for buckets that moved, so get slots too */
+#define MOLOCH_PACKET_RING_SLOTS (MOLOCH_MAX_READER_THREADS + MOLOCH_MAX_PACKET_THREADS)
+
+LOCAL  MolochPacketRing_t   *packetRings[MOLOCH_MAX_PACKET_THREADS][MOLOCH_PACKET_RING_SLOTS];
+LOCAL  int                   packetRingsNum;
+LOCAL  uint32_t              packetRingSize;
+LOCAL  __thread int          packetRingSlot = -1;
+LOCAL  int                   packetRingNext[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  volatile int          packetThreadSleeping[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  volatile int          packetThreadInFlight[MOLOCH_MAX_PACKET_THREADS];
 LOCAL  uint32_t              overloadDrops[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  uint32_t              rebalanceDrops[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  uint32_t              rebalanceMoved[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  uint32_t              rebalanceNext;
+
+#define MOLOCH_PACKET_REBALANCE_MOVES 16
 
-LOCAL  MolochPacketHead_t    fragsQ;
+/* Odd while the thread using a ring slot may hold packets it picked a packet
+ * thread for but hasn't queued yet, a bucket move waits for each to go even
+ * or move on so nothing routed with the old map is still on its way.
+ */
+typedef struct {
+    volatile uint32_t        seq;
+    char                     pad[60];
+} MolochPacketRingSeq_t;
+
+LOCAL  MolochPacketRingSeq_t packetRingSeqs[MOLOCH_PACKET_RING_SLOTS];
+
+/* A bucket on its way from one packet thread to another.  The old thread
+ * keeps the bucket's packets that were routed with the old map, the new
+ * thread holds the ones it gets, and once nothing older can show up the new
+ * thread runs the old ones and then its own, so flows stay in order.
+ */
+typedef struct molochbucketmove_t {
+    struct molochbucketmove_t *move_next;     // old thread's waiting list
+    MolochPacketHead_t       oldQ;
+    MolochPacketHead_t       newQ;
+    uint32_t                 seqs[MOLOCH_PACKET_RING_SLOTS];
+    uint32_t                 tails[MOLOCH_PACKET_RING_SLOTS];
+    int                      bucket;
+    int                      from;
+    int                      to;
+    int                      queued;          // readers are done, waiting on tails
+} MolochBucketMove_t;
+
+LOCAL  MolochBucketMove_t   *bucketMoves[MOLOCH_SESSION_BUCKETS];
+LOCAL  MolochBucketMove_t   *bucketMovesWaiting[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  int                   bucketMovesOutstanding;
 
 LOCAL  gboolean              callFilters;
 
 
-int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int len);
+int moloch_packet_ip4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
+int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
+int moloch_packet_ether(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
+LOCAL uint32_t moloch_packet_frag_hash(const void *key);
+LOCAL void moloch_packet_parse(MolochPacketBatch_t * batch, MolochPacket_t * const packet);
+
+/* Fragments of both ip versions are keyed by version, reader, src, dst and id
+ * with v4 addresses zero padded, and sharded over fragsThreads threads by the
+ * key hash.  Each shard has its own hash, expire list and share of maxFrags,
+ * so the frag threads never share anything.
+ */
+#define MOLOCH_FRAG_KEY_LEN 38
 
 typedef struct molochfrags_t {
     struct molochfrags_t  *fragh_next, *fragh_prev;
@@ -64,7 +143,7 @@ typedef struct molochfrags_t {
     uint32_t               fragh_bucket;
     uint32_t               fragh_hash;
     MolochPacketHead_t     packets;
-    char                   key[10];
+    char                   key[MOLOCH_FRAG_KEY_LEN];
     uint32_t               secs;
     char                   haveNoFlags;
 } MolochFrags_t;
@@ -77,28 +156,196 @@ typedef struct {
     uint32_t               fragl_count;
 } MolochFragsHead_t;
 
-typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 199337);
+typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 49999);
+
+typedef struct {
+    MolochPacketHead_t     fragsQ;
+    MolochFragsHead_t      fragsList;
+    MolochFragsHash_t      fragsHash;
+    uint32_t               maxFrags;
+    uint64_t               dropped;
+} MolochFragsShard_t;
+
+LOCAL MolochFragsShard_t  *fragsShards[MOLOCH_MAX_FRAGS_THREADS];
+
+/******************************************************************************/
+/* Packet buffer pool.  Buffers are carved out of fixed size slabs, recycled
+ * through a small per thread cache that spills into a shared free list, and
+ * are reference counted so the tcp code can hold on to them without a copy.
+ */
+typedef struct molochpacketbuf_t {
+    struct molochpacketbuf_t *buf_next;
+    uint32_t                  refs;
+    uint32_t                  sizeClass;
+} __attribute__((aligned(16))) MolochPacketBuf_t;
+
+typedef struct {
+    MolochPacketBuf_t        *buf_next;
+    uint32_t                  buf_count;
+} MolochPacketBufHead_t;
+
+#define MOLOCH_PACKET_BUF_CLASSES 3
+#define MOLOCH_PACKET_BUF_CACHE   256
+
+LOCAL const uint32_t               packetBufSizes[MOLOCH_PACKET_BUF_CLASSES] = {2048 - sizeof(MolochPacketBuf_t), MOLOCH_SNAPLEN, MOLOCH_PACKET_MAX_LEN};
+LOCAL __thread MolochPacketBufHead_t packetBufCache[MOLOCH_PACKET_BUF_CLASSES];
+LOCAL MolochPacketBufHead_t        packetBufFree[MOLOCH_PACKET_BUF_CLASSES];
+LOCAL MOLOCH_LOCK_DEFINE(packetBufFree);
+
+/******************************************************************************/
+LOCAL void moloch_packet_buf_refill(int sizeClass)
+{
+    MolochPacketBufHead_t *cache = &packetBufCache[sizeClass];
+    const int              size = sizeof(MolochPacketBuf_t) + packetBufSizes[sizeClass];
+    const int              num = MAX(4, 128*1024/size);
+    int                    i;
+
+    MOLOCH_LOCK(packetBufFree);
+    for (i = 0; i < num && packetBufFree[sizeClass].buf_next; i++) {
+        MolochPacketBuf_t *buf = packetBufFree[sizeClass].buf_next;
+        packetBufFree[sizeClass].buf_next = buf->buf_next;
+        packetBufFree[sizeClass].buf_count--;
+        buf->buf_next = cache->buf_next;
+        cache->buf_next = buf;
+        cache->buf_count++;
+    }
+    MOLOCH_UNLOCK(packetBufFree);
+
+    if (cache->buf_next)
+        return;
+
+    // Nothing free anywhere, carve a new slab.  Slabs are never returned.
+    uint8_t *slab;
+    if (posix_memalign((void **)&slab, 64, (size_t)num * size)) {
+        LOG("ERROR - Couldn't allocate packet buffer slab of %d", num * size);
+        exit(1);
+    }
+    for (i = 0; i < num; i++) {
+        MolochPacketBuf_t *buf = (MolochPacketBuf_t *)(slab + i * size);
+        buf->sizeClass = sizeClass;
+        buf->buf_next = cache->buf_next;
+        cache->buf_next = buf;
+        cache->buf_count++;
+    }
+}
+/******************************************************************************/
+uint8_t *moloch_packet_buf_alloc(int len)
+{
+    int sizeClass;
+    for (sizeClass = 0; sizeClass < MOLOCH_PACKET_BUF_CLASSES && (uint32_t)len > packetBufSizes[sizeClass]; sizeClass++);
+
+    if (sizeClass == MOLOCH_PACKET_BUF_CLASSES) {
+        LOG("ERROR - Packet buffer of %d is larger then %d", len, MOLOCH_PACKET_MAX_LEN);
+        exit(1);
+    }
+
+#ifdef MOLOCH_USE_MALLOC
+    MolochPacketBuf_t *buf = malloc(sizeof(MolochPacketBuf_t) + len);
+    buf->sizeClass = sizeClass;
+#else
+    MolochPacketBufHead_t *cache = &packetBufCache[sizeClass];
+    if (!cache->buf_next)
+        moloch_packet_buf_refill(sizeClass);
+
+    MolochPacketBuf_t *buf = cache->buf_next;
+    cache->buf_next = buf->buf_next;
+    cache->buf_count--;
+#endif
+
+    buf->refs = 1;
+    return (uint8_t *)(buf + 1);
+}
+/******************************************************************************/
+void moloch_packet_buf_ref(uint8_t *data)
+{
+    MolochPacketBuf_t *buf = ((MolochPacketBuf_t *)data) - 1;
+    __sync_add_and_fetch(&buf->refs, 1);
+}
+/******************************************************************************/
+void moloch_packet_buf_unref(uint8_t *data)
+{
+    MolochPacketBuf_t *buf = ((MolochPacketBuf_t *)data) - 1;
+
+    if (__sync_sub_and_fetch(&buf->refs, 1) > 0)
+        return;
+
+#ifdef MOLOCH_USE_MALLOC
+    free(buf);
+#else
+    MolochPacketBufHead_t *cache = &packetBufCache[buf->sizeClass];
+    buf->buf_next = cache->buf_next;
+    cache->buf_next = buf;
+    cache->buf_count++;
 
-MolochFragsHash_t          fragsHash;
-MolochFragsHead_t          fragsList;
+    if (cache->buf_count <= MOLOCH_PACKET_BUF_CACHE)
+        return;
+
+    // Give half back so the threads that allocate (readers) can reuse them
+    MolochPacketBuf_t *first = cache->buf_next, *last = first;
+    int i;
+    for (i = 1; i < MOLOCH_PACKET_BUF_CACHE/2; i++) {
+        last = last->buf_next;
+    }
+    cache->buf_next = last->buf_next;
+    cache->buf_count -= MOLOCH_PACKET_BUF_CACHE/2;
+
+    MOLOCH_LOCK(packetBufFree);
+    last->buf_next = packetBufFree[buf->sizeClass].buf_next;
+    packetBufFree[buf->sizeClass].buf_next = first;
+    packetBufFree[buf->sizeClass].buf_count += MOLOCH_PACKET_BUF_CACHE/2;
+    MOLOCH_UNLOCK(packetBufFree);
+#endif
+}
+/******************************************************************************/
+/* Copy pkt into a packet buffer we own, giving back borrowed reader memory */
+LOCAL void moloch_packet_copy(MolochPacket_t * const packet)
+{
+    uint8_t *pkt = moloch_packet_buf_alloc(packet->pktlen);
+    memcpy(pkt, packet->pkt, packet->pktlen);
 
+    if (packet->borrowed) {
+        moloch_reader_release(packet);
+        packet->borrowed = 0;
+    }
+    packet->pkt = pkt;
+    packet->copied = 1;
+}
 /******************************************************************************/
 void moloch_packet_free(MolochPacket_t *packet)
 {
     if (packet->copied) {
-        free(packet->pkt);
+        moloch_packet_buf_unref(packet->pkt);
+    } else if (packet->borrowed) {
+        moloch_reader_release(packet);
     }
     packet->pkt = 0;
     MOLOCH_TYPE_FREE(MolochPacket_t, packet);
 }
 /******************************************************************************/
+LOCAL void moloch_packet_tcp_data_free(MolochTcpData_t *td)
+{
+    moloch_packet_buf_unref(td->pkt);
+    MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+}
+/******************************************************************************/
 void moloch_packet_tcp_free(MolochSession_t *session)
 {
-    MolochTcpData_t *td;
-    while (DLL_POP_HEAD(td_, &session->tcpData, td)) {
-        moloch_packet_free(td->packet);
-        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+    MolochTcpDataHead_t *tcpData = session->tcpData;
+    uint32_t             i;
+    int                  which;
+
+    if (!tcpData)
+        return;
+
+    moloch_session_mem_add(session, -(int)(tcpData->bytes + sizeof(MolochTcpDataHead_t)));
+    for (which = 0; which < 2; which++) {
+        for (i = 0; i < tcpData->q[which].num; i++) {
+            moloch_packet_tcp_data_free(MOLOCH_TCP_DATA_Q(&tcpData->q[which], i));
+        }
+        free(tcpData->q[which].td);
     }
+    MOLOCH_TYPE_FREE(MolochTcpDataHead_t, tcpData);
+    session->tcpData = 0;
 }
 /******************************************************************************/
 // Idea from gopacket tcpassembly/assemply.go
@@ -133,55 +380,132 @@ void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, i
     }
 }
 /******************************************************************************/
-void moloch_packet_tcp_finish(MolochSession_t *session)
+LOCAL void moloch_packet_tcp_data_pop(MolochTcpDataHead_t *tcpData, int which)
 {
-    MolochTcpData_t            *ftd;
-    MolochTcpData_t            *next;
+    MolochTcpDataQ_t *q = &tcpData->q[which];
+    MolochTcpData_t  *td = q->td[q->head];
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
+    tcpData->bytes -= td->len;
+    moloch_packet_tcp_data_free(td);
+    q->head = (q->head + 1) & (q->size - 1);
+    q->num--;
+}
+/******************************************************************************/
+/* Double the ring, unwrapping it so the head is at 0 again */
+LOCAL int moloch_packet_tcp_data_grow(MolochTcpDataQ_t *q)
+{
+    const uint32_t    size = q->size?q->size*2:8;
+    MolochTcpData_t **td = malloc(size * sizeof(MolochTcpData_t *));
+    uint32_t          i;
 
-#ifdef DEBUG_PACKET
-    LOG("START");
-    DLL_FOREACH(td_, tcpData, ftd) {
-        LOG("dir: %d seq: %8u ack: %8u len: %4u", ftd->packet->direction, ftd->seq, ftd->ack, ftd->len);
+    if (!td)
+        return FALSE;
+
+    for (i = 0; i < q->num; i++) {
+        td[i] = MOLOCH_TCP_DATA_Q(q, i);
     }
-#endif
+    free(q->td);
+    q->td = td;
+    q->head = 0;
+    q->size = size;
+    return TRUE;
+}
+/******************************************************************************/
+/* Hand the parsers everything that is now in order.  When both directions
+ * have data ready the one the other side has already acked goes first, so
+ * requests still come before their responses.  A hole that has been there
+ * tcpGapTimeout seconds, or holding more than maxTcpQueueBytes, is skipped.
+ */
+void moloch_packet_tcp_finish(MolochSession_t *session)
+{
+    MolochTcpDataHead_t * const tcpData = session->tcpData;
+    MolochTcpData_t            *head[2];
+    int                         which;
 
-    DLL_FOREACH_REMOVABLE(td_, tcpData, ftd, next) {
-        const int which = ftd->packet->direction;
-        const uint32_t tcpSeq = session->tcpSeq[which];
+    if (!tcpData)
+        return;
 
-        if (tcpSeq >= ftd->seq && tcpSeq < (ftd->seq + ftd->len)) {
-            const int offset = tcpSeq - ftd->seq;
-            const uint8_t *data = ftd->packet->pkt + ftd->dataOffset + offset;
-            const int len = ftd->len - offset;
+    const uint32_t bytes = tcpData->bytes;
+    while (1) {
+        int ready[2] = {0, 0};
+
+        for (which = 0; which < 2; which++) {
+            MolochTcpDataQ_t *q = &tcpData->q[which];
+
+            head[which] = 0;
+            while (q->num) {
+                MolochTcpData_t *td = MOLOCH_TCP_DATA_Q(q, 0);
 
-            if (session->firstBytesLen[which] < 8) {
-                int copy = MIN(8 - session->firstBytesLen[which], len);
-                memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
-                session->firstBytesLen[which] += copy;
+                // Retransmit of data we already have
+                if (moloch_packet_sequence_diff(session->tcpSeq[which], td->seq + td->len) <= 0) {
+                    moloch_packet_tcp_data_pop(tcpData, which);
+                    continue;
+                }
+                head[which] = td;
+                ready[which] = moloch_packet_sequence_diff(td->seq, session->tcpSeq[which]) >= 0;
+                break;
             }
+        }
 
-            if (session->totalDatabytes[which] == session->consumed[which])  {
-                moloch_parsers_classify_tcp(session, data, len, which);
+        if (ready[0] && ready[1]) {
+            if (moloch_packet_sequence_diff(head[0]->seq, head[1]->ack) > 0)
+                which = 0;
+            else if (moloch_packet_sequence_diff(head[1]->seq, head[0]->ack) > 0)
+                which = 1;
+            else
+                which = (head[0]->arrived < head[1]->arrived)?0:1;
+        } else if (ready[0] || ready[1]) {
+            which = ready[0]?0:1;
+        } else {
+            int skipped = 0;
+            for (which = 0; which < 2; which++) {
+                MolochTcpDataQ_t *q = &tcpData->q[which];
+                if (!head[which])
+                    continue;
+
+                if (q->gapSecs == 0)
+                    q->gapSecs = session->lastPacket.tv_sec;
+
+                if (tcpData->bytes > config.maxTcpQueueBytes ||
+                    (config.tcpGapTimeout && session->lastPacket.tv_sec >= q->gapSecs + config.tcpGapTimeout)) {
+                    moloch_session_add_tag(session, "incomplete-tcp");
+                    session->tcpSeq[which] = head[which]->seq;
+                    skipped = 1;
+                }
             }
+            if (!skipped)
+                break;
+            continue;
+        }
 
-            moloch_packet_process_data(session, data, len, which);
-            session->tcpSeq[which] += len;
-            session->databytes[which] += len;
-            session->totalDatabytes[which] += len;
+        MolochTcpData_t *ftd = head[which];
+        const int offset = session->tcpSeq[which] - ftd->seq;
+        const uint8_t *data = ftd->pkt + ftd->dataOffset + offset;
+        const int len = ftd->len - offset;
 
-            if (config.yara) {
-                moloch_yara_execute(session, data, len, 0);
-            }
+        if (session->firstBytesLen[which] < 8) {
+            int copy = MIN(8 - session->firstBytesLen[which], len);
+            memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
+            session->firstBytesLen[which] += copy;
+        }
 
-            DLL_REMOVE(td_, tcpData, ftd);
-            moloch_packet_free(ftd->packet);
-            MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
-        } else {
-            return;
+        if (session->totalDatabytes[which] == session->consumed[which])  {
+            moloch_parsers_classify_tcp(session, data, len, which);
+        }
+
+        moloch_packet_process_data(session, data, len, which);
+        session->tcpSeq[which] += len;
+        session->databytes[which] += len;
+        session->totalDatabytes[which] += len;
+
+        if (config.yara) {
+            moloch_yara_execute(session, data, len, 0);
         }
+
+        tcpData->q[which].gapSecs = 0;
+        moloch_packet_tcp_data_pop(tcpData, which);
     }
+    moloch_session_mem_add(session, (int)(tcpData->bytes - bytes));
 }
 
 /******************************************************************************/
@@ -253,15 +577,6 @@ int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacket_t *
         session->tcpState[packet->direction] = MOLOCH_TCP_STATE_FIN;
     }
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
-
-    if (DLL_COUNT(td_, tcpData) > 256) {
-        moloch_packet_tcp_free(session);
-        moloch_session_add_tag(session, "incomplete-tcp");
-        session->stopTCP = 1;
-        return 1;
-    }
-
     if (tcphdr->th_flags & (TH_ACK | TH_RST)) {
         int owhich = (packet->direction + 1) & 1;
         if (session->tcpState[owhich] == MOLOCH_TCP_STATE_FIN) {
@@ -285,66 +600,184 @@ int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacket_t *
     if (diff <= 0)
         return 1;
 
-    MolochTcpData_t *ftd, *td = MOLOCH_TYPE_ALLOC(MolochTcpData_t);
-    const uint32_t ack = ntohl(tcphdr->th_ack);
+    // Segments can live as long as the session, don't pin reader memory that long
+    if (packet->borrowed) {
+        moloch_packet_copy(packet);
+        tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
+    }
 
-    td->packet = packet;
-    td->ack = ack;
-    td->seq = seq;
-    td->len = len;
-    td->dataOffset = packet->payloadOffset + 4*tcphdr->th_off;
+    if (!session->tcpData) {
+        session->tcpData = MOLOCH_TYPE_ALLOC0(MolochTcpDataHead_t);
+        moloch_session_mem_add(session, sizeof(MolochTcpDataHead_t));
+    }
+
+    MolochTcpDataHead_t * const tcpData = session->tcpData;
+    MolochTcpDataQ_t    * const q = &tcpData->q[packet->direction];
+
+    // Binary search for the first segment that starts at or after this one
+    int32_t  rel = seq - session->tcpSeq[packet->direction];
+    uint32_t lo = 0, hi = q->num;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if ((int32_t)(MOLOCH_TCP_DATA_Q(q, mid)->seq - session->tcpSeq[packet->direction]) < rel)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    if (DLL_COUNT(td_, tcpData) == 0) {
-        DLL_PUSH_TAIL(td_, tcpData, td);
+    // Same start, keep the longer one
+    MolochTcpData_t *td;
+    if (lo < q->num && MOLOCH_TCP_DATA_Q(q, lo)->seq == seq) {
+        if (MOLOCH_TCP_DATA_Q(q, lo)->len >= len)
+            return 1;
+        td = MOLOCH_TCP_DATA_Q(q, lo);
+        tcpData->bytes -= td->len;
+        moloch_session_mem_add(session, -(int)td->len);
+        moloch_packet_buf_unref(td->pkt);
     } else {
-        uint32_t sortA, sortB;
-        DLL_FOREACH_REVERSE(td_, tcpData, ftd) {
-            if (packet->direction == ftd->packet->direction) {
-                sortA = seq;
-                sortB = ftd->seq;
-            } else {
-                sortA = seq;
-                sortB = ftd->ack;
-            }
+        // No memory for a bigger ring, drop it and let the hole be skipped like any other loss
+        if (q->num == q->size && !moloch_packet_tcp_data_grow(q))
+            return 1;
 
-            diff = moloch_packet_sequence_diff(sortB, sortA);
-            if (diff == 0) {
-                if (packet->direction == ftd->packet->direction) {
-                    if (td->len > ftd->len) {
-                        DLL_ADD_AFTER(td_, tcpData, ftd, td);
-
-                        DLL_REMOVE(td_, tcpData, ftd);
-                        moloch_packet_free(ftd->packet);
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
-                        ftd = td;
-                    } else {
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
-                        return 1;
-                    }
-                    break;
-                } else if (moloch_packet_sequence_diff(ack, ftd->seq) < 0) {
-                    DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                    break;
-                }
-            } else if (diff > 0) {
-                DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                break;
+        // Open up lo by moving whichever side of it is shorter
+        uint32_t i;
+        if (lo < q->num - lo) {
+            q->head = (q->head - 1) & (q->size - 1);
+            for (i = 0; i < lo; i++) {
+                MOLOCH_TCP_DATA_Q(q, i) = MOLOCH_TCP_DATA_Q(q, i + 1);
+            }
+        } else {
+            for (i = q->num; i > lo; i--) {
+                MOLOCH_TCP_DATA_Q(q, i) = MOLOCH_TCP_DATA_Q(q, i - 1);
             }
         }
-        if ((void*)ftd == (void*)tcpData) {
-            DLL_PUSH_HEAD(td_, tcpData, td);
+        q->num++;
+        td = MOLOCH_TCP_DATA_Q(q, lo) = MOLOCH_TYPE_ALLOC(MolochTcpData_t);
+    }
+
+    td->pkt = packet->pkt;
+    td->ack = ntohl(tcphdr->th_ack);
+    td->seq = seq;
+    td->len = len;
+    td->dataOffset = packet->payloadOffset + 4*tcphdr->th_off;
+    td->arrived = tcpData->arrived++;
+    tcpData->bytes += len;
+    moloch_session_mem_add(session, len);
+
+    // The segment keeps the packet buffer alive, the packet itself can go
+    moloch_packet_buf_ref(packet->pkt);
+    return 1;
+}
+
+/******************************************************************************/
+/* Called the first time a thread hands us a packet, allocates its rings */
+LOCAL void moloch_packet_ring_slot_init()
+{
+    int slot = __sync_fetch_and_add(&packetRingsNum, 1);
+
+    if (slot >= MOLOCH_PACKET_RING_SLOTS) {
+        LOG("ERROR - Too many threads adding packets, max %d", MOLOCH_PACKET_RING_SLOTS);
+        exit(1);
+    }
+
+    int t;
+    for (t = 0; t < config.packetThreads; t++) {
+        MolochPacketRing_t *ring;
+        if (posix_memalign((void **)&ring, 64, sizeof(MolochPacketRing_t))) {
+            LOG("ERROR - Couldn't allocate packet ring");
+            exit(1);
         }
+        memset(ring, 0, sizeof(MolochPacketRing_t));
+        ring->mask = packetRingSize - 1;
+        ring->packets = malloc(sizeof(MolochPacket_t *) * packetRingSize);
+        __atomic_store_n(&packetRings[t][slot], ring, __ATOMIC_RELEASE);
     }
+    packetRingSlot = slot;
+}
+/******************************************************************************/
+/* Mark our slot busy before reading sessionThreadMap, the barrier pairs with
+ * the one in moloch_packet_bucket_move_cmd.
+ */
+static inline void moloch_packet_ring_busy()
+{
+    MolochPacketRingSeq_t *rs = &packetRingSeqs[packetRingSlot];
 
-    return 0;
+    if (!(rs->seq & 1)) {
+        __atomic_store_n(&rs->seq, rs->seq + 1, __ATOMIC_RELAXED);
+        __sync_synchronize();
+    }
 }
+/******************************************************************************/
+static inline void moloch_packet_ring_idle()
+{
+    MolochPacketRingSeq_t *rs = &packetRingSeqs[packetRingSlot];
 
+    if (rs->seq & 1)
+        __atomic_store_n(&rs->seq, rs->seq + 1, __ATOMIC_RELEASE);
+}
 /******************************************************************************/
+LOCAL int moloch_packet_ring_count(int thread)
+{
+    int count = 0;
+    int r;
+
+    for (r = 0; r < packetRingsNum; r++) {
+        MolochPacketRing_t *ring = __atomic_load_n(&packetRings[thread][r], __ATOMIC_ACQUIRE);
+        if (ring)
+            count += ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+/******************************************************************************/
+/* Grab up to max packets for a packet thread.  We start with a different ring
+ * each time so a busy reader can't starve the others.  The in flight count is
+ * published before head moves, so anyone that sees the ring shrink also sees
+ * the packets we are holding.
+ */
+LOCAL int moloch_packet_ring_dequeue(int thread, MolochPacket_t **packets, int max)
+{
+    const int rings = packetRingsNum;
+    int       num = 0;
+    int       r;
+
+    if (rings == 0)
+        return 0;
+
+    for (r = 0; r < rings && num < max; r++) {
+        MolochPacketRing_t *ring = __atomic_load_n(&packetRings[thread][(packetRingNext[thread] + r) % rings], __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+
+        uint32_t       head = ring->head;
+        const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail && num < max) {
+            packets[num++] = ring->packets[head & ring->mask];
+            head++;
+        }
+        __atomic_store_n(&packetThreadInFlight[thread], num, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    packetRingNext[thread] = (packetRingNext[thread] + 1) % rings;
+
+    return num;
+}
+/******************************************************************************/
+/* Only bother the packet thread if it has given up spinning and is parked */
+LOCAL void moloch_packet_ring_wake(int thread)
+{
+    __sync_synchronize();
+    if (packetThreadSleeping[thread]) {
+        MOLOCH_LOCK(packetQ[thread].lock);
+        MOLOCH_COND_SIGNAL(packetQ[thread].lock);
+        MOLOCH_UNLOCK(packetQ[thread].lock);
+    }
+}
+/******************************************************************************/
+/* Session commands are checked before parking, so the same rule applies */
 void moloch_packet_thread_wake(int thread)
 {
-    MOLOCH_LOCK(packetQ[thread].lock);
-    MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-    MOLOCH_UNLOCK(packetQ[thread].lock);
+    moloch_packet_ring_wake(thread);
 }
 /******************************************************************************/
 /* Only called on main thread, we busy block until all packet threads are empty.
@@ -355,290 +788,694 @@ void moloch_packet_flush()
     int flushed = 0;
     int t;
     while (!flushed) {
-        flushed = !moloch_session_cmd_outstanding();
+        flushed = !moloch_session_cmd_outstanding() && !bucketMovesOutstanding;
 
         for (t = 0; t < config.packetThreads; t++) {
-            MOLOCH_LOCK(packetQ[t].lock);
-            if (DLL_COUNT(packet_, &packetQ[t]) > 0) {
+            if (moloch_packet_ring_count(t) > 0 || packetThreadInFlight[t]) {
                 flushed = 0;
             }
-            MOLOCH_UNLOCK(packetQ[t].lock);
             usleep(10000);
         }
     }
 }
 /******************************************************************************/
-LOCAL void *moloch_packet_thread(void *threadp)
+/* Sessions that will never write or parse another packet are put in a table
+ * shared by all threads, so readers can count and drop their packets instead
+ * of copying and queueing them.  Only the packet thread that owns a session
+ * changes its entry, bumping seq to odd while it does, readers just add to
+ * the counters, which the owner folds into the session on its timer and when
+ * saving.  TCP packets with SYN, FIN or RST still go thru so closes are seen.
+ */
+#define MOLOCH_BYPASS_PROBES 4
+
+typedef struct {
+    uint32_t                 seq;          // odd while the owner changes the entry
+    uint32_t                 used;
+    uint32_t                 hash;
+    uint32_t                 lastSecs;
+    uint64_t                 packets[2];   // [0] is packets from sessionId addr1
+    uint64_t                 bytes[2];
+    MolochSessionId_t        sessionId;
+} MolochBypass_t;
+
+LOCAL MolochBypass_t        *bypassTable;
+LOCAL uint32_t               bypassMask;
+
+/******************************************************************************/
+LOCAL int moloch_packet_bypass_check(MolochPacket_t * const packet, const MolochSessionId_t * const sessionId)
 {
-    MolochPacket_t  *packet;
-    int thread = (long)threadp;
+    const uint8_t *l4 = packet->pkt + packet->payloadOffset;
+    int            i;
 
-    while (1) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        if (DLL_COUNT(packet_, &packetQ[thread]) == 0) {
-            struct timeval tv;
-            struct timespec ts;
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + 1;
-            ts.tv_nsec = 0;
-            MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
-        }
-        DLL_POP_HEAD(packet_, &packetQ[thread], packet);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
+    if (packet->protocol == IPPROTO_TCP && (l4[13] & (TH_SYN | TH_FIN | TH_RST)))
+        return 0;
 
-        moloch_session_process_commands(thread);
+    for (i = 0; i < MOLOCH_BYPASS_PROBES; i++) {
+        MolochBypass_t *entry = &bypassTable[(packet->hash + i) & bypassMask];
+        uint32_t        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
 
-        if (!packet)
+        if ((seq & 1) || !entry->used || entry->hash != packet->hash || !moloch_session_id_cmp(sessionId, &entry->sessionId))
             continue;
 
-        lastPacketSecs[thread] = packet->ts.tv_sec;
+        // Changed while we were looking
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != seq)
+            return 0;
 
-        MolochSession_t     *session;
-        struct ip           *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
-        struct ip6_hdr      *ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
-        struct tcphdr       *tcphdr = 0;
-        struct udphdr       *udphdr = 0;
-        char                 sessionId[MOLOCH_SESSIONID_LEN];
+        int side;
+        if (packet->v6)
+            side = memcmp(packet->pkt + packet->ipOffset + 8, sessionId->v6.addr1, 16) != 0;
+        else
+            side = memcmp(packet->pkt + packet->ipOffset + 12, &sessionId->v4.addr1, 4) != 0;
+        if (!side && packet->protocol != IPPROTO_ICMP && packet->protocol != IPPROTO_ICMPV6)
+            side = memcmp(l4, &sessionId->port1, 2) != 0;
 
-        switch (packet->protocol) {
-        case IPPROTO_TCP:
-            tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
+        __sync_add_and_fetch(&entry->packets[side], 1);
+        __sync_add_and_fetch(&entry->bytes[side], packet->pktlen);
+        entry->lastSecs = packet->ts.tv_sec;
+        return 1;
+    }
+    return 0;
+}
+/******************************************************************************/
+/* Bypass once nothing more will be written and nothing wants the data */
+LOCAL int moloch_packet_bypass_ok(MolochSession_t * const session)
+{
+    if (!session->stopSaving || session->packets[0] + session->packets[1] < session->stopSaving)
+        return 0;
+
+    if (session->stopSPI)
+        return 1;
+
+    // Give the classifiers a chance at both directions first
+    if (session->firstBytesLen[0] < 8 || session->firstBytesLen[1] < 8)
+        return 0;
+
+    int i;
+    for (i = 0; i < session->parserNum; i++) {
+        if (session->parserInfo[i].parserFunc)
+            return 0;
+    }
+    return 1;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_bypass_add(MolochSession_t * const session)
+{
+    int i;
+
+    for (i = 0; i < MOLOCH_BYPASS_PROBES; i++) {
+        uint32_t        slot = (session->h_hash + i) & bypassMask;
+        MolochBypass_t *entry = &bypassTable[slot];
+        uint32_t        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+        if ((seq & 1) || entry->used || !__sync_bool_compare_and_swap(&entry->seq, seq, seq + 1))
+            continue;
+
+        // Another packet thread filled it before we claimed it
+        if (entry->used) {
+            __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        entry->hash = session->h_hash;
+        entry->sessionId = session->sessionId;
+        entry->packets[0] = entry->packets[1] = 0;
+        entry->bytes[0] = entry->bytes[1] = 0;
+        entry->lastSecs = session->lastPacket.tv_sec;
+        entry->used = 1;
+        __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+
+        session->bypassed = 1;
+        session->bypassSlot = slot;
+        if (moloch_reader_bypass)
+            moloch_reader_bypass(&session->sessionId);
+        return;
+    }
+}
+/******************************************************************************/
+/* Fold what the readers counted into the session, and optionally let the
+ * packets thru again.  Only called by the session's packet thread.
+ */
+void moloch_packet_bypass_sync(MolochSession_t *session, int remove)
+{
+    MolochBypass_t *entry = &bypassTable[session->bypassSlot];
+    int             same, side;
+
+    if (session->sessionId.len == MOLOCH_SESSIONID4_LEN)
+        same = MOLOCH_V6_TO_V4(session->addr1) == entry->sessionId.v4.addr1;
+    else
+        same = memcmp(session->addr1.s6_addr, entry->sessionId.v6.addr1, 16) == 0;
+    same = same && session->port1 == ntohs(entry->sessionId.port1);
+
+    if (remove) {
+        __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+        entry->used = 0;
+        __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+        session->bypassed = 0;
+    }
+
+    for (side = 0; side < 2; side++) {
+        const int dir = same?side:!side;
+        session->packets[dir] += __atomic_exchange_n(&entry->packets[side], 0, __ATOMIC_ACQ_REL);
+        session->bytes[dir] += __atomic_exchange_n(&entry->bytes[side], 0, __ATOMIC_ACQ_REL);
+    }
+
+    if (entry->lastSecs > session->lastPacket.tv_sec) {
+        session->lastPacket.tv_sec = entry->lastSecs;
+        session->lastPacket.tv_usec = 0;
+    }
+}
+/******************************************************************************/
+/* The packet was queued before its bucket moved to another thread */
+LOCAL void moloch_packet_forward(MolochPacket_t *packet, int thread)
+{
+    if (packetRingSlot == -1)
+        moloch_packet_ring_slot_init();
+
+    MolochPacketRing_t * const ring = packetRings[thread][packetRingSlot];
+    const uint32_t             tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) {
+        __sync_add_and_fetch(&overloadDrops[thread], 1);
+        moloch_packet_free(packet);
+    } else {
+        ring->packets[tail & ring->mask] = packet;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    moloch_packet_ring_wake(thread);
+}
+/******************************************************************************/
+LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
+{
+    const uint32_t      bucket = MOLOCH_SESSION_BUCKET(packet->hash);
+    MolochBucketMove_t *move = __atomic_load_n(&bucketMoves[bucket], __ATOMIC_ACQUIRE);
+    if (unlikely(move != NULL)) {
+        if (move->from == thread) {
+            DLL_PUSH_TAIL(packet_, &move->oldQ, packet);
+            return;
+        }
+        if (move->to == thread) {
+            DLL_PUSH_TAIL(packet_, &move->newQ, packet);
+            return;
+        }
+    }
+
+    const int owner = sessionThreadMap[bucket];
+    if (owner != thread) {
+        moloch_packet_forward(packet, owner);
+        return;
+    }
+
+    lastPacketSecs[thread][packet->readerPos] = packet->ts.tv_sec;
+
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_QUEUE, packet->statsTsc);
+    MOLOCH_STATS_COUNT(MOLOCH_STATS_PACKETS, 1);
+    MOLOCH_STATS_COUNT(MOLOCH_STATS_BYTES, packet->pktlen);
+
+    MolochSession_t     *session;
+    struct ip           *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    struct ip6_hdr      *ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
+    struct tcphdr       *tcphdr = 0;
+    struct udphdr       *udphdr = 0;
+    MolochSessionId_t    sessionId;
+
+    switch (packet->protocol) {
+    case IPPROTO_TCP:
+        tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
+
+        if (packet->v6) {
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, tcphdr->th_sport,
+                               ip6->ip6_dst.s6_addr, tcphdr->th_dport);
+        } else {
+            moloch_session_id(&sessionId, ip4->ip_src.s_addr, tcphdr->th_sport,
+                              ip4->ip_dst.s_addr, tcphdr->th_dport);
+        }
+        break;
+    case IPPROTO_UDP:
+        udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset);
+        if (packet->v6) {
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
+                               ip6->ip6_dst.s6_addr, udphdr->uh_dport);
+        } else {
+            moloch_session_id(&sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
+                              ip4->ip_dst.s_addr, udphdr->uh_dport);
+        }
+        break;
+    case IPPROTO_ICMP:
+        if (packet->v6) {
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, 0,
+                               ip6->ip6_dst.s6_addr, 0);
+        } else {
+            moloch_session_id(&sessionId, ip4->ip_src.s_addr, 0,
+                              ip4->ip_dst.s_addr, 0);
+        }
+        break;
+    case IPPROTO_ICMPV6:
+        moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, 0,
+                           ip6->ip6_dst.s6_addr, 0);
+        break;
+    }
+    sessionId.pad[0] = packet->readerPos;
+
+    int isNew;
+    uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
+    session = moloch_session_find_or_create(packet->ses, packet->hash, &sessionId, &isNew); // Returns locked session
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_SESSION, statsTsc);
+
+    if (isNew) {
+        MOLOCH_STATS_COUNT(MOLOCH_STATS_SESSIONS, 1);
+        session->saveTime = packet->ts.tv_sec + config.tcpSaveTimeout;
+        session->firstPacket = packet->ts;
 
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, tcphdr->th_sport,
-                                   ip6->ip6_dst.s6_addr, tcphdr->th_dport);
+        session->protocol = packet->protocol;
+        if (ip4->ip_v == 4) {
+            ((uint32_t *)session->addr1.s6_addr)[2] = htonl(0xffff);
+            ((uint32_t *)session->addr1.s6_addr)[3] = ip4->ip_src.s_addr;
+            ((uint32_t *)session->addr2.s6_addr)[2] = htonl(0xffff);
+            ((uint32_t *)session->addr2.s6_addr)[3] = ip4->ip_dst.s_addr;
+            session->ip_tos = ip4->ip_tos;
+        } else {
+            session->addr1 = ip6->ip6_src;
+            session->addr2 = ip6->ip6_dst;
+            session->ip_tos = 0;
+        }
+        session->thread = thread;
+
+        moloch_parsers_initial_tag(session);
+
+        switch (session->protocol) {
+        case IPPROTO_TCP:
+           /* If antiSynDrop option is set to true, capture will assume that
+            *if the syn-ack ip4 was captured first then the syn probably got dropped.*/
+            if ((tcphdr->th_flags & TH_SYN) && (tcphdr->th_flags & TH_ACK) && (config.antiSynDrop)) {
+                struct in6_addr tmp;
+                tmp = session->addr1;
+                session->addr1 = session->addr2;
+                session->addr2 = tmp;
+                session->port1 = ntohs(tcphdr->th_dport);
+                session->port2 = ntohs(tcphdr->th_sport);
             } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, tcphdr->th_sport,
-                                  ip4->ip_dst.s_addr, tcphdr->th_dport);
+                session->port1 = ntohs(tcphdr->th_sport);
+                session->port2 = ntohs(tcphdr->th_dport);
             }
-            break;
-        case IPPROTO_UDP:
-            udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset);
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
-                                   ip6->ip6_dst.s6_addr, udphdr->uh_dport);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
-                                  ip4->ip_dst.s_addr, udphdr->uh_dport);
+            if (moloch_http_is_moloch(session->h_hash, &sessionId)) {
+                if (config.debug) {
+                    char buf[1000];
+                    LOG("Ignoring connection %s", moloch_session_id_string(&session->sessionId, buf));
+                }
+                session->stopSPI = 1;
+                session->stopSaving = 1;
             }
             break;
+        case IPPROTO_UDP:
+            session->port1 = ntohs(udphdr->uh_sport);
+            session->port2 = ntohs(udphdr->uh_dport);
             break;
         case IPPROTO_ICMP:
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
-                                   ip6->ip6_dst.s6_addr, 0);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, 0,
-                                  ip4->ip_dst.s_addr, 0);
-            }
-            break;
-        case IPPROTO_ICMPV6:
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
-                               ip6->ip6_dst.s6_addr, 0);
             break;
         }
 
-        int isNew;
-        session = moloch_session_find_or_create(packet->ses,sessionId, &isNew); // Returns locked session
+        if (pluginsCbs & MOLOCH_PLUGIN_NEW)
+            moloch_plugins_cb_new(session);
+    }
+
+    int dir;
+    if (ip4->ip_v == 4) {
+        dir = (MOLOCH_V6_TO_V4(session->addr1) == ip4->ip_src.s_addr &&
+               MOLOCH_V6_TO_V4(session->addr2) == ip4->ip_dst.s_addr);
+    } else {
+        dir = (memcmp(session->addr1.s6_addr, ip6->ip6_src.s6_addr, 16) == 0 &&
+               memcmp(session->addr2.s6_addr, ip6->ip6_dst.s6_addr, 16) == 0);
+    }
+
+    packet->direction = 0;
+    switch (session->protocol) {
+    case IPPROTO_UDP:
+        udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset);
+        packet->direction = (dir &&
+                             session->port1 == ntohs(udphdr->uh_sport) &&
+                             session->port2 == ntohs(udphdr->uh_dport))?0:1;
+        session->databytes[packet->direction] += (packet->pktlen - 8);
+        break;
+    case IPPROTO_TCP:
+        tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
+        packet->direction = (dir &&
+                             session->port1 == ntohs(tcphdr->th_sport) &&
+                             session->port2 == ntohs(tcphdr->th_dport))?0:1;
+        session->tcp_flags |= tcphdr->th_flags;
+        break;
+    case IPPROTO_ICMP:
+        packet->direction = (dir)?0:1;
+        break;
+    }
+
+    /* Check if the stop saving bpf filters match */
+    if (session->packets[packet->direction] == 0 && session->stopSaving == 0 && callFilters) {
+        if (moloch_reader_should_filter) {
+            enum MolochFilterType type;
+            int index;
+            if (moloch_reader_should_filter(packet, &type, &index)) {
+                if (type == MOLOCH_FILTER_DONT_SAVE)
+                    session->stopSaving = config.bpfsVal[type][index];
+                else if (type == MOLOCH_FILTER_MIN_SAVE)
+                    session->minSaving = config.bpfsVal[type][index];
+            }
+        }
+    }
+
+    session->packets[packet->direction]++;
+    session->bytes[packet->direction] += packet->pktlen;
+    session->lastPacket = packet->ts;
+
+    uint32_t packets = session->packets[0] + session->packets[1];
+
+    if (session->stopSaving == 0 || packets < session->stopSaving) {
+        statsTsc = MOLOCH_STATS_SAMPLE();
+        moloch_writer_write(session, packet);
+        MOLOCH_STATS_RECORD(MOLOCH_STATS_WRITER, statsTsc);
+
+        int16_t len;
+        if (session->lastFileNum != packet->writerFileNum) {
+            session->lastFileNum = packet->writerFileNum;
+            g_array_append_val(session->fileNumArray, packet->writerFileNum);
+            int64_t pos = -1LL * packet->writerFileNum;
+            g_array_append_val(session->filePosArray, pos);
+            len = 0;
+            g_array_append_val(session->fileLenArray, len);
+        }
+
+        g_array_append_val(session->filePosArray, packet->writerFilePos);
+        len = 16 + packet->pktlen;
+        g_array_append_val(session->fileLenArray, len);
+
+        if (packets >= config.maxPackets || session->midSave) {
+            moloch_session_mid_save(session, packet->ts.tv_sec);
+        }
+    }
+
+    if (pcapFileHeader.linktype == 1 && session->firstBytesLen[packet->direction] < 8 && session->packets[packet->direction] < 10) {
+        const uint8_t *pcapData = packet->pkt;
+        char str1[20];
+        char str2[20];
+        snprintf(str1, sizeof(str1), "%02x:%02x:%02x:%02x:%02x:%02x",
+                pcapData[0],
+                pcapData[1],
+                pcapData[2],
+                pcapData[3],
+                pcapData[4],
+                pcapData[5]);
+
+
+        snprintf(str2, sizeof(str2), "%02x:%02x:%02x:%02x:%02x:%02x",
+                pcapData[6],
+                pcapData[7],
+                pcapData[8],
+                pcapData[9],
+                pcapData[10],
+                pcapData[11]);
+
+        if (packet->direction == 1) {
+            moloch_field_string_add(mac1Field, session, str1, 17, TRUE);
+            moloch_field_string_add(mac2Field, session, str2, 17, TRUE);
+        } else {
+            moloch_field_string_add(mac1Field, session, str2, 17, TRUE);
+            moloch_field_string_add(mac2Field, session, str1, 17, TRUE);
+        }
+
+        int n = 12;
+        while (pcapData[n] == 0x81 && pcapData[n+1] == 0x00) {
+            uint16_t vlan = ((uint16_t)(pcapData[n+2] << 8 | pcapData[n+3])) & 0xfff;
+            moloch_field_int_add(vlanField, session, vlan);
+            n += 4;
+        }
+
+        // Only v4 tunnel endpoints are recorded
+        if (packet->vpnIpOffset && (pcapData[packet->vpnIpOffset] >> 4) == 4) {
+            ip4 = (struct ip*)(packet->pkt + packet->vpnIpOffset);
+            int field = (packet->tunnel & MOLOCH_PACKET_TUNNEL_GRE)?greIpField:tunnelIpField;
+            moloch_field_int_add(field, session, ip4->ip_src.s_addr);
+            moloch_field_int_add(field, session, ip4->ip_dst.s_addr);
+        }
+
+        if (packet->tunnel) {
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_GRE)
+                moloch_session_add_protocol(session, "gre");
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_VXLAN)
+                moloch_session_add_protocol(session, "vxlan");
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_GENEVE)
+                moloch_session_add_protocol(session, "geneve");
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_GTP)
+                moloch_session_add_protocol(session, "gtp");
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_MPLS)
+                moloch_session_add_protocol(session, "mpls");
+            if (packet->tunnel & MOLOCH_PACKET_TUNNEL_ERSPAN)
+                moloch_session_add_protocol(session, "erspan");
+        }
+    }
+
+
+    int freePacket = 1;
+    statsTsc = MOLOCH_STATS_SAMPLE();
+    switch(packet->ses) {
+    case SESSION_ICMP:
+        moloch_packet_process_icmp(session, packet);
+        break;
+    case SESSION_UDP:
+        moloch_packet_process_udp(session, packet);
+        break;
+    case SESSION_TCP:
+        freePacket = moloch_packet_process_tcp(session, packet);
+        moloch_packet_tcp_finish(session);
+        break;
+    }
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_PARSERS, statsTsc);
+
+    if (bypassMask && !session->bypassed && moloch_packet_bypass_ok(session))
+        moloch_packet_bypass_add(session);
+
+    if (freePacket) {
+        moloch_packet_free(packet);
+    }
+}
+/******************************************************************************/
+/* Runs on the new thread once the old one has nothing older for the bucket */
+LOCAL void moloch_packet_bucket_moved_cmd(int thread, gpointer movev, gpointer UNUSED(uw2))
+{
+    MolochBucketMove_t *move = movev;
+    MolochPacket_t     *packet;
+
+    __atomic_store_n(&bucketMoves[move->bucket], NULL, __ATOMIC_RELEASE);
+
+    while (DLL_POP_HEAD(packet_, &move->oldQ, packet)) {
+        moloch_packet_process(packet, thread);
+    }
+    while (DLL_POP_HEAD(packet_, &move->newQ, packet)) {
+        moloch_packet_process(packet, thread);
+    }
+
+    MOLOCH_TYPE_FREE(MolochBucketMove_t, move);
+    __sync_sub_and_fetch(&bucketMovesOutstanding, 1);
+}
+/******************************************************************************/
+/* Runs on the old thread, which owns the bucket so no session can be added to
+ * it while we look.  From here new packets for the bucket go to the new
+ * thread, moloch_packet_bucket_moves_check finishes the move.
+ */
+LOCAL void moloch_packet_bucket_move_cmd(int thread, gpointer movev, gpointer UNUSED(uw2))
+{
+    MolochBucketMove_t *move = movev;
+    int                 slot;
+
+    if (sessionThreadMap[move->bucket] != thread || moloch_session_bucket_sessions(move->bucket) != 0 || bucketMoves[move->bucket]) {
+        MOLOCH_TYPE_FREE(MolochBucketMove_t, move);
+        __sync_sub_and_fetch(&bucketMovesOutstanding, 1);
+        return;
+    }
 
-        if (isNew) {
-            session->saveTime = packet->ts.tv_sec + config.tcpSaveTimeout;
-            session->firstPacket = packet->ts;
+    __atomic_store_n(&bucketMoves[move->bucket], move, __ATOMIC_RELEASE);
+    __atomic_store_n(&sessionThreadMap[move->bucket], move->to, __ATOMIC_RELEASE);
+    __sync_synchronize();
 
-            session->protocol = packet->protocol;
-            if (ip4->ip_v == 4) {
-                ((uint32_t *)session->addr1.s6_addr)[2] = htonl(0xffff);
-                ((uint32_t *)session->addr1.s6_addr)[3] = ip4->ip_src.s_addr;
-                ((uint32_t *)session->addr2.s6_addr)[2] = htonl(0xffff);
-                ((uint32_t *)session->addr2.s6_addr)[3] = ip4->ip_dst.s_addr;
-                session->ip_tos = ip4->ip_tos;
-            } else {
-                session->addr1 = ip6->ip6_src;
-                session->addr2 = ip6->ip6_dst;
-                session->ip_tos = 0;
+    for (slot = 0; slot < MOLOCH_PACKET_RING_SLOTS; slot++) {
+        move->seqs[slot] = packetRingSeqs[slot].seq;
+    }
+    move->move_next = bucketMovesWaiting[thread];
+    bucketMovesWaiting[thread] = move;
+    rebalanceMoved[thread]++;
+}
+/******************************************************************************/
+/* Called by the old thread between batches.  A move is done once every slot
+ * that was busy during the map change has gone idle or moved on, and then
+ * this thread has taken everything that was in its rings at that point.
+ */
+LOCAL void moloch_packet_bucket_moves_check(int thread)
+{
+    MolochBucketMove_t **prev = &bucketMovesWaiting[thread];
+    MolochBucketMove_t  *move;
+    int                  slot;
+
+    while ((move = *prev)) {
+        if (!move->queued) {
+            for (slot = 0; slot < MOLOCH_PACKET_RING_SLOTS; slot++) {
+                const uint32_t seq = packetRingSeqs[slot].seq;
+                if ((seq & 1) && seq == move->seqs[slot])
+                    break;
             }
-            session->thread = thread;
-
-            moloch_parsers_initial_tag(session);
-
-            switch (session->protocol) {
-            case IPPROTO_TCP:
-               /* If antiSynDrop option is set to true, capture will assume that
-                *if the syn-ack ip4 was captured first then the syn probably got dropped.*/
-                if ((tcphdr->th_flags & TH_SYN) && (tcphdr->th_flags & TH_ACK) && (config.antiSynDrop)) {
-                    struct in6_addr tmp;
-                    tmp = session->addr1;
-                    session->addr1 = session->addr2;
-                    session->addr2 = tmp;
-                    session->port1 = ntohs(tcphdr->th_dport);
-                    session->port2 = ntohs(tcphdr->th_sport);
-                } else {
-                    session->port1 = ntohs(tcphdr->th_sport);
-                    session->port2 = ntohs(tcphdr->th_dport);
-                }
-                if (moloch_http_is_moloch(session->h_hash, sessionId)) {
-                    if (config.debug) {
-                        char buf[1000];
-                        LOG("Ignoring connection %s", moloch_session_id_string(session->sessionId, buf));
-                    }
-                    session->stopSPI = 1;
-                    session->stopSaving = 1;
-                }
-                break;
-            case IPPROTO_UDP:
-                session->port1 = ntohs(udphdr->uh_sport);
-                session->port2 = ntohs(udphdr->uh_dport);
-                break;
-            case IPPROTO_ICMP:
-                break;
+            if (slot < MOLOCH_PACKET_RING_SLOTS) {
+                prev = &move->move_next;
+                continue;
             }
 
-            if (pluginsCbs & MOLOCH_PLUGIN_NEW)
-                moloch_plugins_cb_new(session);
-        }
-
-        int dir;
-        if (ip4->ip_v == 4) {
-            dir = (MOLOCH_V6_TO_V4(session->addr1) == ip4->ip_src.s_addr &&
-                   MOLOCH_V6_TO_V4(session->addr2) == ip4->ip_dst.s_addr);
-        } else {
-            dir = (memcmp(session->addr1.s6_addr, ip6->ip6_src.s6_addr, 16) == 0 &&
-                   memcmp(session->addr2.s6_addr, ip6->ip6_dst.s6_addr, 16) == 0);
+            for (slot = 0; slot < MOLOCH_PACKET_RING_SLOTS; slot++) {
+                MolochPacketRing_t *ring = __atomic_load_n(&packetRings[thread][slot], __ATOMIC_ACQUIRE);
+                move->tails[slot] = ring?__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE):0;
+            }
+            move->queued = 1;
         }
 
-        packet->direction = 0;
-        switch (session->protocol) {
-        case IPPROTO_UDP:
-            udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset);
-            packet->direction = (dir &&
-                                 session->port1 == ntohs(udphdr->uh_sport) &&
-                                 session->port2 == ntohs(udphdr->uh_dport))?0:1;
-            session->databytes[packet->direction] += (packet->pktlen - 8);
-            break;
-        case IPPROTO_TCP:
-            tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
-            packet->direction = (dir &&
-                                 session->port1 == ntohs(tcphdr->th_sport) &&
-                                 session->port2 == ntohs(tcphdr->th_dport))?0:1;
-            session->tcp_flags |= tcphdr->th_flags;
-            break;
-        case IPPROTO_ICMP:
-            packet->direction = (dir)?0:1;
-            break;
+        for (slot = 0; slot < MOLOCH_PACKET_RING_SLOTS; slot++) {
+            MolochPacketRing_t *ring = packetRings[thread][slot];
+            if (ring && (int32_t)(ring->head - move->tails[slot]) < 0)
+                break;
         }
-
-        /* Check if the stop saving bpf filters match */
-        if (session->packets[packet->direction] == 0 && session->stopSaving == 0 && callFilters) {
-            if (moloch_reader_should_filter) {
-                enum MolochFilterType type;
-                int index;
-                if (moloch_reader_should_filter(packet, &type, &index)) {
-                    if (type == MOLOCH_FILTER_DONT_SAVE)
-                        session->stopSaving = config.bpfsVal[type][index];
-                    else if (type == MOLOCH_FILTER_MIN_SAVE)
-                        session->minSaving = config.bpfsVal[type][index];
-                }
-            }
+        if (slot < MOLOCH_PACKET_RING_SLOTS) {
+            prev = &move->move_next;
+            continue;
         }
 
-        session->packets[packet->direction]++;
-        session->bytes[packet->direction] += packet->pktlen;
-        session->lastPacket = packet->ts;
-
-        uint32_t packets = session->packets[0] + session->packets[1];
-
-        if (session->stopSaving == 0 || packets < session->stopSaving) {
-            moloch_writer_write(session, packet);
-
-            int16_t len;
-            if (session->lastFileNum != packet->writerFileNum) {
-                session->lastFileNum = packet->writerFileNum;
-                g_array_append_val(session->fileNumArray, packet->writerFileNum);
-                int64_t pos = -1LL * packet->writerFileNum;
-                g_array_append_val(session->filePosArray, pos);
-                len = 0;
-                g_array_append_val(session->fileLenArray, len);
-            }
-
-            g_array_append_val(session->filePosArray, packet->writerFilePos);
-            len = 16 + packet->pktlen;
-            g_array_append_val(session->fileLenArray, len);
+        *prev = move->move_next;
+        moloch_session_add_thread_cmd(move->to, moloch_packet_bucket_moved_cmd, move, NULL);
+    }
+}
+/******************************************************************************/
+LOCAL void *moloch_packet_thread(void *threadp)
+{
+    MolochPacket_t  *packets[MOLOCH_PACKET_BATCH];
+    int              thread = (long)threadp;
+    int              spinMax = MOLOCH_PACKET_MIN_SPIN;
 
-            if (packets >= config.maxPackets || session->midSave) {
-                moloch_session_mid_save(session, packet->ts.tv_sec);
+    while (1) {
+        int i, num = moloch_packet_ring_dequeue(thread, packets, MOLOCH_PACKET_BATCH);
+
+        if (num == 0) {
+            // Spin a bit before parking, spin longer if it has been paying off
+            int spin;
+            for (spin = 0; spin < spinMax; spin++) {
+                MOLOCH_CPU_RELAX();
+                if (moloch_packet_ring_count(thread) > 0 || moloch_session_thread_cmds(thread))
+                    break;
             }
-        }
 
-        if (pcapFileHeader.linktype == 1 && session->firstBytesLen[packet->direction] < 8 && session->packets[packet->direction] < 10) {
-            const uint8_t *pcapData = packet->pkt;
-            char str1[20];
-            char str2[20];
-            snprintf(str1, sizeof(str1), "%02x:%02x:%02x:%02x:%02x:%02x",
-                    pcapData[0],
-                    pcapData[1],
-                    pcapData[2],
-                    pcapData[3],
-                    pcapData[4],
-                    pcapData[5]);
-
-
-            snprintf(str2, sizeof(str2), "%02x:%02x:%02x:%02x:%02x:%02x",
-                    pcapData[6],
-                    pcapData[7],
-                    pcapData[8],
-                    pcapData[9],
-                    pcapData[10],
-                    pcapData[11]);
-
-            if (packet->direction == 1) {
-                moloch_field_string_add(mac1Field, session, str1, 17, TRUE);
-                moloch_field_string_add(mac2Field, session, str2, 17, TRUE);
+            if (spin < spinMax) {
+                spinMax = MIN(spinMax * 2, MOLOCH_PACKET_MAX_SPIN);
             } else {
-                moloch_field_string_add(mac1Field, session, str2, 17, TRUE);
-                moloch_field_string_add(mac2Field, session, str1, 17, TRUE);
-            }
-
-            int n = 12;
-            while (pcapData[n] == 0x81 && pcapData[n+1] == 0x00) {
-                uint16_t vlan = ((uint16_t)(pcapData[n+2] << 8 | pcapData[n+3])) & 0xfff;
-                moloch_field_int_add(vlanField, session, vlan);
-                n += 4;
+                spinMax = MAX(spinMax / 2, MOLOCH_PACKET_MIN_SPIN);
+
+                struct timeval tv;
+
+                MOLOCH_LOCK(packetQ[thread].lock);
+                packetThreadSleeping[thread] = 1;
+                __sync_synchronize();
+                if (moloch_packet_ring_count(thread) == 0 && !moloch_session_thread_cmds(thread)) {
+                    struct timespec ts;
+                    gettimeofday(&tv, NULL);
+                    ts.tv_sec = tv.tv_sec + 1;
+                    ts.tv_nsec = 0;
+                    MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
+                }
+                packetThreadSleeping[thread] = 0;
+                MOLOCH_UNLOCK(packetQ[thread].lock);
+
+                // No traffic on a live interface, let wall time drive the session timeouts
+                if (!config.pcapReadOffline && lastPacketSecs[thread][0] && moloch_packet_ring_count(thread) == 0) {
+                    gettimeofday(&tv, NULL);
+                    if (tv.tv_sec > lastPacketSecs[thread][0])
+                        lastPacketSecs[thread][0] = tv.tv_sec;
+                }
             }
 
-            if (packet->vpnIpOffset) {
-                ip4 = (struct ip*)(packet->pkt + packet->vpnIpOffset);
-                moloch_field_int_add(greIpField, session, ip4->ip_src.s_addr);
-                moloch_field_int_add(greIpField, session, ip4->ip_dst.s_addr);
-                moloch_session_add_protocol(session, "gre");
-            }
+            moloch_session_process_commands(thread);
+            if (bucketMovesWaiting[thread])
+                moloch_packet_bucket_moves_check(thread);
+            continue;
         }
 
-
-        int freePacket = 1;
-        switch(packet->ses) {
-        case SESSION_ICMP:
-            moloch_packet_process_icmp(session, packet);
-            break;
-        case SESSION_UDP:
-            moloch_packet_process_udp(session, packet);
-            break;
-        case SESSION_TCP:
-            freePacket = moloch_packet_process_tcp(session, packet);
-            moloch_packet_tcp_finish(session);
-            break;
+        for (i = 0; i < num; i++) {
+            moloch_packet_process(packets[i], thread);
         }
+        packetThreadInFlight[thread] = 0;
 
-        if (freePacket) {
-            moloch_packet_free(packet);
-        }
+        // After the batch, so a command sees every packet it dequeued as done
+        moloch_session_process_commands(thread);
+        if (bucketMovesWaiting[thread])
+            moloch_packet_bucket_moves_check(thread);
     }
 
     return NULL;
 }
 
 /******************************************************************************/
-int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int len);
-int moloch_packet_gre4(MolochPacket_t * const packet, const uint8_t *data, int len)
+/* Tunnels are decapsulated so sessions are made, and hashed to packet threads,
+ * on the inner addresses instead of piling up as one session between the two
+ * tunnel endpoints.
+ */
+LOCAL int moloch_packet_ethertype(MolochPacketBatch_t * batch, MolochPacket_t * const packet, int ethertype, const uint8_t *data, int len);
+/******************************************************************************/
+LOCAL int moloch_packet_ip_version(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
+{
+    if (len < 1)
+        return 1;
+
+    switch (data[0] >> 4) {
+    case 4:
+        return moloch_packet_ip4(batch, packet, data, len);
+    case 6:
+        return moloch_packet_ip6(batch, packet, data, len);
+    }
+    return 1;
+}
+/******************************************************************************/
+LOCAL int moloch_packet_mpls(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
+{
+    int bottom = 0;
+
+    packet->tunnel |= MOLOCH_PACKET_TUNNEL_MPLS;
+    while (!bottom) {
+        if (len < 4)
+            return 1;
+        bottom = data[2] & 0x1;
+        data += 4;
+        len -= 4;
+    }
+
+    // Ethernet pseudowires start with a zero control word
+    if (len > 4 && (data[0] >> 4) == 0)
+        return moloch_packet_ether(batch, packet, data + 4, len - 4);
+
+    return moloch_packet_ip_version(batch, packet, data, len);
+}
+/******************************************************************************/
+LOCAL int moloch_packet_erspan(MolochPacketBatch_t * batch, MolochPacket_t * const packet, int type, int haveSeq, const uint8_t *data, int len)
+{
+    int hlen = 0;
+
+    packet->tunnel |= MOLOCH_PACKET_TUNNEL_ERSPAN;
+    if (type == 0x22eb) {
+        // Type III, optional platform specific subheader
+        hlen = 12;
+        if (len >= 12 && (data[11] & 0x01))
+            hlen += 8;
+    } else if (haveSeq) {
+        // Type II, type I has no header
+        hlen = 8;
+    }
+
+    if (len < hlen)
+        return 1;
+
+    return moloch_packet_ether(batch, packet, data + hlen, len - hlen);
+}
+/******************************************************************************/
+int moloch_packet_gre4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
 {
     BSB bsb;
 
@@ -651,12 +1488,6 @@ int moloch_packet_gre4(MolochPacket_t * const packet, const uint8_t *data, int l
     uint16_t type = 0;
     BSB_IMPORT_u16(bsb, type);
 
-    if (type != 0x0800) {
-        if (config.logUnknownProtocols)
-            LOG("Unknown GRE protocol 0x%04x(%d)", type, type);
-        return 1;
-    }
-
     uint16_t offset = 0;
 
     if (flags_version & (0x8000 | 0x4000)) {
@@ -689,66 +1520,177 @@ int moloch_packet_gre4(MolochPacket_t * const packet, const uint8_t *data, int l
     if (BSB_IS_ERROR(bsb)) 
         return 1;
 
-    return moloch_packet_ip4(packet, BSB_WORK_PTR(bsb), BSB_REMAINING(bsb));
+    packet->tunnel |= MOLOCH_PACKET_TUNNEL_GRE;
+
+    switch (type) {
+    case 0x88be:
+    case 0x22eb:
+        return moloch_packet_erspan(batch, packet, type, flags_version & 0x1000, BSB_WORK_PTR(bsb), BSB_REMAINING(bsb));
+    case 0x0800:
+    case 0x86dd:
+    case 0x6558:
+    case 0x8847:
+    case 0x8848:
+        return moloch_packet_ethertype(batch, packet, type, BSB_WORK_PTR(bsb), BSB_REMAINING(bsb));
+    default:
+        if (config.logUnknownProtocols)
+            LOG("Unknown GRE protocol 0x%04x(%d)", type, type);
+        return 1;
+    }
+}
+/******************************************************************************/
+LOCAL int moloch_packet_gtp(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
+{
+    // Only version 1 G-PDUs carry user traffic
+    if (len < 8 || (data[0] >> 5) != 1 || !(data[0] & 0x10) || data[1] != 0xff)
+        return -1;
+
+    int hlen = 8;
+    if (data[0] & 0x07) {
+        hlen = 12;
+        if (len < hlen)
+            return 1;
+
+        // Extension headers, length is in 4 byte units and the last byte is the next type
+        int next = data[11];
+        while (next) {
+            if (len <= hlen || data[hlen] == 0 || len < hlen + data[hlen] * 4)
+                return 1;
+            hlen += data[hlen] * 4;
+            next = data[hlen - 1];
+        }
+    }
+
+    packet->tunnel |= MOLOCH_PACKET_TUNNEL_GTP;
+    return moloch_packet_ip_version(batch, packet, data + hlen, len - hlen);
+}
+/******************************************************************************/
+/* Returns -1 if the udp packet isn't a tunnel we decapsulate */
+LOCAL int moloch_packet_udp_tunnel(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
+{
+    const struct udphdr *udphdr = (const struct udphdr *)data;
+    int                  hlen;
+
+    data += 8;
+    len -= 8;
+
+    switch (ntohs(udphdr->uh_dport)) {
+    case 4789:
+    case 8472:
+        // VXLAN with the valid VNI flag
+        if (len < 8 || !(data[0] & 0x08))
+            return -1;
+        packet->vpnIpOffset = packet->ipOffset; // ipOffset will get reset
+        packet->tunnel |= MOLOCH_PACKET_TUNNEL_VXLAN;
+        return moloch_packet_ether(batch, packet, data + 8, len - 8);
+    case 6081:
+        // GENEVE version 0, options length is in 4 byte units
+        if (len < 8 || (data[0] >> 6) != 0)
+            return -1;
+        hlen = 8 + (data[0] & 0x3f) * 4;
+        if (len < hlen)
+            return 1;
+        packet->vpnIpOffset = packet->ipOffset;
+        packet->tunnel |= MOLOCH_PACKET_TUNNEL_GENEVE;
+        return moloch_packet_ethertype(batch, packet, data[2] << 8 | data[3], data + hlen, len - hlen);
+    case 2152: {
+        int vpnIpOffset = packet->vpnIpOffset;
+        packet->vpnIpOffset = packet->ipOffset;
+        int rc = moloch_packet_gtp(batch, packet, data, len);
+        if (rc == -1)
+            packet->vpnIpOffset = vpnIpOffset;
+        return rc;
+    }
+    }
+    return -1;
 }
 /******************************************************************************/
-void moloch_packet_frags_free(MolochFrags_t * const frags)
+LOCAL void moloch_packet_frags_free(MolochFragsShard_t * const shard, MolochFrags_t * const frags)
 {
     MolochPacket_t *packet;
 
     while (DLL_POP_HEAD(packet_, &frags->packets, packet)) {
         moloch_packet_free(packet);
     }
-    HASH_REMOVE(fragh_, fragsHash, frags);
-    DLL_REMOVE(fragl_, &fragsList, frags);
+    HASH_REMOVE(fragh_, shard->fragsHash, frags);
+    DLL_REMOVE(fragl_, &shard->fragsList, frags);
     MOLOCH_TYPE_FREE(MolochFrags_t, frags);
 }
 /******************************************************************************/
-void moloch_packet_frags_process(MolochPacket_t * const packet)
+/* For v6 payloadOffset is just past the fragment header */
+LOCAL void moloch_packet_frag_key(const MolochPacket_t * const packet, char *key)
+{
+    memset(key, 0, MOLOCH_FRAG_KEY_LEN);
+    key[0] = packet->v6;
+    key[1] = packet->readerPos;
+
+    if (packet->v6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)(packet->pkt + packet->ipOffset);
+        memcpy(key+2, ip6->ip6_src.s6_addr, 16);
+        memcpy(key+18, ip6->ip6_dst.s6_addr, 16);
+        memcpy(key+34, packet->pkt + packet->payloadOffset - 4, 4);
+    } else {
+        struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+        memcpy(key+2, &ip4->ip_src.s_addr, 4);
+        memcpy(key+18, &ip4->ip_dst.s_addr, 4);
+        memcpy(key+34, &ip4->ip_id, 2);
+    }
+}
+/******************************************************************************/
+/* Byte offset of the fragment's payload and if more fragments follow */
+LOCAL int moloch_packet_frag_offset(const MolochPacket_t * const packet, int *more)
+{
+    uint16_t off;
+
+    if (packet->v6) {
+        memcpy(&off, packet->pkt + packet->payloadOffset - 6, 2);
+        off = ntohs(off);
+        *more = off & 1;
+        return off & 0xfff8;
+    }
+
+    struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    off = ntohs(ip4->ip_off);
+    *more = (off & IP_MF) != 0;
+    return (off & IP_OFFMASK) * 8;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_frags_process(MolochFragsShard_t * const shard, MolochPacketBatch_t * batch, MolochPacket_t * const packet)
 {
     MolochPacket_t * fpacket;
     MolochFrags_t   *frags;
-    char             key[10];
-
-    struct ip * const ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
-    memcpy(key, &ip4->ip_src.s_addr, 4);
-    memcpy(key+4, &ip4->ip_dst.s_addr, 4);
-    memcpy(key+8, &ip4->ip_id, 2);
+    char             key[MOLOCH_FRAG_KEY_LEN];
+    int              more, fmore;
 
-    HASH_FIND(fragh_, fragsHash, key, frags);
+    moloch_packet_frag_key(packet, key);
+    HASH_FIND_HASH(fragh_, shard->fragsHash, packet->hash, key, frags);
 
     if (!frags) {
         frags = MOLOCH_TYPE_ALLOC0(MolochFrags_t);
-        memcpy(frags->key, key, 10);
+        memcpy(frags->key, key, MOLOCH_FRAG_KEY_LEN);
         frags->secs = packet->ts.tv_sec;
-        HASH_ADD(fragh_, fragsHash, key, frags);
-        DLL_PUSH_TAIL(fragl_, &fragsList, frags);
+        HASH_ADD_HASH(fragh_, shard->fragsHash, packet->hash, key, frags);
+        DLL_PUSH_TAIL(fragl_, &shard->fragsList, frags);
         DLL_INIT(packet_, &frags->packets);
-        DLL_PUSH_TAIL(packet_, &frags->packets, packet);
 
-        if (DLL_COUNT(fragl_, &fragsList) > config.maxFrags) {
-            droppedFrags++;
-            moloch_packet_frags_free(DLL_PEEK_HEAD(fragl_, &fragsList));
+        if (DLL_COUNT(fragl_, &shard->fragsList) > shard->maxFrags) {
+            shard->dropped++;
+            moloch_packet_frags_free(shard, DLL_PEEK_HEAD(fragl_, &shard->fragsList));
         }
-        return;
     } else {
-        DLL_MOVE_TAIL(fragl_, &fragsList, frags);
+        DLL_MOVE_TAIL(fragl_, &shard->fragsList, frags);
     }
 
-    uint16_t          ip_off = ntohs(ip4->ip_off);
-    uint16_t          ip_flags = ip_off & ~IP_OFFMASK;
-    ip_off &= IP_OFFMASK;
+    int off = moloch_packet_frag_offset(packet, &more);
 
-    // we might be done once we receive the packets with no flags
-    if (ip_flags == 0) {
+    // we might be done once we receive the packet with no more fragments
+    if (!more) {
         frags->haveNoFlags = 1;
     }
 
     // Insert this packet in correct location sorted by offset
     DLL_FOREACH_REVERSE(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (ip_off >= fip_off) {
+        if (off >= moloch_packet_frag_offset(fpacket, &fmore)) {
             DLL_ADD_AFTER(packet_, &frags->packets, fpacket, packet);
             break;
         }
@@ -757,125 +1699,214 @@ void moloch_packet_frags_process(MolochPacket_t * const packet)
         DLL_PUSH_HEAD(packet_, &frags->packets, packet);
     }
 
-    // Don't bother checking until we get a packet with no flags
+    // Don't bother checking until we get the last fragment
     if (!frags->haveNoFlags) {
         return;
     }
 
-    int off = 0;
-    struct ip *fip4;
-    uint16_t fip_off;
-
+    // Duplicates and overlaps are fine, holes are not
     int payloadLen = 0;
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (fip_off != off)
+        int foff = moloch_packet_frag_offset(fpacket, &fmore);
+        if (foff > payloadLen)
             break;
-        off += fpacket->payloadLen/8;
-        payloadLen = MAX(payloadLen, fip_off*8 + fpacket->payloadLen);
+        payloadLen = MAX(payloadLen, foff + fpacket->payloadLen);
     }
     // We have a hole
     if ((void*)fpacket != (void*)&frags->packets) {
         return;
     }
 
+    // The first fragment's headers are used, minus the v6 fragment header
+    MolochPacket_t *first = DLL_PEEK_HEAD(packet_, &frags->packets);
+    int hdrLen = first->payloadOffset - (first->v6?8:0);
+
     // Packet is too large, hacker
-    if (payloadLen + packet->payloadOffset >= MOLOCH_PACKET_MAX_LEN) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+    if (payloadLen + hdrLen >= MOLOCH_PACKET_MAX_LEN) {
+        shard->dropped++;
+        moloch_packet_frags_free(shard, frags);
         return;
     }
 
-    // Now alloc the full packet
-    packet->pktlen = packet->payloadOffset + payloadLen;
-    uint8_t *pkt = malloc(packet->pktlen);
-    memcpy(pkt, packet->pkt, packet->payloadOffset);
+    // Now fill a pool buffer with the full packet
+    uint8_t *pkt = moloch_packet_buf_alloc(hdrLen + payloadLen);
+    memcpy(pkt, first->pkt, hdrLen);
 
     // Fix header of new packet
-    fip4 = (struct ip*)(pkt + packet->ipOffset);
-    fip4->ip_len = htons(payloadLen + 4*ip4->ip_hl);
-    fip4->ip_off = 0;
+    if (first->v6) {
+        // Point whatever was before the fragment header to what was after it
+        int nxtPos = first->ipOffset + 6;
+        int pos = first->ipOffset + sizeof(struct ip6_hdr);
+        while (pos < hdrLen) {
+            nxtPos = pos;
+            pos += (pkt[pos+1] + 1) << 3;
+        }
+        pkt[nxtPos] = first->pkt[hdrLen];
+
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)(pkt + first->ipOffset);
+        ip6->ip6_plen = htons(hdrLen - first->ipOffset - sizeof(struct ip6_hdr) + payloadLen);
+    } else {
+        struct ip *fip4 = (struct ip*)(pkt + first->ipOffset);
+        fip4->ip_len = htons(payloadLen + 4*fip4->ip_hl);
+        fip4->ip_off = 0;
+    }
 
     // Copy payload
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-
-        memcpy(pkt+packet->payloadOffset+(fip_off*8), fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
+        int foff = moloch_packet_frag_offset(fpacket, &fmore);
+        memcpy(pkt+hdrLen+foff, fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
     }
 
     // Set all the vars in the current packet to new defraged packet
     if (packet->copied)
-        free(packet->pkt);
+        moloch_packet_buf_unref(packet->pkt);
     packet->pkt = pkt;
+    packet->pktlen = hdrLen + payloadLen;
     packet->copied = 1;
     packet->wasfrag = 1;
-    packet->payloadLen = payloadLen;
+    packet->v6 = 0;
     DLL_REMOVE(packet_, &frags->packets, packet); // Remove from list so we don't get freed
-    moloch_packet_frags_free(frags);
+    moloch_packet_frags_free(shard, frags);
 
-    moloch_packet(packet);
+    moloch_packet_parse(batch, packet);
 }
 /******************************************************************************/
-LOCAL void *moloch_packet_frags_thread(void *UNUSED(unused))
+LOCAL void *moloch_packet_frags_thread(void *shardv)
 {
-    MolochPacket_t  *packet;
-    MolochFrags_t   *frags;
-
+    MolochFragsShard_t *shard = shardv;
+    MolochPacket_t     *packet;
+    MolochFrags_t      *frags;
 
     while (1) {
-        MOLOCH_LOCK(fragsQ.lock);
-        while (DLL_COUNT(packet_, &fragsQ) == 0) {
-            MOLOCH_COND_WAIT(fragsQ.lock);
+        MOLOCH_LOCK(shard->fragsQ.lock);
+        while (DLL_COUNT(packet_, &shard->fragsQ) == 0) {
+            MOLOCH_COND_WAIT(shard->fragsQ.lock);
         }
-        DLL_POP_HEAD(packet_, &fragsQ, packet);
-        MOLOCH_UNLOCK(fragsQ.lock);
-
+        DLL_POP_HEAD(packet_, &shard->fragsQ, packet);
+        MOLOCH_UNLOCK(shard->fragsQ.lock);
 
         // Remove expired entries
-        while ((frags = DLL_PEEK_HEAD(fragl_, &fragsList)) && (frags->secs + config.fragsTimeout < packet->ts.tv_sec)) {
-            droppedFrags++;
-            moloch_packet_frags_free(frags);
+        while ((frags = DLL_PEEK_HEAD(fragl_, &shard->fragsList)) && (frags->secs + config.fragsTimeout < packet->ts.tv_sec)) {
+            shard->dropped++;
+            moloch_packet_frags_free(shard, frags);
         }
 
-        moloch_packet_frags_process(packet);
+        moloch_packet_frags_process(shard, NULL, packet);
     }
     return NULL;
 }
 /******************************************************************************/
-void moloch_packet_frags4(MolochPacket_t * const packet)
+void moloch_packet_frags(MolochPacketBatch_t * batch, MolochPacket_t * const packet)
 {
-    uint8_t *pkt = malloc(packet->pktlen);
-    memcpy(pkt, packet->pkt, packet->pktlen);
-    packet->pkt = pkt;
-    packet->copied = 1;
+    char key[MOLOCH_FRAG_KEY_LEN];
+
+    if (!packet->copied) {
+        moloch_packet_copy(packet);
+    }
+
+    // The frag key hash picks the shard and is reused for its hash lookup
+    moloch_packet_frag_key(packet, key);
+    packet->hash = moloch_packet_frag_hash(key);
+    MolochFragsShard_t *shard = fragsShards[packet->hash % config.fragsThreads];
 
     // When running tests we do on the same thread so results are more determinstic
     if (config.tests) {
-        moloch_packet_frags_process(packet);
+        moloch_packet_frags_process(shard, batch, packet);
         return;
     }
 
-
-    MOLOCH_LOCK(fragsQ.lock);
-    DLL_PUSH_TAIL(packet_, &fragsQ, packet);
-    MOLOCH_COND_SIGNAL(fragsQ.lock);
-    MOLOCH_UNLOCK(fragsQ.lock);
+    MOLOCH_LOCK(shard->fragsQ.lock);
+    DLL_PUSH_TAIL(packet_, &shard->fragsQ, packet);
+    MOLOCH_COND_SIGNAL(shard->fragsQ.lock);
+    MOLOCH_UNLOCK(shard->fragsQ.lock);
 }
 /******************************************************************************/
 int moloch_packet_frags_size()
 {
-    return DLL_COUNT(fragl_, &fragsList);
+    int t, count = 0;
+    for (t = 0; t < config.fragsThreads; t++) {
+        count += DLL_COUNT(fragl_, &fragsShards[t]->fragsList);
+    }
+    return count;
 }
 /******************************************************************************/
 int moloch_packet_frags_outstanding()
 {
-    return DLL_COUNT(packet_, &fragsQ);
+    int t, count = 0;
+    for (t = 0; t < config.fragsThreads; t++) {
+        count += DLL_COUNT(packet_, &fragsShards[t]->fragsQ);
+    }
+    return count;
+}
+/******************************************************************************/
+/* Taps that aggregate several SPAN ports can hand us the same packet two or
+ * three times.  A direct mapped table keeps hashes of recent packets, made
+ * from the ip fields that don't change between copies (not ttl or checksum)
+ * and the first payload bytes.  A hit within dedupWindowMs either way is a
+ * copy and never gets queued.  Copies can arrive on different interfaces and
+ * so reader threads, so there is a table per packet thread, picked by the
+ * session hash every copy shares, used by all the readers.  An entry is the
+ * top of the hash and the time in ms in one word, so it needs no lock.
+ */
+#define MOLOCH_DEDUP_MS_MASK ((1ULL << 24) - 1)
+
+LOCAL uint64_t              *dedupTables[MOLOCH_MAX_PACKET_THREADS];
+LOCAL uint32_t               dedupMask;
+
+LOCAL inline uint64_t moloch_packet_dedup_mix(uint64_t h, const uint8_t *data, int len)
+{
+    while (len > 0) {
+        uint64_t v = 0;
+        memcpy(&v, data, MIN(len, 8));
+        h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+        data += 8;
+        len -= 8;
+    }
+    return h;
+}
+/******************************************************************************/
+LOCAL int moloch_packet_dedup(const MolochPacket_t * const packet)
+{
+    const uint8_t *ip = packet->pkt + packet->ipOffset;
+    uint64_t       h = packet->protocol;
+
+    if (packet->v6) {
+        h = moloch_packet_dedup_mix(h, ip, 7);         // flow, plen, nxt
+        h = moloch_packet_dedup_mix(h, ip + 8, 32);    // addresses
+    } else {
+        h = moloch_packet_dedup_mix(h, ip + 2, 6);     // len, id, off
+        h = moloch_packet_dedup_mix(h, ip + 12, 8);    // addresses
+    }
+    h = moloch_packet_dedup_mix(h, packet->pkt + packet->payloadOffset, MIN(24, packet->pktlen - packet->payloadOffset));
+
+    const uint64_t ms = (packet->ts.tv_sec * 1000ULL + packet->ts.tv_usec / 1000) & MOLOCH_DEDUP_MS_MASK;
+    uint64_t      *entry = &dedupTables[MOLOCH_SESSION_THREAD(packet->hash)][h & dedupMask];
+    const uint64_t old = __atomic_load_n(entry, __ATOMIC_RELAXED);
+
+    if ((old & ~MOLOCH_DEDUP_MS_MASK) == (h & ~MOLOCH_DEDUP_MS_MASK)) {
+        // The copy we kept may be from a tap that stamped it a little later
+        uint64_t diff = (ms - old) & MOLOCH_DEDUP_MS_MASK;
+        if (diff > MOLOCH_DEDUP_MS_MASK / 2)
+            diff = MOLOCH_DEDUP_MS_MASK + 1 - diff;
+        if (diff <= config.dedupWindowMs)
+            return 1;
+    }
+    __atomic_store_n(entry, (h & ~MOLOCH_DEDUP_MS_MASK) | ms, __ATOMIC_RELAXED);
+    return 0;
 }
 /******************************************************************************/
-int moloch_packet_ip(MolochPacket_t * const packet, const char * const sessionId)
+int moloch_packet_ip(MolochPacketBatch_t * batch, MolochPacket_t * const packet, MolochSessionId_t * const sessionId)
 {
+    // Sessions from files read at the same time on different threads never merge
+    sessionId->pad[0] = packet->readerPos;
+    packet->hash = moloch_session_hash(sessionId);
+
+    if (config.dedupWindowMs && moloch_packet_dedup(packet)) {
+        MOLOCH_STATS_COUNT(MOLOCH_STATS_DEDUPS, 1);
+        return 1;
+    }
+
     totalBytes += packet->pktlen;
 
     if (totalPackets == 0) {
@@ -913,40 +1944,59 @@ int moloch_packet_ip(MolochPacket_t * const packet, const char * const sessionId
           );
     }
 
-    uint32_t thread = moloch_session_hash(sessionId) % config.packetThreads;
+    packet->statsTsc = MOLOCH_STATS_SAMPLE();
 
-    if (DLL_COUNT(packet_, &packetQ[thread]) >= config.maxPacketsInQueue) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        overloadDrops[thread]++;
-        if ((overloadDrops[thread] % 1000) == 1) {
-            LOG("WARNING - Packet Q %d is overflowing, total dropped %u, increase packetThreads or maxPacketsInQueue", thread, overloadDrops[thread]);
+    if (bypassMask && moloch_packet_bypass_check(packet, sessionId)) {
+        MOLOCH_STATS_COUNT(MOLOCH_STATS_BYPASSED, 1);
+        return 1;
+    }
+
+    if (packetRingSlot == -1)
+        moloch_packet_ring_slot_init();
+
+    // Batches stay busy until moloch_packet_batch_flush
+    moloch_packet_ring_busy();
+    uint32_t thread = MOLOCH_SESSION_THREAD(packet->hash);
+
+    MolochPacketRing_t * const ring = packetRings[thread][packetRingSlot];
+    const uint32_t             tail = ring->tail + (batch?DLL_COUNT(packet_, &batch->packetQ[thread]):0);
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) {
+        uint32_t drops = __sync_add_and_fetch(&overloadDrops[thread], 1);
+        if ((drops % 1000) == 1) {
+            LOG("WARNING - Packet Q %d is overflowing, total dropped %u, increase packetThreads or maxPacketsInQueue", thread, drops);
         }
-        packet->pkt = 0;
-        MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
+        moloch_packet_ring_wake(thread);
+        if (!batch)
+            moloch_packet_ring_idle();
         return 1;
     }
 
-    if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
+    // Borrowed packets stay in reader memory until the packet thread is done
+    if (!packet->copied && !packet->borrowed) {
+        moloch_packet_copy(packet);
+    }
+
+    // Batches are handed to the packet threads in moloch_packet_batch_flush
+    if (batch) {
+        DLL_PUSH_TAIL(packet_, &batch->packetQ[thread], packet);
+        batch->count++;
+        return 0;
     }
 
-    MOLOCH_LOCK(packetQ[thread].lock);
-    DLL_PUSH_TAIL(packet_, &packetQ[thread], packet);
-    MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-    MOLOCH_UNLOCK(packetQ[thread].lock);
+    ring->packets[tail & ring->mask] = packet;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    moloch_packet_ring_idle();
+    moloch_packet_ring_wake(thread);
     return 0;
 }
 /******************************************************************************/
-int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int len)
+int moloch_packet_ip4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
 {
     struct ip           *ip4 = (struct ip*)data;
     struct tcphdr       *tcphdr = 0;
     struct udphdr       *udphdr = 0;
-    char                 sessionId[MOLOCH_SESSIONID_LEN];
+    MolochSessionId_t    sessionId;
 
     if (len < (int)sizeof(struct ip))
         return 1;
@@ -960,6 +2010,7 @@ int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int le
         return 1;
 
     packet->ipOffset = (uint8_t*)data - packet->pkt;
+    packet->v6 = 0;
     packet->payloadOffset = packet->ipOffset + ip_hdr_len;
     packet->payloadLen = ip_len - ip_hdr_len;
 
@@ -968,7 +2019,7 @@ int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int le
     ip_off &= IP_OFFMASK;
 
     if ((ip_flags & IP_MF) || ip_off > 0) {
-        moloch_packet_frags4(packet);
+        moloch_packet_frags(batch, packet);
         return 0;
     }
 
@@ -979,7 +2030,7 @@ int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int le
         }
 
         tcphdr = (struct tcphdr *)((char*)ip4 + ip_hdr_len);
-        moloch_session_id(sessionId, ip4->ip_src.s_addr, tcphdr->th_sport,
+        moloch_session_id(&sessionId, ip4->ip_src.s_addr, tcphdr->th_sport,
                           ip4->ip_dst.s_addr, tcphdr->th_dport);
         packet->ses = SESSION_TCP;
         break;
@@ -990,18 +2041,22 @@ int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int le
 
         udphdr = (struct udphdr *)((char*)ip4 + ip_hdr_len);
 
-        moloch_session_id(sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
+        int rc = moloch_packet_udp_tunnel(batch, packet, (uint8_t *)udphdr, len - ip_hdr_len);
+        if (rc != -1)
+            return rc;
+
+        moloch_session_id(&sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
                           ip4->ip_dst.s_addr, udphdr->uh_dport);
         packet->ses = SESSION_UDP;
         break;
     case IPPROTO_ICMP:
-        moloch_session_id(sessionId, ip4->ip_src.s_addr, 0,
+        moloch_session_id(&sessionId, ip4->ip_src.s_addr, 0,
                           ip4->ip_dst.s_addr, 0);
         packet->ses = SESSION_ICMP;
         break;
     case IPPROTO_GRE:
         packet->vpnIpOffset = packet->ipOffset; // ipOffset will get reset
-        return moloch_packet_gre4(packet, data + ip_hdr_len, len - ip_hdr_len);
+        return moloch_packet_gre4(batch, packet, data + ip_hdr_len, len - ip_hdr_len);
     default:
         if (config.logUnknownProtocols)
             LOG("Unknown protocol %d", ip4->ip_p);
@@ -1009,15 +2064,15 @@ int moloch_packet_ip4(MolochPacket_t * const packet, const uint8_t *data, int le
     }
     packet->protocol = ip4->ip_p;
 
-    return moloch_packet_ip(packet, sessionId);
+    return moloch_packet_ip(batch, packet, &sessionId);
 }
 /******************************************************************************/
-int moloch_packet_ip6(MolochPacket_t * const UNUSED(packet), const uint8_t *data, int len)
+int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
 {
     struct ip6_hdr      *ip6 = (struct ip6_hdr *)data;
     struct tcphdr       *tcphdr = 0;
     struct udphdr       *udphdr = 0;
-    char                 sessionId[MOLOCH_SESSIONID_LEN];
+    MolochSessionId_t    sessionId;
 
     if (len < (int)sizeof(struct ip6_hdr)) {
         return 1;
@@ -1045,8 +2100,13 @@ int moloch_packet_ip6(MolochPacket_t * const UNUSED(packet), const uint8_t *data
             ip_hdr_len += ((data[ip_hdr_len+1] + 1) << 3);
             break;
         case IPPROTO_FRAGMENT:
-            LOG("ERROR - Don't support ip6 fragements yet!");
-            return 1;
+            if (len < ip_hdr_len + 8 || ip_len + (int)sizeof(struct ip6_hdr) < ip_hdr_len + 8) {
+                return 1;
+            }
+            packet->payloadOffset = packet->ipOffset + ip_hdr_len + 8;
+            packet->payloadLen = ip_len + sizeof(struct ip6_hdr) - ip_hdr_len - 8;
+            moloch_packet_frags(batch, packet);
+            return 0;
         case IPPROTO_TCP:
             if (len < ip_hdr_len + (int)sizeof(struct tcphdr)) {
                 return 1;
@@ -1054,7 +2114,7 @@ int moloch_packet_ip6(MolochPacket_t * const UNUSED(packet), const uint8_t *data
 
             tcphdr = (struct tcphdr *)(data + ip_hdr_len);
 
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, tcphdr->th_sport,
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, tcphdr->th_sport,
                                ip6->ip6_dst.s6_addr, tcphdr->th_dport);
             packet->ses = SESSION_TCP;
             done = 1;
@@ -1066,20 +2126,24 @@ int moloch_packet_ip6(MolochPacket_t * const UNUSED(packet), const uint8_t *data
 
             udphdr = (struct udphdr *)(data + ip_hdr_len);
 
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
+            int rc = moloch_packet_udp_tunnel(batch, packet, (uint8_t *)udphdr, len - ip_hdr_len);
+            if (rc != -1)
+                return rc;
+
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
                                ip6->ip6_dst.s6_addr, udphdr->uh_dport);
 
             packet->ses = SESSION_UDP;
             done = 1;
             break;
         case IPPROTO_ICMP:
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, 0,
                                ip6->ip6_dst.s6_addr, 0);
             packet->ses = SESSION_ICMP;
             done = 1;
             break;
         case IPPROTO_ICMPV6:
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
+            moloch_session_id6(&sessionId, ip6->ip6_src.s6_addr, 0,
                                ip6->ip6_dst.s6_addr, 0);
             packet->ses = SESSION_ICMP;
             done = 1;
@@ -1097,10 +2161,27 @@ int moloch_packet_ip6(MolochPacket_t * const UNUSED(packet), const uint8_t *data
     packet->protocol = nxt;
     packet->payloadOffset = packet->ipOffset + ip_hdr_len;
     packet->payloadLen = ip_len - ip_hdr_len + sizeof(struct ip6_hdr);
-    return moloch_packet_ip(packet, sessionId);
+    return moloch_packet_ip(batch, packet, &sessionId);
+}
+/******************************************************************************/
+LOCAL int moloch_packet_ethertype(MolochPacketBatch_t * batch, MolochPacket_t * const packet, int ethertype, const uint8_t *data, int len)
+{
+    switch (ethertype) {
+    case 0x0800:
+        return moloch_packet_ip4(batch, packet, data, len);
+    case 0x86dd:
+        return moloch_packet_ip6(batch, packet, data, len);
+    case 0x6558: // Transparent ethernet bridging
+        return moloch_packet_ether(batch, packet, data, len);
+    case 0x8847:
+    case 0x8848:
+        return moloch_packet_mpls(batch, packet, data, len);
+    default:
+        return 1;
+    }
 }
 /******************************************************************************/
-int moloch_packet_ether(MolochPacket_t * const packet, const uint8_t *data, int len)
+int moloch_packet_ether(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len)
 {
     if (len < 14) {
         return 1;
@@ -1110,39 +2191,36 @@ int moloch_packet_ether(MolochPacket_t * const packet, const uint8_t *data, int
         int ethertype = data[n] << 8 | data[n+1];
         n += 2;
         switch (ethertype) {
-        case 0x0800:
-            return moloch_packet_ip4(packet, data+n, len - n);
-        case 0x86dd:
-            return moloch_packet_ip6(packet, data+n, len - n);
         case 0x8100:
+        case 0x88a8:
             n += 2;
             break;
         default:
-            return 1;
+            return moloch_packet_ethertype(batch, packet, ethertype, data+n, len - n);
         } // switch
     }
     return 0;
 }
 /******************************************************************************/
-void moloch_packet(MolochPacket_t * const packet)
+LOCAL void moloch_packet_parse(MolochPacketBatch_t * batch, MolochPacket_t * const packet)
 {
     int rc;
 
     switch(pcapFileHeader.linktype) {
     case 0: // NULL
         if (packet->pktlen > 4)
-            rc = moloch_packet_ip4(packet, packet->pkt+4, packet->pktlen-4);
+            rc = moloch_packet_ip4(batch, packet, packet->pkt+4, packet->pktlen-4);
         else
             rc = 1;
         break;
     case 1: // Ether
-        rc = moloch_packet_ether(packet, packet->pkt, packet->pktlen);
+        rc = moloch_packet_ether(batch, packet, packet->pkt, packet->pktlen);
         break;
     case 12: // RAW
-        rc = moloch_packet_ip4(packet, packet->pkt, packet->pktlen);
+        rc = moloch_packet_ip4(batch, packet, packet->pkt, packet->pktlen);
         break;
     case 113: // SLL
-        rc = moloch_packet_ip4(packet, packet->pkt, packet->pktlen);
+        rc = moloch_packet_ip4(batch, packet, packet->pkt, packet->pktlen);
         break;
     default:
         LOG("ERROR - Unsupported pcap link type %d", pcapFileHeader.linktype);
@@ -1153,32 +2231,158 @@ void moloch_packet(MolochPacket_t * const packet)
     }
 }
 /******************************************************************************/
+void moloch_packet(MolochPacket_t * const packet)
+{
+    uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
+    moloch_packet_parse(NULL, packet);
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_PARSE, statsTsc);
+}
+/******************************************************************************/
+void moloch_packet_batch_init(MolochPacketBatch_t *batch)
+{
+    int t;
+
+    for (t = 0; t < MOLOCH_MAX_PACKET_THREADS; t++) {
+        DLL_INIT(packet_, &batch->packetQ[t]);
+    }
+    batch->count = 0;
+}
+/******************************************************************************/
+/* Parse and hash a packet, but just hold on to it in the batch bucket for its
+ * packet thread.  Caller must call moloch_packet_batch_flush before the
+ * packet data it gave us goes away.
+ */
+void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const packet)
+{
+    uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
+    moloch_packet_parse(batch, packet);
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_PARSE, statsTsc);
+}
+/******************************************************************************/
+/* Hand each bucket to its packet thread with a single ring update and wakeup */
+void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
+{
+    int t;
+
+    if (batch->count == 0) {
+        if (packetRingSlot != -1)
+            moloch_packet_ring_idle();
+        return;
+    }
+
+    for (t = 0; t < config.packetThreads; t++) {
+        if (DLL_COUNT(packet_, &batch->packetQ[t]) == 0)
+            continue;
+
+        MolochPacketRing_t * const ring = packetRings[t][packetRingSlot];
+        uint32_t                   tail = ring->tail;
+        MolochPacket_t            *packet;
+
+        while (DLL_POP_HEAD(packet_, &batch->packetQ[t], packet)) {
+            ring->packets[tail & ring->mask] = packet;
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        moloch_packet_ring_wake(t);
+    }
+    batch->count = 0;
+    moloch_packet_ring_idle();
+}
+/******************************************************************************/
 int moloch_packet_outstanding()
 {
     int count = 0;
     int t;
 
     for (t = 0; t < config.packetThreads; t++) {
-        count += DLL_COUNT(packet_, &packetQ[t]);
+        count += moloch_packet_ring_count(t) + packetThreadInFlight[t];
     }
-    return count;
+    // Packets held by bucket moves aren't in any ring
+    return count + bucketMovesOutstanding;
 }
 /******************************************************************************/
-uint32_t moloch_packet_frag_hash(const void *key)
+LOCAL uint32_t moloch_packet_frag_hash(const void *key)
 {
     int i;
     uint32_t n = 0;
-    for (i = 0; i < 10; i++) {
+    for (i = 0; i < MOLOCH_FRAG_KEY_LEN; i++) {
         n = (n << 5) - n + ((char*)key)[i];
     }
     return n;
 }
 /******************************************************************************/
-int moloch_packet_frag_cmp(const void *keyv, const void *elementv)
+LOCAL int moloch_packet_frag_cmp(const void *keyv, const void *elementv)
 {
     MolochFrags_t *element = (MolochFrags_t *)elementv;
 
-    return memcmp(keyv, element->key, 10) == 0;
+    return memcmp(keyv, element->key, MOLOCH_FRAG_KEY_LEN) == 0;
+}
+/******************************************************************************/
+/* Every rebalanceInterval look for a packet thread that is backing up, by
+ * queue depth plus overload drops since last time, and move some of its
+ * buckets that have no sessions to the least loaded thread.  Heavy sessions
+ * stay where they are, it is new sessions that end up elsewhere.
+ */
+LOCAL gboolean moloch_packet_rebalance_gfunc(gpointer UNUSED(user_data))
+{
+    uint32_t load[MOLOCH_MAX_PACKET_THREADS];
+    int      t, hot = 0, cold = 0;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        const uint32_t drops = overloadDrops[t];
+        load[t] = moloch_packet_ring_count(t) + packetThreadInFlight[t] + (drops - rebalanceDrops[t]);
+        rebalanceDrops[t] = drops;
+
+        if (load[t] > load[hot])
+            hot = t;
+        if (load[t] < load[cold])
+            cold = t;
+    }
+
+    if (load[hot] < packetRingSize / 4 || load[hot] < 2 * load[cold])
+        return TRUE;
+
+    int moved = 0;
+    int i;
+    for (i = 0; i < MOLOCH_SESSION_BUCKETS && moved < MOLOCH_PACKET_REBALANCE_MOVES; i++) {
+        const int b = (rebalanceNext + i) % MOLOCH_SESSION_BUCKETS;
+        if (sessionThreadMap[b] != hot || moloch_session_bucket_sessions(b) != 0 || bucketMoves[b])
+            continue;
+
+        // The owning thread checks again before moving it
+        MolochBucketMove_t *move = MOLOCH_TYPE_ALLOC0(MolochBucketMove_t);
+        DLL_INIT(packet_, &move->oldQ);
+        DLL_INIT(packet_, &move->newQ);
+        move->bucket = b;
+        move->from = hot;
+        move->to = cold;
+        __sync_add_and_fetch(&bucketMovesOutstanding, 1);
+        moloch_session_add_thread_cmd(hot, moloch_packet_bucket_move_cmd, move, NULL);
+        moved++;
+    }
+    rebalanceNext = (rebalanceNext + i) % MOLOCH_SESSION_BUCKETS;
+
+    if (config.debug && moved)
+        LOG("Moving %d buckets from packet thread %d (load %u) to %d (load %u)", moved, hot, load[hot], cold, load[cold]);
+
+    return TRUE;
+}
+/******************************************************************************/
+void moloch_packet_load_json(GString *json)
+{
+    int t, b;
+
+    g_string_append(json, "\"packetThreads\": [");
+    for (t = 0; t < config.packetThreads; t++) {
+        int buckets = 0;
+        for (b = 0; b < MOLOCH_SESSION_BUCKETS; b++) {
+            if (sessionThreadMap[b] == t)
+                buckets++;
+        }
+        g_string_append_printf(json, "%s\n{\"thread\": %d, \"queue\": %d, \"overloadDrops\": %u, \"buckets\": %d, \"bucketsMoved\": %u}",
+            (t?",":""), t, moloch_packet_ring_count(t) + packetThreadInFlight[t], overloadDrops[t], buckets, rebalanceMoved[t]);
+    }
+    g_string_append(json, "\n]");
 }
 /******************************************************************************/
 void moloch_packet_init()
@@ -1223,6 +2427,12 @@ void moloch_packet_init()
         MOLOCH_FIELD_TYPE_IP_GHASH,  MOLOCH_FIELD_FLAG_COUNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
         NULL);
 
+    tunnelIpField = moloch_field_define("general", "ip",
+        "tunnel.ip", "Tunnel IP", "tunnelip",
+        "VXLAN, GENEVE and GTP tunnel endpoint ip addresses for session",
+        MOLOCH_FIELD_TYPE_IP_GHASH,  MOLOCH_FIELD_FLAG_COUNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
+        NULL);
+
     moloch_field_define("general", "lotermfield",
         "tipv6.src", "IPv6 Src", "tipv61-term",
         "Temporary IPv6 Source",
@@ -1240,6 +2450,22 @@ void moloch_packet_init()
         NULL);
 
     int t;
+    for (dedupMask = 1; dedupMask < config.dedupSize; dedupMask <<= 1);
+    dedupMask--;
+    for (t = 0; config.dedupWindowMs && t < config.packetThreads; t++) {
+        dedupTables[t] = calloc(dedupMask + 1, sizeof(uint64_t));
+    }
+
+    // Plugins that want every packet turn bypass off
+    if (config.bypassSize && !(pluginsCbs & (MOLOCH_PLUGIN_IP | MOLOCH_PLUGIN_UDP | MOLOCH_PLUGIN_TCP))) {
+        for (bypassMask = 1; bypassMask < config.bypassSize; bypassMask <<= 1);
+        bypassTable = calloc(bypassMask, sizeof(MolochBypass_t));
+        bypassMask--;
+    }
+
+    // Each ring holds up to maxPacketsInQueue packets, rounded up to a power of 2
+    for (packetRingSize = 1024; packetRingSize < config.maxPacketsInQueue; packetRingSize <<= 1);
+
     for (t = 0; t < config.packetThreads; t++) {
         char name[100];
         DLL_INIT(packet_, &packetQ[t]);
@@ -1249,14 +2475,25 @@ void moloch_packet_init()
         g_thread_new(name, &moloch_packet_thread, (gpointer)(long)t);
     }
 
-    DLL_INIT(packet_, &fragsQ);
-    MOLOCH_LOCK_INIT(fragsQ.lock);
-    MOLOCH_COND_INIT(fragsQ.lock);
-
-    HASH_INIT(fragh_, fragsHash, moloch_packet_frag_hash, moloch_packet_frag_cmp);
-    DLL_INIT(fragl_, &fragsList);
+    for (t = 0; t < config.fragsThreads; t++) {
+        char name[100];
+        MolochFragsShard_t *shard = fragsShards[t] = calloc(1, sizeof(MolochFragsShard_t));
+        DLL_INIT(packet_, &shard->fragsQ);
+        MOLOCH_LOCK_INIT(shard->fragsQ.lock);
+        MOLOCH_COND_INIT(shard->fragsQ.lock);
+        HASH_INIT(fragh_, shard->fragsHash, moloch_packet_frag_hash, moloch_packet_frag_cmp);
+        DLL_INIT(fragl_, &shard->fragsList);
+        shard->maxFrags = MAX(config.maxFrags / config.fragsThreads, 1);
+
+        if (!config.tests) {
+            snprintf(name, sizeof(name), "moloch-frags%d", t);
+            g_thread_new(name, &moloch_packet_frags_thread, shard);
+        }
+    }
 
-    g_thread_new("moloch-frags4", &moloch_packet_frags_thread, NULL);
+    if (config.rebalanceInterval && config.packetThreads > 1) {
+        g_timeout_add_seconds(config.rebalanceInterval, moloch_packet_rebalance_gfunc, 0);
+    }
 
     moloch_add_can_quit(moloch_packet_outstanding, "packet outstanding");
     moloch_add_can_quit(moloch_packet_frags_outstanding, "packet frags outstanding");
@@ -1273,7 +2510,13 @@ uint64_t moloch_packet_dropped_packets()
 /******************************************************************************/
 uint64_t moloch_packet_dropped_frags()
 {
-    return droppedFrags;
+    uint64_t dropped = 0;
+    int      t;
+
+    for (t = 0; t < config.fragsThreads; t++) {
+        dropped += fragsShards[t]->dropped;
+    }
+    return dropped;
 }
 /******************************************************************************/
 uint64_t moloch_packet_dropped_overload()
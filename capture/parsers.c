@@ -409,6 +409,8 @@ void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func,
     session->parserInfo[session->parserNum].uw             = uw;
     session->parserInfo[session->parserNum].parserFreeFunc = ffunc;
     session->parserInfo[session->parserNum].parserSaveFunc = sfunc;
+    session->parserInfo[session->parserNum].parserCheckpointFunc = 0;
+    session->parserInfo[session->parserNum].parserName     = 0;
 
     session->parserNum++;
 }
@@ -424,6 +426,7 @@ void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
             }
 
             session->parserInfo[i].parserSaveFunc = 0;
+            session->parserInfo[i].parserCheckpointFunc = 0;
             session->parserInfo[i].parserFunc = 0;
             session->parserInfo[i].uw = 0;
             break;
@@ -431,6 +434,111 @@ void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
     }
 }
 /******************************************************************************/
+/* Parsers that can carry their state across a restart mark their entry after
+ * registering it, and register a restore function under the same name at
+ * startup.
+ */
+typedef struct {
+    const char              *name;
+    MolochParserRestoreFunc  func;
+} MolochParserRestore_t;
+
+#define MOLOCH_PARSERS_MAX_RESTORE 64
+LOCAL MolochParserRestore_t parserRestores[MOLOCH_PARSERS_MAX_RESTORE];
+LOCAL int                   parserRestoresNum;
+
+void  moloch_parsers_checkpoint_register(MolochSession_t *session, void *uw, const char *name, MolochParserCheckpointFunc func)
+{
+    int i;
+    for (i = 0; i < session->parserNum; i++) {
+        if (session->parserInfo[i].uw == uw) {
+            session->parserInfo[i].parserCheckpointFunc = func;
+            session->parserInfo[i].parserName = name;
+            break;
+        }
+    }
+}
+/******************************************************************************/
+void  moloch_parsers_restore_register(const char *name, MolochParserRestoreFunc func)
+{
+    if (parserRestoresNum >= MOLOCH_PARSERS_MAX_RESTORE) {
+        LOG("ERROR - Too many parser restore functions, max %d", MOLOCH_PARSERS_MAX_RESTORE);
+        exit(1);
+    }
+    parserRestores[parserRestoresNum].name = name;
+    parserRestores[parserRestoresNum].func = func;
+    parserRestoresNum++;
+}
+/******************************************************************************/
+/* FALSE if a parser still working on the session can't be checkpointed */
+gboolean moloch_parsers_checkpoint(MolochSession_t *session, BSB *bsb)
+{
+    int i, num = 0;
+
+    for (i = 0; i < session->parserNum; i++) {
+        if (!session->parserInfo[i].parserFunc)
+            continue;
+        if (!session->parserInfo[i].parserCheckpointFunc)
+            return FALSE;
+        num++;
+    }
+
+    BSB_EXPORT_u08(*bsb, num);
+    for (i = 0; i < session->parserNum; i++) {
+        if (!session->parserInfo[i].parserFunc)
+            continue;
+
+        int nameLen = strlen(session->parserInfo[i].parserName);
+        BSB_EXPORT_u08(*bsb, nameLen);
+        BSB_EXPORT_ptr(*bsb, session->parserInfo[i].parserName, nameLen);
+
+        // Length is filled in once the parser is done
+        unsigned char *lenPtr = BSB_WORK_PTR(*bsb);
+        BSB_EXPORT_u32(*bsb, 0);
+        if (BSB_IS_ERROR(*bsb))
+            return FALSE;
+
+        if (!session->parserInfo[i].parserCheckpointFunc(session, session->parserInfo[i].uw, bsb) || BSB_IS_ERROR(*bsb))
+            return FALSE;
+
+        uint32_t len = BSB_WORK_PTR(*bsb) - lenPtr - 4;
+        lenPtr[0] = len >> 24;
+        lenPtr[1] = len >> 16;
+        lenPtr[2] = len >> 8;
+        lenPtr[3] = len;
+    }
+    return BSB_NOT_ERROR(*bsb);
+}
+/******************************************************************************/
+void moloch_parsers_restore(MolochSession_t *session, BSB *bsb)
+{
+    int num = 0;
+    int i, r;
+
+    BSB_IMPORT_u08(*bsb, num);
+    for (i = 0; i < num && BSB_NOT_ERROR(*bsb); i++) {
+        int            nameLen = 0;
+        uint32_t       len = 0;
+        unsigned char *name, *data;
+
+        BSB_IMPORT_u08(*bsb, nameLen);
+        BSB_IMPORT_ptr(*bsb, name, nameLen);
+        BSB_IMPORT_u32(*bsb, len);
+        BSB_IMPORT_ptr(*bsb, data, len);
+        if (BSB_IS_ERROR(*bsb))
+            return;
+
+        for (r = 0; r < parserRestoresNum; r++) {
+            if (strncmp(parserRestores[r].name, (char *)name, nameLen) == 0 && parserRestores[r].name[nameLen] == 0) {
+                BSB pbsb;
+                BSB_INIT(pbsb, data, len);
+                parserRestores[r].func(session, &pbsb);
+                break;
+            }
+        }
+    }
+}
+/******************************************************************************/
 typedef struct moloch_classify_t
 {
     const char          *name;
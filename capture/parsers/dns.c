@@ -326,12 +326,55 @@ int dns_tcp_parser(MolochSession_t *session, void *uw, const unsigned char *data
     return 0;
 }
 /******************************************************************************/
+/* Carries a partly read request or response across a restart */
+int dns_tcp_checkpoint(MolochSession_t *UNUSED(session), void *uw, BSB *bsb)
+{
+    DNSInfo_t            *info          = uw;
+    int                   which;
+
+    for (which = 0; which < 2; which++) {
+        BSB_EXPORT_u16(*bsb, info->len[which]);
+        BSB_EXPORT_u16(*bsb, info->pos[which]);
+        if (info->len[which])
+            BSB_EXPORT_ptr(*bsb, info->data[which], info->pos[which]);
+    }
+    return BSB_NOT_ERROR(*bsb);
+}
+/******************************************************************************/
+void dns_tcp_restore(MolochSession_t *session, BSB *bsb)
+{
+    DNSInfo_t            *info          = MOLOCH_TYPE_ALLOC0(DNSInfo_t);
+    unsigned char        *data;
+    int                   which;
+
+    for (which = 0; which < 2; which++) {
+        uint16_t len = 0, pos = 0;
+        BSB_IMPORT_u16(*bsb, len);
+        BSB_IMPORT_u16(*bsb, pos);
+        if (!len)
+            continue;
+        BSB_IMPORT_ptr(*bsb, data, pos);
+        if (BSB_IS_ERROR(*bsb) || pos > len)
+            break;
+
+        info->size[which] = MAX(1024, len);
+        info->data[which] = malloc(info->size[which]);
+        memcpy(info->data[which], data, pos);
+        info->len[which] = len;
+        info->pos[which] = pos;
+    }
+
+    moloch_parsers_register(session, dns_tcp_parser, info, dns_free);
+    moloch_parsers_checkpoint_register(session, info, "dns-tcp", dns_tcp_checkpoint);
+}
+/******************************************************************************/
 void dns_tcp_classify(MolochSession_t *session, const unsigned char *UNUSED(data), int UNUSED(len), int which, void *UNUSED(uw))
 {
     if (/*which == 0 &&*/ session->port2 == 53 && !moloch_session_has_protocol(session, "dns")) {
         moloch_session_add_protocol(session, "dns");
         DNSInfo_t  *info= MOLOCH_TYPE_ALLOC0(DNSInfo_t);
         moloch_parsers_register(session, dns_tcp_parser, info, dns_free);
+        moloch_parsers_checkpoint_register(session, info, "dns-tcp", dns_tcp_checkpoint);
     }
 }
 /******************************************************************************/
@@ -341,10 +384,24 @@ int dns_udp_parser(MolochSession_t *session, void *UNUSED(uw), const unsigned ch
     return 0;
 }
 /******************************************************************************/
+/* Every udp packet is parsed on its own, nothing to carry over */
+int dns_udp_checkpoint(MolochSession_t *UNUSED(session), void *UNUSED(uw), BSB *UNUSED(bsb))
+{
+    return TRUE;
+}
+/******************************************************************************/
+void dns_udp_restore(MolochSession_t *session, BSB *UNUSED(bsb))
+{
+    moloch_parsers_register(session, dns_udp_parser, 0, 0);
+    moloch_parsers_checkpoint_register(session, 0, "dns-udp", dns_udp_checkpoint);
+}
+/******************************************************************************/
 void dns_udp_classify(MolochSession_t *session, const unsigned char *UNUSED(data), int UNUSED(len), int UNUSED(which), void *UNUSED(uw))
 {
-    if (session->port1 == 53 || session->port2 == 53)
+    if (session->port1 == 53 || session->port2 == 53) {
         moloch_parsers_register(session, dns_udp_parser, 0, 0);
+        moloch_parsers_checkpoint_register(session, 0, "dns-udp", dns_udp_checkpoint);
+    }
 }
 /******************************************************************************/
 void moloch_parser_init()
@@ -492,5 +549,8 @@ void moloch_parser_init()
     DNS_CLASSIFY("\xa4\x00"); // NOTIFY response
     DNS_CLASSIFY("\xa8\x00"); // UPDATE response
     DNS_CLASSIFY("\xa8\x05"); // UPDATE response
+
+    moloch_parsers_restore_register("dns-tcp", dns_tcp_restore);
+    moloch_parsers_restore_register("dns-udp", dns_udp_restore);
 }
 
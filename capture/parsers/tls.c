@@ -569,6 +569,38 @@ void tls_free(MolochSession_t *UNUSED(session), void *uw)
     MOLOCH_TYPE_FREE(TLSInfo_t, tls);
 }
 /******************************************************************************/
+/* Carries the part of the server handshake seen so far across a restart */
+int tls_checkpoint(MolochSession_t *UNUSED(session), void *uw, BSB *bsb)
+{
+    TLSInfo_t            *tls          = uw;
+
+    BSB_EXPORT_u08(*bsb, tls->which);
+    BSB_EXPORT_u16(*bsb, tls->len);
+    BSB_EXPORT_ptr(*bsb, tls->buf, tls->len);
+    return BSB_NOT_ERROR(*bsb);
+}
+/******************************************************************************/
+void tls_restore(MolochSession_t *session, BSB *bsb)
+{
+    unsigned char        *buf;
+    uint16_t              len = 0;
+    int                   which = 0;
+
+    BSB_IMPORT_u08(*bsb, which);
+    BSB_IMPORT_u16(*bsb, len);
+    BSB_IMPORT_ptr(*bsb, buf, len);
+    if (BSB_IS_ERROR(*bsb) || len > sizeof(((TLSInfo_t *)0)->buf) || which > 1)
+        return;
+
+    TLSInfo_t  *tls = MOLOCH_TYPE_ALLOC(TLSInfo_t);
+    tls->which      = which;
+    tls->len        = len;
+    memcpy(tls->buf, buf, len);
+
+    moloch_parsers_register2(session, tls_parser, tls, tls_free, tls_save);
+    moloch_parsers_checkpoint_register(session, tls, "tls", tls_checkpoint);
+}
+/******************************************************************************/
 void tls_classify(MolochSession_t *session, const unsigned char *data, int len, int which, void *UNUSED(uw))
 {
     if (len < 6 || data[2] > 0x03)
@@ -590,6 +622,7 @@ void tls_classify(MolochSession_t *session, const unsigned char *data, int len,
         tls->len        = 0;
 
         moloch_parsers_register2(session, tls_parser, tls, tls_free, tls_save);
+        moloch_parsers_checkpoint_register(session, tls, "tls", tls_checkpoint);
 
         if (data[5] == 1) {
             tls_process_client(session, data, (int)len);
@@ -714,6 +747,7 @@ void moloch_parser_init()
         NULL);
 
     moloch_parsers_classifier_register_tcp("tls", NULL, 0, (unsigned char*)"\x16\x03", 2, tls_classify);
+    moloch_parsers_restore_register("tls", tls_restore);
 
     int t;
     for (t = 0; t < config.packetThreads; t++) {
@@ -33,8 +33,6 @@ extern MolochPcapFileHdr_t   pcapFileHeader;
 LOCAL const DAQ_Module_t    *module;
 LOCAL void                  *handles[MAX_INTERFACES];
 
-LOCAL struct bpf_program    *bpf_programs[MOLOCH_FILTER_MAX];
-
 /******************************************************************************/
 int reader_daq_stats(MolochReaderStats_t *stats)
 {
@@ -89,48 +87,13 @@ static void *reader_daq_thread(gpointer handle)
     return NULL;
 }
 /******************************************************************************/
-int reader_daq_should_filter(const MolochPacket_t *packet, enum MolochFilterType *type, int *index)
-{
-    int t, i;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        for (i = 0; i < config.bpfsNum[t]; i++) {
-            if (bpf_filter(bpf_programs[t][i].bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
-                *type = t;
-                *index = i;
-                return 1;
-            }
-        }
-    }
-    return 0;
-}
-/******************************************************************************/
 void reader_daq_start() {
     int err;
 
     //ALW - Bug: assumes all linktypes are the same
     pcapFileHeader.linktype = daq_get_datalink_type(module, handles[0]);
     pcapFileHeader.snaplen = MOLOCH_SNAPLEN;
-    pcap_t *dpcap = pcap_open_dead(pcapFileHeader.linktype, pcapFileHeader.snaplen);
-    int t;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        if (config.bpfsNum[t]) {
-            int i;
-            if (bpf_programs[t]) {
-                for (i = 0; i < config.bpfsNum[t]; i++) {
-                    pcap_freecode(&bpf_programs[t][i]);
-                }
-            } else {
-                bpf_programs[t] = malloc(config.bpfsNum[t]*sizeof(struct bpf_program));
-            }
-            for (i = 0; i < config.bpfsNum[t]; i++) {
-                if (pcap_compile(dpcap, &bpf_programs[t][i], config.bpfs[t][i], 1, PCAP_NETMASK_UNKNOWN) == -1) {
-                    LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpfs[t][i], pcap_geterr(dpcap));
-                    exit(1);
-                }
-            }
-            moloch_reader_should_filter = reader_daq_should_filter;
-        }
-    }
+    moloch_readers_filters_init(pcapFileHeader.linktype, pcapFileHeader.snaplen);
 
     int i;
     for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
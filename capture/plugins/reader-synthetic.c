@@ -0,0 +1,463 @@
+/* reader-synthetic.c  -- Reader that makes up traffic for load testing
+ *
+ * Generates ethernet packets in memory for a configurable number of
+ * concurrent flows per thread, TCP flows carry an HTTP or TLS conversation
+ * and UDP flows a DNS query and response, over a mix of IPv4 and IPv6.
+ * Each thread walks its flows round robin so packets of different sessions
+ * are interleaved like real traffic, and a finished flow is replaced with a
+ * new one on new addresses.  Combine with writer null and --nospi to find
+ * where capture falls over without a capture nic.
+ *
+ *   rootPlugins=reader-synthetic.so
+ *   pcapReadMethod=synthetic
+ *   interface=synthetic
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+extern MolochPcapFileHdr_t   pcapFileHeader;
+
+#define SYN_MAX_THREADS 16
+#define SYN_BATCH       64
+
+enum { SYN_HTTP, SYN_TLS, SYN_DNS };
+
+typedef struct {
+    uint8_t                  addr1[16];   // client
+    uint8_t                  addr2[16];   // server
+    uint16_t                 port1;
+    uint16_t                 port2;
+    uint32_t                 seq[2];
+    uint32_t                 num;         // packets sent
+    uint32_t                 life;        // packets before closing
+    uint32_t                 id;
+    uint8_t                  v6;
+    uint8_t                  kind;
+} SynFlow_t;
+
+typedef struct {
+    SynFlow_t               *flows;
+    uint64_t                 rand;
+    uint32_t                 nextId;
+    uint8_t                  thread;
+} SynThread_t;
+
+LOCAL int                    numThreads;
+LOCAL int                    numFlows;
+LOCAL int                    flowPackets;
+LOCAL int                    packetSize;
+LOCAL int                    v6Percent;
+LOCAL int                    udpPercent;
+LOCAL int                    tlsPercent;
+LOCAL uint64_t               pps;
+LOCAL int                    stopping;
+LOCAL uint64_t               totalPackets[SYN_MAX_THREADS];
+LOCAL SynThread_t            threads[SYN_MAX_THREADS];
+
+/******************************************************************************/
+LOCAL uint32_t syn_rand(SynThread_t *st)
+{
+    // xorshift64*
+    st->rand ^= st->rand >> 12;
+    st->rand ^= st->rand << 25;
+    st->rand ^= st->rand >> 27;
+    return (st->rand * 0x2545F4914F6CDD1DULL) >> 32;
+}
+/******************************************************************************/
+LOCAL void syn_flow_new(SynThread_t *st, SynFlow_t *flow)
+{
+    uint32_t id = st->nextId++;
+
+    memset(flow, 0, sizeof(*flow));
+    flow->id   = id;
+    flow->v6   = (syn_rand(st) % 100) < (uint32_t)v6Percent;
+
+    if ((syn_rand(st) % 100) < (uint32_t)udpPercent) {
+        flow->kind = SYN_DNS;
+        flow->life = 2;
+        flow->port2 = 53;
+    } else {
+        flow->kind = ((syn_rand(st) % 100) < (uint32_t)tlsPercent)?SYN_TLS:SYN_HTTP;
+        flow->life = 7 + syn_rand(st) % (2 * flowPackets);
+        flow->port2 = (flow->kind == SYN_TLS)?443:80;
+    }
+    flow->port1 = 1024 + syn_rand(st) % 64000;
+    flow->seq[0] = syn_rand(st);
+    flow->seq[1] = syn_rand(st);
+
+    // Clients are 10.thread.x.x or fd00:thread::x, servers 172.16.x.x or fd01::x
+    if (flow->v6) {
+        flow->addr1[0] = 0xfd;
+        flow->addr1[1] = 0x00;
+        flow->addr1[2] = st->thread;
+        memcpy(flow->addr1 + 12, &id, 4);
+        flow->addr2[0] = 0xfd;
+        flow->addr2[1] = 0x01;
+        flow->addr2[15] = syn_rand(st);
+        flow->addr2[14] = syn_rand(st);
+    } else {
+        flow->addr1[0] = 10;
+        flow->addr1[1] = st->thread;
+        flow->addr1[2] = id >> 8;
+        flow->addr1[3] = id;
+        flow->addr2[0] = 172;
+        flow->addr2[1] = 16 + (syn_rand(st) & 0xf);
+        flow->addr2[2] = syn_rand(st);
+        flow->addr2[3] = syn_rand(st);
+    }
+}
+/******************************************************************************/
+LOCAL int syn_dns(uint8_t *p, SynFlow_t *flow, int response)
+{
+    BSB bsb;
+    BSB_INIT(bsb, p, 512);
+
+    BSB_EXPORT_u16(bsb, flow->id);
+    BSB_EXPORT_u16(bsb, response?0x8180:0x0100);
+    BSB_EXPORT_u16(bsb, 1);
+    BSB_EXPORT_u16(bsb, response?1:0);
+    BSB_EXPORT_u16(bsb, 0);
+    BSB_EXPORT_u16(bsb, 0);
+
+    char label[20];
+    int  len = snprintf(label, sizeof(label), "www%u", flow->id % 100000);
+    BSB_EXPORT_u08(bsb, len);
+    BSB_EXPORT_ptr(bsb, label, len);
+    BSB_EXPORT_u08(bsb, 7);
+    BSB_EXPORT_ptr(bsb, "example", 7);
+    BSB_EXPORT_u08(bsb, 3);
+    BSB_EXPORT_ptr(bsb, "com", 3);
+    BSB_EXPORT_u08(bsb, 0);
+    BSB_EXPORT_u16(bsb, 1);          // A
+    BSB_EXPORT_u16(bsb, 1);          // IN
+
+    if (response) {
+        BSB_EXPORT_u16(bsb, 0xc00c);
+        BSB_EXPORT_u16(bsb, 1);
+        BSB_EXPORT_u16(bsb, 1);
+        BSB_EXPORT_u32(bsb, 300);
+        BSB_EXPORT_u16(bsb, 4);
+        BSB_EXPORT_ptr(bsb, flow->addr2, 4);
+    }
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+LOCAL int syn_tls_client_hello(uint8_t *p, SynFlow_t *flow)
+{
+    char host[40];
+    int  hlen = snprintf(host, sizeof(host), "www%u.example.com", flow->id % 100000);
+    BSB  bsb;
+
+    BSB_INIT(bsb, p, 512);
+    BSB_EXPORT_u08(bsb, 0x16);       // handshake record
+    BSB_EXPORT_u16(bsb, 0x0301);
+    BSB_EXPORT_u16(bsb, 4 + 2 + 32 + 1 + 4 + 2 + 2 + 9 + hlen);
+    BSB_EXPORT_u08(bsb, 0x01);       // client hello
+    BSB_EXPORT_u08(bsb, 0);
+    BSB_EXPORT_u16(bsb, 2 + 32 + 1 + 4 + 2 + 2 + 9 + hlen);
+    BSB_EXPORT_u16(bsb, 0x0303);
+    BSB_EXPORT_u32(bsb, flow->id);   // random
+    BSB_EXPORT_skip(bsb, 28);
+    BSB_EXPORT_u08(bsb, 0);          // session id
+    BSB_EXPORT_u16(bsb, 2);
+    BSB_EXPORT_u16(bsb, 0xc02f);     // cipher
+    BSB_EXPORT_u08(bsb, 1);
+    BSB_EXPORT_u08(bsb, 0);          // compression
+    BSB_EXPORT_u16(bsb, 9 + hlen);   // extensions
+    BSB_EXPORT_u16(bsb, 0);          // server name
+    BSB_EXPORT_u16(bsb, 5 + hlen);
+    BSB_EXPORT_u16(bsb, 3 + hlen);
+    BSB_EXPORT_u08(bsb, 0);
+    BSB_EXPORT_u16(bsb, hlen);
+    BSB_EXPORT_ptr(bsb, host, hlen);
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+LOCAL int syn_tls_server_hello(uint8_t *p, SynFlow_t *flow)
+{
+    BSB bsb;
+
+    BSB_INIT(bsb, p, 512);
+    BSB_EXPORT_u08(bsb, 0x16);
+    BSB_EXPORT_u16(bsb, 0x0303);
+    BSB_EXPORT_u16(bsb, 4 + 2 + 32 + 1 + 2 + 1);
+    BSB_EXPORT_u08(bsb, 0x02);       // server hello
+    BSB_EXPORT_u08(bsb, 0);
+    BSB_EXPORT_u16(bsb, 2 + 32 + 1 + 2 + 1);
+    BSB_EXPORT_u16(bsb, 0x0303);
+    BSB_EXPORT_u32(bsb, ~flow->id);
+    BSB_EXPORT_skip(bsb, 28);
+    BSB_EXPORT_u08(bsb, 0);
+    BSB_EXPORT_u16(bsb, 0xc02f);
+    BSB_EXPORT_u08(bsb, 0);
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+/* The tcp payload for the next packet of a flow, returns its direction */
+LOCAL int syn_tcp_payload(SynFlow_t *flow, uint8_t *p, int *len, uint8_t *flags)
+{
+    const uint32_t n = flow->num;
+    int            max = packetSize - 14 - (flow->v6?40:20) - 20;
+
+    *len = 0;
+    if (n == 0) {
+        *flags = TH_SYN;
+        return 0;
+    }
+    if (n == 1) {
+        *flags = TH_SYN | TH_ACK;
+        return 1;
+    }
+    if (n == 2) {
+        *flags = TH_ACK;
+        return 0;
+    }
+    if (n + 2 == flow->life) {
+        *flags = TH_FIN | TH_ACK;
+        return 0;
+    }
+    if (n + 1 == flow->life) {
+        *flags = TH_FIN | TH_ACK;
+        return 1;
+    }
+
+    *flags = TH_ACK | TH_PUSH;
+    if (n == 3) {
+        if (flow->kind == SYN_TLS)
+            *len = syn_tls_client_hello(p, flow);
+        else
+            *len = snprintf((char *)p, max, "GET /synthetic/%u HTTP/1.1\r\nHost: www%u.example.com\r\nUser-Agent: moloch-synthetic\r\nAccept: */*\r\n\r\n",
+                            flow->id, flow->id % 100000);
+        return 0;
+    }
+
+    if (n == 4) {
+        if (flow->kind == SYN_TLS)
+            *len = syn_tls_server_hello(p, flow);
+        else
+            *len = snprintf((char *)p, max, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %u\r\n\r\n",
+                            (flow->life - 7) * max);
+        return 1;
+    }
+
+    // Server data, tls data is application data records
+    *len = max;
+    if (flow->kind == SYN_TLS) {
+        p[0] = 0x17;
+        p[1] = 0x03;
+        p[2] = 0x03;
+        p[3] = (max - 5) >> 8;
+        p[4] = (max - 5) & 0xff;
+        memset(p + 5, 'x', max - 5);
+    } else {
+        memset(p, 'x', max);
+    }
+    return 1;
+}
+/******************************************************************************/
+/* Build the next packet of a flow into p, returns its length */
+LOCAL int syn_packet(SynFlow_t *flow, uint8_t *p)
+{
+    const int ipLen = flow->v6?40:20;
+    const int l4Len = (flow->kind == SYN_DNS)?8:20;
+    uint8_t  *ip = p + 14;
+    uint8_t  *l4 = ip + ipLen;
+    uint8_t  *payload = l4 + l4Len;
+    int       len, dir;
+    uint8_t   flags = 0;
+
+    if (flow->kind == SYN_DNS) {
+        dir = flow->num;
+        len = syn_dns(payload, flow, dir);
+    } else {
+        dir = syn_tcp_payload(flow, payload, &len, &flags);
+    }
+
+    const uint8_t *src = dir?flow->addr2:flow->addr1;
+    const uint8_t *dst = dir?flow->addr1:flow->addr2;
+
+    // Ethernet
+    memcpy(p, dir?"\x00\x00\x5e\x00\x00\x01":"\x00\x00\x5e\x00\x00\x02", 6);
+    memcpy(p + 6, dir?"\x00\x00\x5e\x00\x00\x02":"\x00\x00\x5e\x00\x00\x01", 6);
+    p[12] = flow->v6?0x86:0x08;
+    p[13] = flow->v6?0xdd:0x00;
+
+    if (flow->v6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)ip;
+        ip6->ip6_flow = htonl(0x60000000);
+        ip6->ip6_plen = htons(l4Len + len);
+        ip6->ip6_nxt  = (flow->kind == SYN_DNS)?IPPROTO_UDP:IPPROTO_TCP;
+        ip6->ip6_hlim = 64;
+        memcpy(&ip6->ip6_src, src, 16);
+        memcpy(&ip6->ip6_dst, dst, 16);
+    } else {
+        struct ip *ip4 = (struct ip *)ip;
+        ip4->ip_v   = 4;
+        ip4->ip_hl  = 5;
+        ip4->ip_tos = 0;
+        ip4->ip_len = htons(ipLen + l4Len + len);
+        ip4->ip_id  = htons(flow->num);
+        ip4->ip_off = 0;
+        ip4->ip_ttl = 64;
+        ip4->ip_p   = (flow->kind == SYN_DNS)?IPPROTO_UDP:IPPROTO_TCP;
+        ip4->ip_sum = 0;
+        memcpy(&ip4->ip_src, src, 4);
+        memcpy(&ip4->ip_dst, dst, 4);
+
+        uint32_t sum = 0;
+        int      i;
+        for (i = 0; i < 20; i += 2)
+            sum += (ip[i] << 8) | ip[i+1];
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+        ip4->ip_sum = htons(~sum & 0xffff);
+    }
+
+    const uint16_t sport = htons(dir?flow->port2:flow->port1);
+    const uint16_t dport = htons(dir?flow->port1:flow->port2);
+
+    if (flow->kind == SYN_DNS) {
+        struct udphdr *udp = (struct udphdr *)l4;
+        udp->uh_sport = sport;
+        udp->uh_dport = dport;
+        udp->uh_ulen  = htons(8 + len);
+        udp->uh_sum   = 0;
+    } else {
+        struct tcphdr *tcp = (struct tcphdr *)l4;
+        memset(tcp, 0, sizeof(*tcp));
+        tcp->th_sport = sport;
+        tcp->th_dport = dport;
+        tcp->th_seq   = htonl(flow->seq[dir]);
+        tcp->th_ack   = (flags & TH_ACK)?htonl(flow->seq[!dir]):0;
+        tcp->th_off   = 5;
+        tcp->th_flags = flags;
+        tcp->th_win   = htons(65535);
+        flow->seq[dir] += len + ((flags & (TH_SYN|TH_FIN))?1:0);
+    }
+
+    flow->num++;
+    return 14 + ipLen + l4Len + len;
+}
+/******************************************************************************/
+LOCAL void *reader_synthetic_thread(gpointer stv)
+{
+    SynThread_t         *st = stv;
+    MolochPacketBatch_t  batch;
+    uint8_t              buf[SYN_BATCH][2048];
+    struct timespec      start, now;
+    uint64_t             sent = 0;
+    const uint64_t       threadPps = pps / numThreads;
+    int                  pos = 0, i;
+
+    st->flows = malloc(numFlows * sizeof(SynFlow_t));
+    for (i = 0; i < numFlows; i++) {
+        syn_flow_new(st, &st->flows[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!stopping) {
+        struct timeval ts;
+        gettimeofday(&ts, NULL);
+
+        moloch_packet_batch_init(&batch);
+        for (i = 0; i < SYN_BATCH; i++) {
+            SynFlow_t *flow = &st->flows[pos];
+
+            // moloch_packet_ip copies the packet, so buf can be reused next batch
+            MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+            packet->pkt    = buf[i];
+            packet->pktlen = syn_packet(flow, buf[i]);
+            packet->ts     = ts;
+            moloch_packet_batch(&batch, packet);
+
+            if (flow->num == flow->life)
+                syn_flow_new(st, flow);
+
+            pos = (pos + 1) % numFlows;
+        }
+        moloch_packet_batch_flush(&batch);
+        sent += SYN_BATCH;
+        totalPackets[st->thread] = sent;
+
+        // Sleep if we are ahead of the target rate
+        if (threadPps) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1000000000.0;
+            double ahead = (double)sent / threadPps - elapsed;
+            if (ahead > 0.0001)
+                usleep(ahead * 1000000);
+        }
+    }
+    return NULL;
+}
+/******************************************************************************/
+int reader_synthetic_stats(MolochReaderStats_t *stats)
+{
+    int t;
+
+    stats->dropped = 0;
+    stats->total = 0;
+    for (t = 0; t < numThreads; t++) {
+        stats->total += totalPackets[t];
+    }
+    return 0;
+}
+/******************************************************************************/
+void reader_synthetic_start() {
+    pcapFileHeader.linktype = 1;
+    pcapFileHeader.snaplen = MOLOCH_SNAPLEN;
+
+    int t;
+    for (t = 0; t < numThreads; t++) {
+        char name[100];
+        threads[t].thread = t;
+        threads[t].rand = 0x9e3779b97f4a7c15ULL * (t + 1);
+        snprintf(name, sizeof(name), "moloch-syn%d", t);
+        g_thread_new(name, &reader_synthetic_thread, &threads[t]);
+    }
+}
+/******************************************************************************/
+void reader_synthetic_stop()
+{
+    stopping = 1;
+}
+/******************************************************************************/
+void reader_synthetic_init(char *UNUSED(name))
+{
+    numThreads  = moloch_config_int(NULL, "syntheticThreads", 1, 1, SYN_MAX_THREADS);
+    numFlows    = moloch_config_int(NULL, "syntheticFlows", 10000, 1, 10000000);
+    flowPackets = moloch_config_int(NULL, "syntheticFlowPackets", 20, 1, 100000);
+    packetSize  = moloch_config_int(NULL, "syntheticPacketSize", 800, 200, 1514);
+    v6Percent   = moloch_config_int(NULL, "syntheticV6Percent", 10, 0, 100);
+    udpPercent  = moloch_config_int(NULL, "syntheticUdpPercent", 20, 0, 100);
+    tlsPercent  = moloch_config_int(NULL, "syntheticTlsPercent", 50, 0, 100);
+    pps         = moloch_config_int(NULL, "syntheticPps", 0, 0, 0x7fffffff);
+
+    moloch_reader_start         = reader_synthetic_start;
+    moloch_reader_stop          = reader_synthetic_stop;
+    moloch_reader_stats         = reader_synthetic_stats;
+}
+/******************************************************************************/
+void moloch_plugin_init()
+{
+    moloch_readers_add("synthetic", reader_synthetic_init);
+}
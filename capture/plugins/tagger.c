@@ -199,9 +199,9 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
     // ALW - Fix when we support ipv6 for other ips
     prefix.family = AF_INET;
     prefix.bitlen = 32;
-    if (httpXffField != -1 && session->fields[httpXffField]) {
+    if (httpXffField != -1 && moloch_field_get(session, httpXffField)) {
         if (config.fields[httpXffField]->type == MOLOCH_FIELD_TYPE_IP_HASH) {
-            MolochIntHashStd_t *ihash = session->fields[httpXffField]->ihash;
+            MolochIntHashStd_t *ihash = moloch_field_get(session, httpXffField)->ihash;
             MolochInt_t        *xff;
 
             HASH_FORALL(i_, *ihash, xff,
@@ -216,7 +216,7 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
             GHashTableIter         iter;
             gpointer               ikey;
 
-            ghash = session->fields[httpXffField]->ghash;
+            ghash = moloch_field_get(session, httpXffField)->ghash;
             g_hash_table_iter_init (&iter, ghash);
             while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
                 prefix.add.sin.s_addr = (int)(long)ikey;
@@ -229,8 +229,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
     }
 
     MolochString_t *hstring;
-    if (httpHostField != -1 && session->fields[httpHostField]) {
-        MolochStringHashStd_t *shash = session->fields[httpHostField]->shash;
+    if (httpHostField != -1 && moloch_field_get(session, httpHostField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, httpHostField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allDomains, hstring->s_hash, hstring->str, tstring);
             if (tstring)
@@ -243,8 +243,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
             }
         );
     }
-    if (dnsHostField != -1 && session->fields[dnsHostField]) {
-        MolochStringHashStd_t *shash = session->fields[dnsHostField]->shash;
+    if (dnsHostField != -1 && moloch_field_get(session, dnsHostField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, dnsHostField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allDomains, hstring->s_hash, hstring->str, tstring);
             if (tstring)
@@ -258,8 +258,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         );
     }
 
-    if (httpMd5Field != -1 && session->fields[httpMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[httpMd5Field]->shash;
+    if (httpMd5Field != -1 && moloch_field_get(session, httpMd5Field)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, httpMd5Field)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allMD5s, hstring->s_hash, hstring->str, tstring);
             if (tstring)
@@ -267,8 +267,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         );
     }
 
-    if (httpPathField != -1 && session->fields[httpPathField]) {
-        MolochStringHashStd_t *shash = session->fields[httpPathField]->shash;
+    if (httpPathField != -1 && moloch_field_get(session, httpPathField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, httpPathField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allURIs, hstring->s_hash, hstring->str, tstring);
             if (tstring) {
@@ -277,8 +277,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         );
     }
 
-    if (emailMd5Field != -1 && session->fields[emailMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[emailMd5Field]->shash;
+    if (emailMd5Field != -1 && moloch_field_get(session, emailMd5Field)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailMd5Field)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allMD5s, hstring->s_hash, hstring->str, tstring);
             if (tstring)
@@ -286,8 +286,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         );
     }
 
-    if (emailSrcField != -1 && session->fields[emailSrcField]) {
-        MolochStringHashStd_t *shash = session->fields[emailSrcField]->shash;
+    if (emailSrcField != -1 && moloch_field_get(session, emailSrcField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailSrcField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allEmails, hstring->s_hash, hstring->str, tstring);
             if (tstring)
@@ -295,8 +295,8 @@ void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         );
     }
 
-    if (emailDstField != -1 && session->fields[emailDstField]) {
-        MolochStringHashStd_t *shash = session->fields[emailDstField]->shash;
+    if (emailDstField != -1 && moloch_field_get(session, emailDstField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailDstField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             HASH_FIND_HASH(s_, allEmails, hstring->s_hash, hstring->str, tstring);
             if (tstring)
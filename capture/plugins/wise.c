@@ -524,8 +524,8 @@ void wise_plugin_pre_save(MolochSession_t *session, int UNUSED(final))
 
 
     //Domains
-    if (session->fields[httpHostField]) {
-        MolochStringHashStd_t *shash = session->fields[httpHostField]->shash;
+    if (moloch_field_get(session, httpHostField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, httpHostField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             if (hstring->str[0] == 'h') {
                 if (memcmp(hstring->str, "http://", 7) == 0)
@@ -538,8 +538,8 @@ void wise_plugin_pre_save(MolochSession_t *session, int UNUSED(final))
                 wise_lookup_domain(session, iRequest, hstring->str);
         );
     }
-    if (session->fields[dnsHostField]) {
-        MolochStringHashStd_t *shash = session->fields[dnsHostField]->shash;
+    if (moloch_field_get(session, dnsHostField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, dnsHostField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             if (hstring->str[0] == '<')
                 continue;
@@ -548,30 +548,30 @@ void wise_plugin_pre_save(MolochSession_t *session, int UNUSED(final))
     }
 
     //MD5s
-    if (session->fields[httpMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[httpMd5Field]->shash;
+    if (moloch_field_get(session, httpMd5Field)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, httpMd5Field)->shash;
         HASH_FORALL(s_, *shash, hstring,
             wise_lookup(session, iRequest, hstring->str, INTEL_TYPE_MD5);
         );
     }
 
-    if (session->fields[emailMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[emailMd5Field]->shash;
+    if (moloch_field_get(session, emailMd5Field)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailMd5Field)->shash;
         HASH_FORALL(s_, *shash, hstring,
             wise_lookup(session, iRequest, hstring->str, INTEL_TYPE_MD5);
         );
     }
 
     //Email
-    if (session->fields[emailSrcField]) {
-        MolochStringHashStd_t *shash = session->fields[emailSrcField]->shash;
+    if (moloch_field_get(session, emailSrcField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailSrcField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             wise_lookup(session, iRequest, hstring->str, INTEL_TYPE_EMAIL);
         );
     }
 
-    if (session->fields[emailDstField]) {
-        MolochStringHashStd_t *shash = session->fields[emailDstField]->shash;
+    if (moloch_field_get(session, emailDstField)) {
+        MolochStringHashStd_t *shash = moloch_field_get(session, emailDstField)->shash;
         HASH_FORALL(s_, *shash, hstring,
             wise_lookup(session, iRequest, hstring->str, INTEL_TYPE_EMAIL);
         );
@@ -1,5 +1,11 @@
 /******************************************************************************/
 /* reader-libpcap-file.c  -- Reader using libpcap to a file
+ *
+ * Classic pcap files are mmaped and parsed here instead of going thru
+ * pcap_dispatch, so packets point straight into the mapping, nothing is
+ * copied unless it has to outlive the packet thread, and readerFilePos is
+ * just a pointer subtraction.  libpcap still opens every file, so it checks
+ * the header and compiles the filters, and reads anything else like pcapng.
  *
  * Copyright 2012-2016 AOL Inc. All rights reserved.
  *
@@ -19,6 +25,8 @@
 #include "moloch.h"
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <gio/gio.h>
 #include "pcap.h"
 
@@ -27,17 +35,54 @@ extern MolochPcapFileHdr_t   pcapFileHeader;
 extern MolochConfig_t        config;
 
 static pcap_t               *pcap;
-static FILE                 *offlineFile = 0;
 
 extern void                 *esServer;
 LOCAL  MolochStringHead_t    monitorQ;
 
 LOCAL  char                  offlinePcapFilename[PATH_MAX+1];
-LOCAL  char                 *offlinePcapName;
 
 void reader_libpcapfile_opened();
 
-static struct bpf_program   *bpf_programs[MOLOCH_FILTER_MAX];
+
+/* Everything about one input file.  A mapped file stays mapped until the
+ * reader and every packet pointing into it are done.
+ */
+typedef struct molochpcapfile_t {
+    struct molochpcapfile_t *file_next, *file_prev;
+    pcap_t                  *pcap;
+    MolochPacketBatch_t     *batch;
+    char                    *name;
+    uint8_t                 *data;
+    uint64_t                 size;
+    uint64_t                 pos;
+    uint64_t                 advised;
+    uint32_t                 refs;
+    uint8_t                  readerPos;
+    uint8_t                  swap;
+    uint8_t                  nano;
+    uint8_t                  haveBpf;
+    int                      complete;
+    struct bpf_program       bpf;
+    char                     filename[PATH_MAX+1];
+} MolochPcapFile_t;
+
+typedef struct {
+    struct molochpcapfile_t *file_next, *file_prev;
+    int                      file_count;
+    MOLOCH_LOCK_EXTERN(lock);
+    MOLOCH_COND_EXTERN(lock);
+} MolochPcapFileHead_t;
+
+#define MOLOCH_PCAP_READAHEAD (16*1024*1024)
+#define MOLOCH_PCAP_MAX_READERS MOLOCH_MAX_READER_POS
+
+LOCAL  int                   offlineMmap;
+LOCAL  int                   readerThreads;
+LOCAL  int                   activeFiles;
+LOCAL  int                   readersPaused;
+LOCAL  int                   firstLinktype = -1;
+LOCAL  MolochPcapFile_t     *pcapFile;
+LOCAL  MolochPcapFileHead_t  fileQ;
 
 /******************************************************************************/
 void reader_libpcapfile_monitor_dir(char *dirname);
@@ -298,6 +343,12 @@ gboolean reader_libpcapfile_monitor_gfunc (gpointer UNUSED(user_data))
     if (DLL_COUNT(s_, &monitorQ) == 0)
         return TRUE;
 
+    // With reader threads this timer runs forever and keeps them all busy
+    if (readerThreads > 1) {
+        while (activeFiles < readerThreads && DLL_COUNT(s_, &monitorQ) > 0 && reader_libpcapfile_next());
+        return TRUE;
+    }
+
     if (reader_libpcapfile_next()) {
         return FALSE;
     }
@@ -322,9 +373,10 @@ int reader_libpcapfile_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
-void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+void reader_libpcapfile_pcap_cb(u_char *filev, const struct pcap_pkthdr *h, const u_char *bytes)
 {
-    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    MolochPcapFile_t *file = (MolochPcapFile_t *)filev;
+    MolochPacket_t   *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
 
     if (unlikely(h->caplen != h->len)) {
         if (!config.readTruncatedPackets) {
@@ -340,9 +392,131 @@ void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *
 
     packet->pkt           = (u_char *)bytes;
     packet->ts            = h->ts;
-    packet->readerFilePos = ftell(offlineFile) - 16 - h->len;
-    packet->readerName    = offlinePcapName;
-    moloch_packet(packet);
+    packet->readerFilePos = ftell(pcap_file(file->pcap)) - 16 - h->len;
+    packet->readerName    = file->name;
+    packet->readerPos     = file->readerPos;
+    moloch_packet_batch(file->batch, packet);
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_file_unref(MolochPcapFile_t *file)
+{
+    if (__sync_sub_and_fetch(&file->refs, 1) > 0)
+        return;
+
+    if (file->data)
+        munmap(file->data, file->size);
+    MOLOCH_TYPE_FREE(MolochPcapFile_t, file);
+}
+/******************************************************************************/
+/* Called by whatever thread frees or copies a packet pointing into a map */
+void reader_libpcapfile_release(MolochPacket_t *packet)
+{
+    reader_libpcapfile_file_unref(packet->readerData);
+}
+/******************************************************************************/
+#define PCAP_MAP32(x) (file->swap?__builtin_bswap32(x):(x))
+
+/* Like pcap_dispatch for a mapped file, returns records read, 0 at the end
+ * of the file and -1 on a corrupt file
+ */
+LOCAL int reader_libpcapfile_mmap_dispatch(MolochPcapFile_t *file, int cnt)
+{
+    // Keep the kernel reading ahead of us
+    if (file->pos + MOLOCH_PCAP_READAHEAD/2 > file->advised && file->advised < file->size) {
+        uint64_t len = MIN(MOLOCH_PCAP_READAHEAD, file->size - file->advised);
+        madvise(file->data + file->advised, len, MADV_WILLNEED);
+        file->advised += len;
+    }
+
+    int i;
+    for (i = 0; i < cnt && file->pos < file->size; i++) {
+        if (file->pos + 16 > file->size) {
+            LOG("ERROR - Truncated packet header at %" PRIu64 " in %s", file->pos, file->filename);
+            return -1;
+        }
+
+        // Records aren't aligned
+        uint32_t hdr[4];
+        memcpy(hdr, file->data + file->pos, 16);
+        const uint32_t  caplen = PCAP_MAP32(hdr[2]);
+        const uint32_t  len    = PCAP_MAP32(hdr[3]);
+
+        if (caplen > MOLOCH_PACKET_MAX_LEN - 1 || file->pos + 16 + caplen > file->size) {
+            LOG("ERROR - Bad packet length %u at %" PRIu64 " in %s", caplen, file->pos, file->filename);
+            return -1;
+        }
+
+        uint8_t  *data = file->data + file->pos + 16;
+        uint64_t  pos = file->pos;
+        file->pos += 16 + caplen;
+
+        if (file->haveBpf && !bpf_filter(file->bpf.bf_insns, data, len, caplen))
+            continue;
+
+        if (unlikely(caplen != len)) {
+            if (!config.readTruncatedPackets) {
+                LOG("ERROR - Moloch requires full packet captures caplen: %d pktlen: %d. "
+                    "If using tcpdump use the \"-s0\" option, or set readTruncatedPackets in ini file",
+                    caplen, len);
+                exit (0);
+            }
+        }
+
+        MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+        packet->pkt           = data;
+        packet->pktlen        = caplen;
+        packet->ts.tv_sec     = PCAP_MAP32(hdr[0]);
+        packet->ts.tv_usec    = file->nano?PCAP_MAP32(hdr[1])/1000:PCAP_MAP32(hdr[1]);
+        packet->readerFilePos = pos;
+        packet->readerName    = file->name;
+        packet->readerPos     = file->readerPos;
+        packet->borrowed      = 1;
+        packet->readerData    = file;
+        __sync_add_and_fetch(&file->refs, 1);
+
+        moloch_packet_batch(file->batch, packet);
+    }
+
+    return i;
+}
+/******************************************************************************/
+/* Read up to cnt packets from the file with whichever method it was opened */
+LOCAL int reader_libpcapfile_dispatch(MolochPcapFile_t *file, int cnt)
+{
+    MolochPacketBatch_t batch;
+    moloch_packet_batch_init(&batch);
+    file->batch = &batch;
+
+    int r;
+    if (file->data)
+        r = reader_libpcapfile_mmap_dispatch(file, cnt);
+    else
+        r = pcap_dispatch(file->pcap, cnt, reader_libpcapfile_pcap_cb, (u_char *)file);
+
+    moloch_packet_batch_flush(&batch);
+    file->batch = 0;
+    return r;
+}
+/******************************************************************************/
+/* Finished with a file, always on the main thread */
+LOCAL void reader_libpcapfile_file_done(MolochPcapFile_t *file)
+{
+    if (config.pcapDelete && file->complete) {
+        if (config.debug)
+            LOG("Deleting %s", file->filename);
+        int rc = unlink(file->filename);
+        if (rc != 0)
+            LOG("Failed to delete file %s %s (%d)", file->filename, strerror(errno), errno);
+    }
+
+    if (file->pcap == pcap)
+        pcap = 0;
+    pcap_close(file->pcap);
+    if (file->haveBpf)
+        pcap_freecode(&file->bpf);
+
+    // Packets still in the packet threads keep the mapping around
+    reader_libpcapfile_file_unref(file);
 }
 /******************************************************************************/
 gboolean reader_libpcapfile_read()
@@ -362,18 +536,14 @@ gboolean reader_libpcapfile_read()
         return TRUE;
     }
 
-    int r = pcap_dispatch(pcap, 10000, reader_libpcapfile_pcap_cb, NULL);
+    int r = reader_libpcapfile_dispatch(pcapFile, 10000);
 
     // Some kind of failure, move to the next file or quit
     if (r <= 0) {
-        if (config.pcapDelete && r == 0) {
-            if (config.debug)
-                LOG("Deleting %s", offlinePcapFilename);
-            int rc = unlink(offlinePcapFilename);
-            if (rc != 0)
-                LOG("Failed to delete file %s %s (%d)", offlinePcapFilename, strerror(errno), errno);
-        }
-        pcap_close(pcap);
+        pcapFile->complete = (r == 0);
+        reader_libpcapfile_file_done(pcapFile);
+        pcapFile = 0;
+
         if (reader_libpcapfile_next()) {
             return FALSE;
         }
@@ -388,72 +558,180 @@ gboolean reader_libpcapfile_read()
     return TRUE;
 }
 /******************************************************************************/
-int reader_libpcapfile_should_filter(const MolochPacket_t *packet, enum MolochFilterType *type, int *index)
+/* A reader thread finished a file, start the next ones */
+LOCAL gboolean reader_libpcapfile_thread_done_gfunc(gpointer filev)
 {
-    int t, i;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        for (i = 0; i < config.bpfsNum[t]; i++) {
-            if (bpf_filter(bpf_programs[t][i].bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
-                *type = t;
-                *index = i;
-                return 1;
+    reader_libpcapfile_file_done(filev);
+    activeFiles--;
+
+    while (activeFiles < readerThreads && reader_libpcapfile_next());
+
+    if (activeFiles == 0 && !config.pcapMonitor)
+        moloch_quit();
+    return FALSE;
+}
+/******************************************************************************/
+/* The writer and ES queue lengths are main thread only, so the main thread
+ * checks them for the reader threads and sets readersPaused.
+ */
+LOCAL gboolean reader_libpcapfile_pause_gfunc(gpointer UNUSED(user_data))
+{
+    int paused = moloch_writer_queue_length() > 10 || moloch_http_queue_length(esServer) > 100;
+    __atomic_store_n(&readersPaused, paused, __ATOMIC_RELAXED);
+    return TRUE;
+}
+/******************************************************************************/
+LOCAL void *reader_libpcapfile_thread(gpointer posv)
+{
+    MolochPcapFile_t *file;
+
+    while (1) {
+        MOLOCH_LOCK(fileQ.lock);
+        while (DLL_COUNT(file_, &fileQ) == 0) {
+            MOLOCH_COND_WAIT(fileQ.lock);
+        }
+        DLL_POP_HEAD(file_, &fileQ, file);
+        MOLOCH_UNLOCK(fileQ.lock);
+
+        file->readerPos = (long)posv;
+
+        while (1) {
+            // Same back pressure as the main loop reader
+            if (__atomic_load_n(&readersPaused, __ATOMIC_RELAXED) ||
+                moloch_packet_outstanding() > (int32_t)(config.maxPacketsInQueue/2)) {
+                usleep(1000);
+                continue;
+            }
+
+            int r = reader_libpcapfile_dispatch(file, 10000);
+            if (r <= 0) {
+                file->complete = (r == 0);
+                break;
             }
         }
+
+        g_idle_add(reader_libpcapfile_thread_done_gfunc, file);
     }
-    return 0;
+    return NULL;
+}
+/******************************************************************************/
+/* Map the file if it is a classic pcap file, otherwise libpcap reads it */
+LOCAL int reader_libpcapfile_mmap_open(MolochPcapFile_t *file)
+{
+    struct stat st;
+    uint32_t    magic;
+
+    int fd = open(file->filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 24 || read(fd, &magic, 4) != 4) {
+        close(fd);
+        return 0;
+    }
+
+    switch (magic) {
+    case 0xa1b2c3d4:
+        file->swap = 0; file->nano = 0;
+        break;
+    case 0xd4c3b2a1:
+        file->swap = 1; file->nano = 0;
+        break;
+    case 0xa1b23c4d:
+        file->swap = 0; file->nano = 1;
+        break;
+    case 0x4d3cb2a1:
+        file->swap = 1; file->nano = 1;
+        break;
+    default:
+        close(fd);
+        return 0;
+    }
+
+    // Read only, a writable private map is commit charge for the whole file
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG("WARNING - Couldn't mmap %s, using libpcap: %s", file->filename, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+
+    file->data = data;
+    file->size = st.st_size;
+    file->pos = 24;
+    return 1;
 }
 /******************************************************************************/
 void reader_libpcapfile_opened()
 {
     int dlt_to_linktype(int dlt);
 
-    pcapFileHeader.linktype = dlt_to_linktype(pcap_datalink(pcap)) | pcap_datalink_ext(pcap);
-    pcapFileHeader.snaplen = pcap_snapshot(pcap);
+    int linktype = dlt_to_linktype(pcap_datalink(pcap)) | pcap_datalink_ext(pcap);
 
-    offlineFile = pcap_file(pcap);
+    // Reader threads share one pcapFileHeader and one set of filters
+    if (readerThreads > 1 && firstLinktype != -1 && linktype != firstLinktype) {
+        LOG("ERROR - Skipping %s, link type %d doesn't match %d of the first file, use offlineReaderThreads=1",
+            offlinePcapFilename, linktype, firstLinktype);
+        pcap_close(pcap);
+        pcap = 0;
+        return;
+    }
 
-    if (config.bpf) {
-        struct bpf_program   bpf;
+    MolochPcapFile_t *file = MOLOCH_TYPE_ALLOC0(MolochPcapFile_t);
+    file->pcap = pcap;
+    file->refs = 1;
+    strcpy(file->filename, offlinePcapFilename);
+    // Packets and writer-inplace's file ids use the name after the file is
+    // freed, so names are interned instead of copied for every file
+    file->name = (char *)g_intern_string(offlinePcapFilename);
+
+    int mapped = offlineMmap && reader_libpcapfile_mmap_open(file);
 
-        if (pcap_compile(pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+    if (config.bpf) {
+        if (pcap_compile(pcap, &file->bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
             LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
             exit(1);
         }
+        file->haveBpf = 1;
 
-	if (pcap_setfilter(pcap, &bpf) == -1) {
+        if (!mapped && pcap_setfilter(pcap, &file->bpf) == -1) {
             LOG("ERROR - Couldn't set filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
             exit(1);
         }
     }
 
-    int t;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        if (config.bpfsNum[t]) {
-            int i;
-            if (bpf_programs[t]) {
-                for (i = 0; i < config.bpfsNum[t]; i++) {
-                    pcap_freecode(&bpf_programs[t][i]);
-                }
-            } else {
-                bpf_programs[t] = malloc(config.bpfsNum[t]*sizeof(struct bpf_program));
-            }
-            for (i = 0; i < config.bpfsNum[t]; i++) {
-                if (pcap_compile(pcap, &bpf_programs[t][i], config.bpfs[t][i], 1, PCAP_NETMASK_UNKNOWN) == -1) {
-                    LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpfs[t][i], pcap_geterr(pcap));
-                    exit(1);
-                }
-            }
-            moloch_reader_should_filter = reader_libpcapfile_should_filter;
-        }
+    if (readerThreads > 1 && firstLinktype != -1) {
+        // Already set up by the first file
+    } else {
+        firstLinktype = linktype;
+        pcapFileHeader.linktype = linktype;
+        pcapFileHeader.snaplen = pcap_snapshot(pcap);
+        moloch_readers_filters_init(pcap_datalink(pcap), pcap_snapshot(pcap));
     }
 
-    if (config.flushBetween)
+    // Other files are still being read with reader threads
+    if (config.flushBetween && readerThreads == 1)
         moloch_session_flush();
 
-    offlinePcapName = strdup(offlinePcapFilename);
+    // Hand the file to a reader thread
+    if (readerThreads > 1) {
+        activeFiles++;
+        MOLOCH_LOCK(fileQ.lock);
+        DLL_PUSH_TAIL(file_, &fileQ, file);
+        MOLOCH_COND_SIGNAL(fileQ.lock);
+        MOLOCH_UNLOCK(fileQ.lock);
+        return;
+    }
+
+    pcapFile = file;
 
     int fd = pcap_fileno(pcap);
-    if (fd == -1) {
+    if (mapped) {
+        g_idle_add(reader_libpcapfile_read, NULL);
+    } else if (fd == -1) {
         g_timeout_add(0, reader_libpcapfile_read, NULL);
     } else {
         moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
@@ -462,6 +740,25 @@ void reader_libpcapfile_opened()
 
 /******************************************************************************/
 void reader_libpcapfile_start() {
+    if (readerThreads > 1) {
+        long i;
+        for (i = 0; i < readerThreads; i++) {
+            char name[100];
+            snprintf(name, sizeof(name), "moloch-file%ld", i);
+            g_thread_new(name, &reader_libpcapfile_thread, (gpointer)(i + 1));
+        }
+        g_timeout_add(10, reader_libpcapfile_pause_gfunc, 0);
+
+        while (activeFiles < readerThreads && reader_libpcapfile_next());
+
+        if (config.pcapMonitor) {
+            g_timeout_add(100, reader_libpcapfile_monitor_gfunc, 0);
+        } else if (activeFiles == 0) {
+            moloch_quit();
+        }
+        return;
+    }
+
     reader_libpcapfile_next();
     if (!pcap) {
         if (config.pcapMonitor) {
@@ -476,9 +773,16 @@ void reader_libpcapfile_init(char *UNUSED(name))
 {
     moloch_reader_start         = reader_libpcapfile_start;
     moloch_reader_stats         = reader_libpcapfile_stats;
+    moloch_reader_release       = reader_libpcapfile_release;
+
+    offlineMmap = moloch_config_boolean(NULL, "offlineMmap", TRUE);
+    readerThreads = moloch_config_int(NULL, "offlineReaderThreads", 1, 1, MOLOCH_PCAP_MAX_READERS);
 
     if (config.pcapMonitor)
         reader_libpcapfile_init_monitor();
 
     DLL_INIT(s_, &monitorQ);
+    DLL_INIT(file_, &fileQ);
+    MOLOCH_LOCK_INIT(fileQ.lock);
+    MOLOCH_COND_INIT(fileQ.lock);
 }
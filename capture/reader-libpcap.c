@@ -29,7 +29,6 @@ extern MolochConfig_t        config;
 #define MAX_INTERFACES 10
 static pcap_t               *pcaps[MAX_INTERFACES];
 
-static struct bpf_program   *bpf_programs[MOLOCH_FILTER_MAX];
 
 /******************************************************************************/
 int reader_libpcap_stats(MolochReaderStats_t *stats)
@@ -51,7 +50,7 @@ int reader_libpcap_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
-void reader_libpcap_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+void reader_libpcap_pcap_cb(u_char *batch, const struct pcap_pkthdr *h, const u_char *bytes)
 {
     if (unlikely(h->caplen != h->len)) {
         LOG("ERROR - Moloch requires full packet captures caplen: %d pktlen: %d\n"
@@ -66,7 +65,7 @@ void reader_libpcap_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, c
     packet->ts            = h->ts;
     packet->pktlen        = h->len;
 
-    moloch_packet(packet);
+    moloch_packet_batch((MolochPacketBatch_t *)batch, packet);
 }
 /******************************************************************************/
 static void *reader_libpcap_thread(gpointer pcapv)
@@ -74,11 +73,15 @@ static void *reader_libpcap_thread(gpointer pcapv)
     pcap_t *pcap = pcapv;
     LOG("THREAD %p", (gpointer)pthread_self());
 
+    MolochPacketBatch_t batch;
+    moloch_packet_batch_init(&batch);
+
     while (1) {
-        int r = pcap_loop(pcap, -1, reader_libpcap_pcap_cb, NULL);
+        int r = pcap_dispatch(pcap, 10000, reader_libpcap_pcap_cb, (u_char *)&batch);
+        moloch_packet_batch_flush(&batch);
 
         // Some kind of failure we quit
-        if (unlikely(r <= 0)) {
+        if (unlikely(r < 0)) {
             moloch_quit();
             pcap = 0;
             break;
@@ -89,21 +92,6 @@ static void *reader_libpcap_thread(gpointer pcapv)
     return NULL;
 }
 /******************************************************************************/
-int reader_libpcap_should_filter(const MolochPacket_t *packet, enum MolochFilterType *type, int *index)
-{
-    int t, i;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        for (i = 0; i < config.bpfsNum[t]; i++) {
-            if (bpf_filter(bpf_programs[t][i].bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
-                *type = t;
-                *index = i;
-                return 1;
-            }
-        }
-    }
-    return 0;
-}
-/******************************************************************************/
 void reader_libpcap_start() {
     int dlt_to_linktype(int dlt);
 
@@ -111,27 +99,7 @@ void reader_libpcap_start() {
     pcapFileHeader.linktype = dlt_to_linktype(pcap_datalink(pcaps[0])) | pcap_datalink_ext(pcaps[0]);
     pcapFileHeader.snaplen = pcap_snapshot(pcaps[0]);
 
-    pcap_t *dpcap = pcap_open_dead(pcapFileHeader.linktype, pcapFileHeader.snaplen);
-    int t;
-    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
-        if (config.bpfsNum[t]) {
-            int i;
-            if (bpf_programs[t]) {
-                for (i = 0; i < config.bpfsNum[t]; i++) {
-                    pcap_freecode(&bpf_programs[t][i]);
-                }
-            } else {
-                bpf_programs[t] = malloc(config.bpfsNum[t]*sizeof(struct bpf_program));
-            }
-            for (i = 0; i < config.bpfsNum[t]; i++) {
-                if (pcap_compile(dpcap, &bpf_programs[t][i], config.bpfs[t][i], 1, PCAP_NETMASK_UNKNOWN) == -1) {
-                    LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpfs[t][i], pcap_geterr(dpcap));
-                    exit(1);
-                }
-            }
-            moloch_reader_should_filter = reader_libpcap_should_filter;
-        }
-    }
+    moloch_readers_filters_init(pcapFileHeader.linktype, pcapFileHeader.snaplen);
 
     int i;
     for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
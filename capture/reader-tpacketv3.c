@@ -0,0 +1,361 @@
+/******************************************************************************/
+/* reader-tpacketv3.c  -- Reader using AF_PACKET TPACKET_V3 rings
+ *
+ * Each reader thread maps its own TPACKET_V3 ring and all the threads of an
+ * interface join one PACKET_FANOUT group, so the kernel spreads a single
+ * interface over tpacketv3NumThreads threads.  Packets are handed to the
+ * packet threads pointing straight into the ring, a block is only given back
+ * to the kernel once every packet in it has been freed or copied.
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "moloch.h"
+#include <errno.h>
+
+extern MolochConfig_t        config;
+extern MolochPcapFileHdr_t   pcapFileHeader;
+
+#ifdef __linux__
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "pcap.h"
+
+#define MAX_INTERFACES 10
+#define MAX_THREADS    16
+
+typedef struct {
+    struct tpacket_block_desc *desc;
+    uint32_t                   refs;
+} MolochTPacketV3Block_t;
+
+typedef struct {
+    int                        fd;
+    int                        interfacePos;
+    uint8_t                   *map;
+    MolochTPacketV3Block_t    *blocks;
+    uint32_t                   pos;
+} MolochTPacketV3_t;
+
+LOCAL MolochTPacketV3_t        infos[MAX_INTERFACES][MAX_THREADS];
+LOCAL int                      numThreads;
+LOCAL int                      blockSize;
+LOCAL int                      numBlocks;
+LOCAL int                      stopping;
+LOCAL uint64_t                 totalPackets;
+LOCAL uint64_t                 totalDropped;
+
+
+/******************************************************************************/
+int reader_tpacketv3_stats(MolochReaderStats_t *stats)
+{
+    struct tpacket_stats_v3 tpstats;
+    int i, t;
+
+    // The kernel resets the counters on every read
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        for (t = 0; t < numThreads; t++) {
+            socklen_t len = sizeof(tpstats);
+            if (getsockopt(infos[i][t].fd, SOL_PACKET, PACKET_STATISTICS, &tpstats, &len) != 0)
+                continue;
+            totalDropped += tpstats.tp_drops;
+            totalPackets += tpstats.tp_packets;
+        }
+    }
+
+    stats->dropped = totalDropped;
+    stats->total = totalPackets;
+    return 0;
+}
+/******************************************************************************/
+LOCAL void reader_tpacketv3_block_unref(MolochTPacketV3Block_t *block)
+{
+    if (__sync_sub_and_fetch(&block->refs, 1) == 0) {
+        __atomic_store_n(&block->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    }
+}
+/******************************************************************************/
+/* Called by whatever thread frees or copies a packet pointing into a block */
+void reader_tpacketv3_release(MolochPacket_t *packet)
+{
+    reader_tpacketv3_block_unref(packet->readerData);
+}
+/******************************************************************************/
+LOCAL void reader_tpacketv3_block(MolochTPacketV3_t *info, MolochTPacketV3Block_t *block, MolochPacketBatch_t *batch)
+{
+    struct tpacket_block_desc *desc = block->desc;
+    struct tpacket3_hdr       *th = (struct tpacket3_hdr *)((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+    uint32_t                   p;
+
+    // Hold a ref while walking so the block isn't given back under us
+    block->refs = 1;
+
+    for (p = 0; p < desc->hdr.bh1.num_pkts; p++, th = (struct tpacket3_hdr *)((uint8_t *)th + th->tp_next_offset)) {
+        if (unlikely(th->tp_snaplen != th->tp_len)) {
+            LOG("ERROR - Moloch requires full packet captures caplen: %d pktlen: %d\n"
+                "turning offloading off may fix, something like 'ethtool -K %s tx off sg off gro off gso off lro off tso off'",
+                th->tp_snaplen, th->tp_len, config.interface[info->interfacePos]);
+            exit (0);
+        }
+
+        MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+        uint8_t        *data = (uint8_t *)th + th->tp_mac;
+
+        packet->ts.tv_sec     = th->tp_sec;
+        packet->ts.tv_usec    = th->tp_nsec/1000;
+
+        if (th->tp_status & TP_STATUS_VLAN_VALID) {
+            // The kernel stripped the vlan tag, put it back which means a copy
+            packet->pktlen    = th->tp_snaplen + 4;
+            packet->pkt       = moloch_packet_buf_alloc(packet->pktlen);
+            packet->copied    = 1;
+            memcpy(packet->pkt, data, 12);
+            packet->pkt[12]   = 0x81;
+            packet->pkt[13]   = 0x00;
+            packet->pkt[14]   = th->hv1.tp_vlan_tci >> 8;
+            packet->pkt[15]   = th->hv1.tp_vlan_tci & 0xff;
+            memcpy(packet->pkt + 16, data + 12, th->tp_snaplen - 12);
+        } else {
+            packet->pkt        = data;
+            packet->pktlen     = th->tp_snaplen;
+            packet->borrowed   = 1;
+            packet->readerData = block;
+            __sync_add_and_fetch(&block->refs, 1);
+        }
+
+        moloch_packet_batch(batch, packet);
+    }
+
+    moloch_packet_batch_flush(batch);
+    reader_tpacketv3_block_unref(block);
+}
+/******************************************************************************/
+LOCAL void *reader_tpacketv3_thread(gpointer infov)
+{
+    MolochTPacketV3_t *info = infov;
+    MolochPacketBatch_t batch;
+
+    moloch_packet_batch_init(&batch);
+
+    while (!stopping) {
+        MolochTPacketV3Block_t *block = &info->blocks[info->pos];
+
+        // Packet threads still have packets from our last trip around the ring
+        if (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) != 0) {
+            usleep(100);
+            continue;
+        }
+
+        // Wait for the kernel to fill the block
+        if (!(__atomic_load_n(&block->desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            struct pollfd pfd = {info->fd, POLLIN | POLLERR, 0};
+            if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+                LOG("ERROR - poll failed on %s: %s", config.interface[info->interfacePos], strerror(errno));
+                moloch_quit();
+                break;
+            }
+            continue;
+        }
+
+        reader_tpacketv3_block(info, block, &batch);
+        info->pos = (info->pos + 1) % numBlocks;
+    }
+    return NULL;
+}
+/******************************************************************************/
+void reader_tpacketv3_start() {
+    pcapFileHeader.linktype = 1;
+    pcapFileHeader.snaplen = MOLOCH_SNAPLEN;
+
+    moloch_readers_filters_init(pcapFileHeader.linktype, pcapFileHeader.snaplen);
+
+    int i, t;
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        for (t = 0; t < numThreads; t++) {
+            char name[100];
+            snprintf(name, sizeof(name), "moloch-af3%d-%d", i, t);
+            g_thread_new(name, &reader_tpacketv3_thread, &infos[i][t]);
+        }
+    }
+}
+/******************************************************************************/
+void reader_tpacketv3_stop()
+{
+    stopping = 1;
+}
+/******************************************************************************/
+LOCAL void reader_tpacketv3_open(MolochTPacketV3_t *info, int ifindex, int fanoutGroup, int fanoutType, struct sock_fprog *filter)
+{
+    const char *interface = config.interface[info->interfacePos];
+    int         version = TPACKET_V3;
+    int         i;
+
+    info->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (info->fd < 0) {
+        LOG("ERROR - Couldn't create AF_PACKET socket for %s: %s", interface, strerror(errno));
+        exit(1);
+    }
+
+    if (setsockopt(info->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        LOG("ERROR - Couldn't use TPACKET_V3 on %s: %s", interface, strerror(errno));
+        exit(1);
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = blockSize;
+    req.tp_block_nr         = numBlocks;
+    req.tp_frame_size       = MOLOCH_SNAPLEN;
+    req.tp_frame_nr         = (blockSize / MOLOCH_SNAPLEN) * numBlocks;
+    req.tp_retire_blk_tov   = 60;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+    if (setsockopt(info->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        LOG("ERROR - Couldn't create %d x %d ring on %s: %s", numBlocks, blockSize, interface, strerror(errno));
+        exit(1);
+    }
+
+    info->map = mmap(NULL, (size_t)blockSize * numBlocks, PROT_READ | PROT_WRITE, MAP_SHARED, info->fd, 0);
+    if (info->map == MAP_FAILED) {
+        LOG("ERROR - Couldn't map ring for %s: %s", interface, strerror(errno));
+        exit(1);
+    }
+
+    info->blocks = malloc(numBlocks * sizeof(MolochTPacketV3Block_t));
+    for (i = 0; i < numBlocks; i++) {
+        info->blocks[i].desc = (struct tpacket_block_desc *)(info->map + (size_t)i * blockSize);
+        info->blocks[i].refs = 0;
+    }
+
+    if (filter && setsockopt(info->fd, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(*filter)) < 0) {
+        LOG("ERROR - Couldn't set filter '%s' on %s: %s", config.bpf, interface, strerror(errno));
+        exit(1);
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family   = PF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex  = ifindex;
+
+    if (bind(info->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+        LOG("ERROR - Couldn't bind to %s: %s", interface, strerror(errno));
+        exit(1);
+    }
+
+    struct packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type    = PACKET_MR_PROMISC;
+    if (setsockopt(info->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        LOG("ERROR - Couldn't set promiscuous mode on %s: %s", interface, strerror(errno));
+        exit(1);
+    }
+
+    if (numThreads > 1) {
+        int fanout = fanoutGroup | (fanoutType << 16);
+        if (setsockopt(info->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+            LOG("ERROR - Couldn't join fanout group %d on %s: %s", fanoutGroup, interface, strerror(errno));
+            exit(1);
+        }
+    }
+}
+/******************************************************************************/
+void reader_tpacketv3_init(char *UNUSED(name))
+{
+    numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, MAX_THREADS);
+    blockSize  = moloch_config_int(NULL, "tpacketv3BlockSize", 1 << 21, 1 << 16, 1 << 30);
+    numBlocks  = moloch_config_int(NULL, "tpacketv3NumBlocks", 64, 2, 0x10000);
+
+    if (blockSize % getpagesize() != 0 || blockSize % MOLOCH_SNAPLEN != 0) {
+        LOG("ERROR - tpacketv3BlockSize %d must be a multiple of the page size and %d", blockSize, MOLOCH_SNAPLEN);
+        exit(1);
+    }
+
+    char *fanoutStr = moloch_config_str(NULL, "tpacketv3Fanout", "hash");
+    int   fanoutType;
+    if (strcmp(fanoutStr, "hash") == 0)
+        fanoutType = PACKET_FANOUT_HASH;
+    else if (strcmp(fanoutStr, "cpu") == 0)
+        fanoutType = PACKET_FANOUT_CPU;
+    else if (strcmp(fanoutStr, "lb") == 0)
+        fanoutType = PACKET_FANOUT_LB;
+    else {
+        LOG("ERROR - Unknown tpacketv3Fanout '%s', must be hash, cpu or lb", fanoutStr);
+        exit(1);
+    }
+    g_free(fanoutStr);
+
+    // Compile the capture filter once, the kernel runs it before the ring
+    struct sock_fprog  filter, *filterp = NULL;
+    struct bpf_program bpf;
+    if (config.bpf) {
+        pcap_t *dpcap = pcap_open_dead(DLT_EN10MB, MOLOCH_SNAPLEN);
+        if (pcap_compile(dpcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(dpcap));
+            exit(1);
+        }
+        pcap_close(dpcap);
+        filter.len    = bpf.bf_len;
+        filter.filter = (struct sock_filter *)bpf.bf_insns;
+        filterp = &filter;
+    }
+
+    int i, t;
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++);
+    if (i == MAX_INTERFACES) {
+        LOG("Only support up to %d interfaces", MAX_INTERFACES);
+        exit(1);
+    }
+    if (i * numThreads > MOLOCH_MAX_READER_THREADS) {
+        LOG("ERROR - %d interfaces with tpacketv3NumThreads %d is more then %d reader threads", i, numThreads, MOLOCH_MAX_READER_THREADS);
+        exit(1);
+    }
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        int ifindex = if_nametoindex(config.interface[i]);
+        if (!ifindex) {
+            LOG("ERROR - Unknown interface %s", config.interface[i]);
+            exit(1);
+        }
+
+        // Fanout groups are per network namespace, so mix in the pid
+        int fanoutGroup = (getpid() * MAX_INTERFACES + i) & 0xffff;
+        for (t = 0; t < numThreads; t++) {
+            infos[i][t].interfacePos = i;
+            reader_tpacketv3_open(&infos[i][t], ifindex, fanoutGroup, fanoutType, filterp);
+        }
+    }
+
+    if (filterp)
+        pcap_freecode(&bpf);
+
+    moloch_reader_start         = reader_tpacketv3_start;
+    moloch_reader_stop          = reader_tpacketv3_stop;
+    moloch_reader_stats         = reader_tpacketv3_stats;
+    moloch_reader_release       = reader_tpacketv3_release;
+}
+#else
+/******************************************************************************/
+void reader_tpacketv3_init(char *UNUSED(name))
+{
+    LOG("ERROR - pcapReadMethod tpacketv3 is only supported on linux");
+    exit(1);
+}
+#endif
@@ -1,5 +1,10 @@
 /******************************************************************************/
 /* readers.c  -- Functions dealing with pcap readers
+ *
+ * The dontSaveBPFs and minPacketsSaveBPFs rules are merged here into one
+ * bpf program for all readers.  Each rule's accept returns its rule number
+ * and its reject jumps to the start of the next rule, so deciding a new
+ * session direction is one bpf_filter call no matter how many rules.
  *
  * Copyright 2012-2016 AOL Inc. All rights reserved.
  *
@@ -17,6 +22,7 @@
  */
 
 #include "moloch.h"
+#include "pcap.h"
 
 extern MolochConfig_t        config;
 
@@ -24,11 +30,17 @@ static MolochStringHashStd_t readersHash;
 
 void reader_libpcapfile_init(char*);
 void reader_libpcap_init(char*);
+void reader_tpacketv3_init(char*);
 
 MolochReaderStart  moloch_reader_start;
 MolochReaderStats  moloch_reader_stats;
 MolochReaderFilter moloch_reader_should_filter;
 MolochReaderStop   moloch_reader_stop;
+MolochReaderRelease moloch_reader_release;
+MolochReaderBypass  moloch_reader_bypass;
+
+LOCAL struct bpf_insn     *filterInsns;
+LOCAL int                  filterRules[MOLOCH_FILTER_MAX];
 
 
 /******************************************************************************/
@@ -47,6 +59,90 @@ void moloch_readers_set(char *name) {
     func(name);
 }
 /******************************************************************************/
+LOCAL int moloch_readers_should_filter(const MolochPacket_t *packet, enum MolochFilterType *type, int *index)
+{
+    int rule = bpf_filter(filterInsns, packet->pkt, packet->pktlen, packet->pktlen);
+    if (rule == 0)
+        return 0;
+
+    rule--;
+    int t;
+    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
+        if (rule < filterRules[t]) {
+            *type = t;
+            *index = rule;
+            return 1;
+        }
+        rule -= filterRules[t];
+    }
+    return 0;
+}
+/******************************************************************************/
+/* Compile the save filters for the dlt and merge them into one program that
+ * returns 0 for no match or 1 + the rule number, dontSaveBPFs first.
+ */
+void moloch_readers_filters_init(int dlt, int snaplen)
+{
+    struct bpf_program *programs[MOLOCH_FILTER_MAX];
+    int                 t, i, total = 0, rules = 0;
+
+    if (config.bpfsNum[MOLOCH_FILTER_DONT_SAVE] == 0 && config.bpfsNum[MOLOCH_FILTER_MIN_SAVE] == 0)
+        return;
+
+    pcap_t *dpcap = pcap_open_dead(dlt, snaplen);
+    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
+        programs[t] = malloc(config.bpfsNum[t]*sizeof(struct bpf_program) + 1);
+        for (i = 0; i < config.bpfsNum[t]; i++) {
+            if (pcap_compile(dpcap, &programs[t][i], config.bpfs[t][i], 1, PCAP_NETMASK_UNKNOWN) == -1) {
+                LOG("ERROR - Couldn't compile filter: '%s' with %s", config.bpfs[t][i], pcap_geterr(dpcap));
+                exit(1);
+            }
+            // Plus 2 insns to clear A and X before each rule
+            total += programs[t][i].bf_len + 2;
+        }
+        filterRules[t] = config.bpfsNum[t];
+    }
+    pcap_close(dpcap);
+
+    if (filterInsns)
+        free(filterInsns);
+    filterInsns = malloc(total * sizeof(struct bpf_insn));
+
+    int pos = 0;
+    for (t = 0; t < MOLOCH_FILTER_MAX; t++) {
+        for (i = 0; i < config.bpfsNum[t]; i++) {
+            struct bpf_program *prog = &programs[t][i];
+            int                 last = (rules + 1 == config.bpfsNum[0] + config.bpfsNum[1]);
+            int                 next = pos + 2 + prog->bf_len;   // start of the next rule
+            int                 j;
+
+            rules++;
+            filterInsns[pos++] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_IMM, 0);
+            filterInsns[pos++] = (struct bpf_insn)BPF_STMT(BPF_LDX|BPF_IMM, 0);
+
+            for (j = 0; j < (int)prog->bf_len; j++, pos++) {
+                struct bpf_insn insn = prog->bf_insns[j];
+                if (BPF_CLASS(insn.code) == BPF_RET) {
+                    if (BPF_RVAL(insn.code) != BPF_K) {
+                        LOG("ERROR - Filter '%s' doesn't return a constant", config.bpfs[t][i]);
+                        exit(1);
+                    }
+                    if (insn.k != 0) {
+                        insn.k = rules;
+                    } else if (!last) {
+                        insn = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JA, next - pos - 1, 0, 0);
+                    }
+                }
+                filterInsns[pos] = insn;
+            }
+            pcap_freecode(prog);
+        }
+        free(programs[t]);
+    }
+
+    moloch_reader_should_filter = moloch_readers_should_filter;
+}
+/******************************************************************************/
 void moloch_readers_add(char *name, MolochReaderInit func) {
     moloch_string_add(&readersHash, name, func, TRUE);
 }
@@ -56,6 +152,7 @@ void moloch_readers_init()
     HASH_INIT(s_, readersHash, moloch_string_hash, moloch_string_cmp);
     moloch_readers_add("libpcap-file", reader_libpcapfile_init);
     moloch_readers_add("libpcap", reader_libpcap_init);
+    moloch_readers_add("tpacketv3", reader_tpacketv3_init);
 }
 /******************************************************************************/
 void moloch_readers_exit()
@@ -16,12 +16,15 @@
  */
 
 #include <arpa/inet.h>
+#include <stddef.h>
+#include <errno.h>
 #include "moloch.h"
+#include "ohash.h"
 
 /******************************************************************************/
 extern MolochConfig_t        config;
 extern uint32_t              pluginsCbs;
-extern time_t                lastPacketSecs[MOLOCH_MAX_PACKET_THREADS];
+extern time_t                lastPacketSecs[MOLOCH_MAX_PACKET_THREADS][MOLOCH_MAX_READER_POS];
 
 /******************************************************************************/
 
@@ -32,102 +35,157 @@ LOCAL int                   protocolField;
 LOCAL MolochSessionHead_t   closingQ[MOLOCH_MAX_PACKET_THREADS];
 MolochSessionHead_t         tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 
-typedef HASHP_VAR(h_, MolochSessionHash_t, MolochSessionHead_t);
-
 LOCAL MolochSessionHead_t   sessionsQ[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
-LOCAL MolochSessionHash_t   sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
+LOCAL OHash_t               sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
 LOCAL int needSave[MOLOCH_MAX_PACKET_THREADS];
 
+/* Which packet thread owns each hash bucket and how many sessions it has
+ * there, only the owning thread changes either.
+ */
+volatile uint8_t            sessionThreadMap[MOLOCH_SESSION_BUCKETS];
+LOCAL uint32_t              bucketSessions[MOLOCH_SESSION_BUCKETS];
+
+/* Estimated memory held by each thread's sessions, only the owner changes it */
+LOCAL int64_t               sessionMem[MOLOCH_MAX_PACKET_THREADS];
+
+/* How many of the least recently used sessions to look at for a big one */
+#define MOLOCH_SESSION_EVICT_SCAN 32
+
+typedef struct moloch_session_arena {
+    struct moloch_session_arena *next;
+    uint32_t                     used;
+    uint32_t                     size;
+    uint64_t                     data[];
+} MolochSessionArena_t;
+
+#define MOLOCH_SESSION_ARENA_EXTRA 1024
+
+/* The hot part of MolochSession_t must stay in the first five cache lines */
+typedef char moloch_session_hot_check[(offsetof(MolochSession_t, lastFileNum) + sizeof(uint32_t) <= 5*64)?1:-1];
+
+/* Per thread hierarchical timer wheel keyed on packet time.  Level 0 has one
+ * second slots, each level up covers 64 times more.  Sessions are scheduled
+ * lazily, new packets don't move the timer, instead when it fires we check
+ * if the session really is due and reschedule it if not.  Stretches with
+ * nothing due are skipped a block at a time instead of a second at a time.
+ */
+#define MOLOCH_WHEEL_BITS   6
+#define MOLOCH_WHEEL_SIZE   (1 << MOLOCH_WHEEL_BITS)
+#define MOLOCH_WHEEL_MASK   (MOLOCH_WHEEL_SIZE - 1)
+#define MOLOCH_WHEEL_LEVELS 4
+#define MOLOCH_WHEEL_RANGE  (1U << (MOLOCH_WHEEL_BITS * MOLOCH_WHEEL_LEVELS))
+
+typedef struct {
+    MolochSessionHead_t  slots[MOLOCH_WHEEL_LEVELS * MOLOCH_WHEEL_SIZE];
+    uint32_t             now;          // last second fully processed
+    uint32_t             count;
+    uint32_t             levelCount[MOLOCH_WHEEL_LEVELS];
+} MolochSessionWheel_t;
+
+/* Largest timeout, a wheel whose packet time goes back more than this is
+ * rebuilt instead of waiting for time to catch up
+ */
+LOCAL uint32_t              wheelMaxTimeout;
+
+/* How far ahead of the wall clock live packet time may get */
+#define MOLOCH_WHEEL_LIVE_SLACK 5
+
+/* Files read at the same time can be days apart, so each reader position has
+ * its own packet clock and wheel, created the first time it is used.  Live
+ * capture only uses position 0.
+ */
+LOCAL MolochSessionWheel_t *wheels[MOLOCH_MAX_PACKET_THREADS][MOLOCH_MAX_READER_POS];
+LOCAL int                   wheelsNum[MOLOCH_MAX_PACKET_THREADS];
+
+#define MOLOCH_SESSION_POS(session) ((session)->sessionId.pad[0])
+
+/* Commands for a packet thread are pushed on a lock free stack by any thread,
+ * the packet thread takes the whole stack with one exchange and reverses it
+ * to run them in the order they were added.
+ */
 typedef struct molochsescmd {
-    struct molochsescmd *cmd_next, *cmd_prev;
+    struct molochsescmd *cmd_next;
 
-    MolochSession_t *session;
+    MolochSession_t *session;       // NULL for thread commands
     MolochSesCmd     cmd;
     gpointer         uw1;
     gpointer         uw2;
-    MolochCmd_func   func;
+    union {
+        MolochCmd_func       func;
+        MolochThreadCmd_func threadFunc;
+    };
 } MolochSesCmd_t;
 
 typedef struct {
-    struct molochsescmd *cmd_next, *cmd_prev;
-    int                  cmd_count;
-    MOLOCH_LOCK_EXTERN(lock);
+    MolochSesCmd_t      *head;          // newest first
+    volatile int         count;         // added and not finished yet
+    char                 pad[64 - sizeof(MolochSesCmd_t *) - sizeof(int)];
 } MolochSesCmdHead_t;
 
 LOCAL MolochSesCmdHead_t   sessionCmds[MOLOCH_MAX_PACKET_THREADS];
+LOCAL MolochSesCmd_t      *sessionCmdsLeft[MOLOCH_MAX_PACKET_THREADS]; // oldest first, only the packet thread uses
 
 
 /******************************************************************************/
-void moloch_session_id (char *buf, uint32_t addr1, uint16_t port1, uint32_t addr2, uint16_t port2)
-{
-    buf[0] = 13;
-    if (addr1 < addr2) {
-        memcpy(buf+1, &addr1, 4);
-        memcpy(buf+5, &port1, 2);
-        memcpy(buf+7, &addr2, 4);
-        memcpy(buf+11, &port2, 2);
-    } else if (addr1 > addr2) {
-        memcpy(buf+1, &addr2, 4);
-        memcpy(buf+5, &port2, 2);
-        memcpy(buf+7, &addr1, 4);
-        memcpy(buf+11, &port1, 2);
-    } else if (ntohs(port1) < ntohs(port2)) {
-        memcpy(buf+1, &addr1, 4);
-        memcpy(buf+5, &port1, 2);
-        memcpy(buf+7, &addr2, 4);
-        memcpy(buf+11, &port2, 2);
+void moloch_session_id (MolochSessionId_t *id, uint32_t addr1, uint16_t port1, uint32_t addr2, uint16_t port2)
+{
+    id->w[0] = 0;
+    id->len = MOLOCH_SESSIONID4_LEN;
+    if (addr1 < addr2 || (addr1 == addr2 && ntohs(port1) < ntohs(port2))) {
+        id->port1 = port1;
+        id->port2 = port2;
+        id->v4.addr1 = addr1;
+        id->v4.addr2 = addr2;
     } else {
-        memcpy(buf+1, &addr2, 4);
-        memcpy(buf+5, &port2, 2);
-        memcpy(buf+7, &addr1, 4);
-        memcpy(buf+11, &port1, 2);
+        id->port1 = port2;
+        id->port2 = port1;
+        id->v4.addr1 = addr2;
+        id->v4.addr2 = addr1;
     }
 }
 /******************************************************************************/
-void moloch_session_id6 (char *buf, uint8_t *addr1, uint16_t port1, uint8_t *addr2, uint16_t port2)
+void moloch_session_id6 (MolochSessionId_t *id, uint8_t *addr1, uint16_t port1, uint8_t *addr2, uint16_t port2)
 {
-    buf[0] = 37;
     int cmp = memcmp(addr1, addr2, 16);
-    if (cmp < 0) {
-        memcpy(buf+1, addr1, 16);
-        memcpy(buf+17, &port1, 2);
-        memcpy(buf+19, addr2, 16);
-        memcpy(buf+35, &port2, 2);
-    } else if (cmp > 0) {
-        memcpy(buf+1, addr2, 16);
-        memcpy(buf+17, &port2, 2);
-        memcpy(buf+19, addr1, 16);
-        memcpy(buf+35, &port1, 2);
-    } else if (ntohs(port1) < ntohs(port2)) {
-        memcpy(buf+1, addr1, 16);
-        memcpy(buf+17, &port1, 2);
-        memcpy(buf+19, addr2, 16);
-        memcpy(buf+35, &port2, 2);
+
+    id->w[0] = 0;
+    id->len = MOLOCH_SESSIONID6_LEN;
+    if (cmp < 0 || (cmp == 0 && ntohs(port1) < ntohs(port2))) {
+        id->port1 = port1;
+        id->port2 = port2;
+        memcpy(id->v6.addr1, addr1, 16);
+        memcpy(id->v6.addr2, addr2, 16);
     } else {
-        memcpy(buf+1, addr2, 16);
-        memcpy(buf+17, &port2, 2);
-        memcpy(buf+19, addr1, 16);
-        memcpy(buf+35, &port1, 2);
+        id->port1 = port2;
+        id->port2 = port1;
+        memcpy(id->v6.addr1, addr2, 16);
+        memcpy(id->v6.addr2, addr1, 16);
     }
 }
 /******************************************************************************/
-char *moloch_session_id_string (char *sessionId, char *buf)
+char *moloch_session_id_string (MolochSessionId_t *id, char *buf)
 {
     // ALW: Rewrite to make pretty
-    return moloch_sprint_hex_string(buf, (uint8_t *)sessionId, sessionId[0]);
+    return moloch_sprint_hex_string(buf, (uint8_t *)id, id->len);
 }
 /******************************************************************************/
-/* Must match moloch_session_cmp and moloch_session_id
- * a1 0-3
- * p1 4-5
- * a2 6-9
- * p2 10-11
+/* Multiply xorshift over the key words, every byte of the key matters and
+ * both the high bits (packet thread) and low bits (session table) are mixed.
  */
 uint32_t moloch_session_hash(const void *key)
 {
-    unsigned char *p = (unsigned char *)key;
-    //return ((p[2] << 16 | p[3] << 8 | p[4]) * 59) ^ (p[8] << 16 | p[9] << 8 |  p[10]);
-    return (((p[1]<<24) ^ (p[2]<<18) ^ (p[3]<<12) ^ (p[4]<<6) ^ p[5]) * 13) ^ (p[8]<<24|p[9]<<16 | p[10]<<8 | p[11]);
+    const MolochSessionId_t *id = key;
+    const int                num = id->len >> 3;
+    uint64_t                 h = 0;
+    int                      i;
+
+    for (i = 0; i < num; i++) {
+        h = (h ^ id->w[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return h;
 }
 
 /******************************************************************************/
@@ -135,7 +193,18 @@ int moloch_session_cmp(const void *keyv, const void *elementv)
 {
     MolochSession_t *session = (MolochSession_t *)elementv;
 
-    return memcmp(keyv, session->sessionId, MIN(((uint8_t *)keyv)[0], session->sessionId[0])) == 0;
+    return moloch_session_id_cmp(keyv, &session->sessionId);
+}
+/******************************************************************************/
+LOCAL void moloch_session_push_cmd(int thread, MolochSesCmd_t *cmd)
+{
+    MolochSesCmdHead_t *cmds = &sessionCmds[thread];
+    __sync_add_and_fetch(&cmds->count, 1);
+
+    cmd->cmd_next = __atomic_load_n(&cmds->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cmds->head, &cmd->cmd_next, cmd, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    moloch_packet_thread_wake(thread);
 }
 /******************************************************************************/
 void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd icmd, gpointer uw1, gpointer uw2, MolochCmd_func func)
@@ -146,10 +215,21 @@ void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd icmd, gpointe
     cmd->uw1 = uw1;
     cmd->uw2 = uw2;
     cmd->func = func;
-    MOLOCH_LOCK(sessionCmds[session->thread].lock);
-    DLL_PUSH_TAIL(cmd_, &sessionCmds[session->thread], cmd);
-    moloch_packet_thread_wake(session->thread);
-    MOLOCH_UNLOCK(sessionCmds[session->thread].lock);
+    moloch_session_push_cmd(session->thread, cmd);
+}
+/******************************************************************************/
+/* Run func on a packet thread between packets, for work on the thread's
+ * sessions as a whole instead of one session.
+ */
+void moloch_session_add_thread_cmd(int thread, MolochThreadCmd_func func, gpointer uw1, gpointer uw2)
+{
+    MolochSesCmd_t *cmd = MOLOCH_TYPE_ALLOC(MolochSesCmd_t);
+    cmd->cmd = MOLOCH_SES_CMD_THREAD;
+    cmd->session = NULL;
+    cmd->uw1 = uw1;
+    cmd->uw2 = uw2;
+    cmd->threadFunc = func;
+    moloch_session_push_cmd(thread, cmd);
 }
 /******************************************************************************/
 void moloch_session_get_tag_cb(void *sessionV, int tagType, const char *tagName, uint32_t tag, gboolean async)
@@ -172,14 +252,15 @@ gboolean moloch_session_has_tag(MolochSession_t *session, const char *tagName)
 {
     uint32_t tagValue;
 
-    if (!session->fields[tagsField])
+    MolochField_t *field = moloch_field_get(session, tagsField);
+    if (!field)
         return FALSE;
 
     if ((tagValue = moloch_db_peek_tag(tagName)) == 0)
         return FALSE;
 
     MolochInt_t          *hint;
-    HASH_FIND_INT(i_, *(session->fields[tagsField]->ihash), tagValue, hint);
+    HASH_FIND_INT(i_, *(field->ihash), tagValue, hint);
     return hint != 0;
 }
 /******************************************************************************/
@@ -190,11 +271,12 @@ void moloch_session_add_protocol(MolochSession_t *session, const char *protocol)
 /******************************************************************************/
 gboolean moloch_session_has_protocol(MolochSession_t *session, const char *protocol)
 {
-    if (!session->fields[protocolField])
+    MolochField_t *field = moloch_field_get(session, protocolField);
+    if (!field)
         return FALSE;
 
     MolochString_t          *hstring;
-    HASH_FIND(s_, *(session->fields[protocolField]->shash), protocol, hstring);
+    HASH_FIND(s_, *(field->shash), protocol, hstring);
     return hstring != 0;
 }
 /******************************************************************************/
@@ -228,6 +310,188 @@ void moloch_session_add_tag_type(MolochSession_t *session, int tagtype, const ch
     }
 }
 /******************************************************************************/
+LOCAL void moloch_session_save(MolochSession_t *session);
+/******************************************************************************/
+/* The second after which the session needs to be looked at */
+LOCAL uint32_t moloch_session_deadline(MolochSession_t *session)
+{
+    if (session->closingQ)
+        return session->saveTime;
+
+    return MIN(session->lastPacket.tv_sec + config.timeouts[session->ses], session->saveTime);
+}
+/******************************************************************************/
+LOCAL MolochSessionWheel_t *moloch_session_wheel(int thread, int pos)
+{
+    MolochSessionWheel_t *wheel = wheels[thread][pos];
+    int                   i;
+
+    if (wheel)
+        return wheel;
+
+    wheel = MOLOCH_TYPE_ALLOC0(MolochSessionWheel_t);
+    for (i = 0; i < MOLOCH_WHEEL_LEVELS * MOLOCH_WHEEL_SIZE; i++) {
+        DLL_INIT(tw_, &wheel->slots[i]);
+    }
+    wheels[thread][pos] = wheel;
+    if (pos >= wheelsNum[thread])
+        wheelsNum[thread] = pos + 1;
+    return wheel;
+}
+/******************************************************************************/
+/* Schedule for twExpire, but never before minExpire */
+LOCAL void moloch_session_wheel_insert(MolochSessionWheel_t *wheel, MolochSession_t *session, uint32_t minExpire)
+{
+    uint32_t expire = MAX(session->twExpire, minExpire);
+    uint32_t delta = expire - wheel->now;
+    int      level;
+
+    for (level = 0; level < MOLOCH_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1U << (MOLOCH_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    // Past the end of the wheel, park in the furthest slot and recheck then
+    if (delta >= MOLOCH_WHEEL_RANGE)
+        expire = wheel->now + MOLOCH_WHEEL_RANGE - 1;
+
+    session->twSlot = level * MOLOCH_WHEEL_SIZE + ((expire >> (MOLOCH_WHEEL_BITS * level)) & MOLOCH_WHEEL_MASK);
+    DLL_PUSH_TAIL(tw_, &wheel->slots[session->twSlot], session);
+    wheel->count++;
+    wheel->levelCount[level]++;
+}
+/******************************************************************************/
+LOCAL void moloch_session_timer_cancel(MolochSession_t *session)
+{
+    if (!session->tw_next)
+        return;
+
+    MolochSessionWheel_t *wheel = moloch_session_wheel(session->thread, MOLOCH_SESSION_POS(session));
+    DLL_REMOVE(tw_, &wheel->slots[session->twSlot], session);
+    wheel->count--;
+    wheel->levelCount[session->twSlot / MOLOCH_WHEEL_SIZE]--;
+}
+/******************************************************************************/
+LOCAL void moloch_session_timer_schedule(MolochSession_t *session)
+{
+    MolochSessionWheel_t *wheel = moloch_session_wheel(session->thread, MOLOCH_SESSION_POS(session));
+
+    moloch_session_timer_cancel(session);
+    session->twExpire = moloch_session_deadline(session) + 1;
+    moloch_session_wheel_insert(wheel, session, wheel->now + 1);
+}
+/******************************************************************************/
+/* Same rules the old queue walking used, things happen once the packet time
+ * is past the deadline.
+ */
+LOCAL void moloch_session_timer_fire(MolochSession_t *session, uint32_t now)
+{
+    // Packets the readers dropped for us still count, and keep it alive
+    if (session->bypassed)
+        moloch_packet_bypass_sync(session, FALSE);
+
+    if (session->closingQ) {
+        if (session->saveTime < now) {
+            moloch_session_save(session);
+            return;
+        }
+    } else {
+        if ((uint64_t)session->lastPacket.tv_sec + config.timeouts[session->ses] < now) {
+            moloch_session_save(session);
+            return;
+        }
+
+        if (session->tcp_next && session->saveTime < now) {
+            moloch_session_mid_save(session, now);
+        }
+    }
+
+    session->twExpire = moloch_session_deadline(session) + 1;
+    moloch_session_wheel_insert(moloch_session_wheel(session->thread, MOLOCH_SESSION_POS(session)), session, now + 1);
+}
+/******************************************************************************/
+/* Put everything back in around target.  When packet time went back, sessions
+ * last seen after target would wait for it to catch up, so they are saved.
+ */
+LOCAL void moloch_session_wheel_rebuild(MolochSessionWheel_t *wheel, uint32_t target)
+{
+    MolochSessionHead_t all;
+    MolochSession_t    *session;
+    const int           back = target <= wheel->now;
+    int                 i;
+
+    DLL_INIT(tw_, &all);
+    for (i = 0; i < MOLOCH_WHEEL_LEVELS * MOLOCH_WHEEL_SIZE; i++) {
+        while (DLL_POP_HEAD(tw_, &wheel->slots[i], session)) {
+            DLL_PUSH_TAIL(tw_, &all, session);
+        }
+    }
+    wheel->count = 0;
+    memset(wheel->levelCount, 0, sizeof(wheel->levelCount));
+    wheel->now = target - 1;
+
+    while (DLL_POP_HEAD(tw_, &all, session)) {
+        if (back && (uint32_t)session->lastPacket.tv_sec > target)
+            moloch_session_save(session);
+        else
+            moloch_session_wheel_insert(wheel, session, target);
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_session_wheel_advance(MolochSessionWheel_t *wheel, uint32_t target)
+{
+    MolochSession_t      *session;
+    int                   level;
+
+    if (target <= wheel->now) {
+        if (wheel->now - target > wheelMaxTimeout)
+            moloch_session_wheel_rebuild(wheel, target);
+        return;
+    }
+
+    // Nothing to do per second, or too far to step, so rebuild around target
+    if (wheel->count == 0 || target - wheel->now >= MOLOCH_WHEEL_RANGE)
+        moloch_session_wheel_rebuild(wheel, target);
+
+    while (wheel->now < target) {
+        // Lower levels empty means nothing happens before the next block at
+        // the first level that isn't, so jump to just before it
+        int empty;
+        for (empty = 0; empty < MOLOCH_WHEEL_LEVELS && wheel->levelCount[empty] == 0; empty++);
+
+        if (empty > 0) {
+            const uint32_t next = empty == MOLOCH_WHEEL_LEVELS?target + 1:((wheel->now >> (MOLOCH_WHEEL_BITS * empty)) + 1) << (MOLOCH_WHEEL_BITS * empty);
+            if (next > target) {
+                wheel->now = target;
+                break;
+            }
+            wheel->now = next - 1;
+        }
+
+        const uint32_t now = ++wheel->now;
+
+        // Crossed into a new block at higher levels, spread it out below
+        for (level = MOLOCH_WHEEL_LEVELS - 1; level > 0; level--) {
+            if (now & ((1U << (MOLOCH_WHEEL_BITS * level)) - 1))
+                continue;
+
+            MolochSessionHead_t *slot = &wheel->slots[level * MOLOCH_WHEEL_SIZE + ((now >> (MOLOCH_WHEEL_BITS * level)) & MOLOCH_WHEEL_MASK)];
+            while (DLL_POP_HEAD(tw_, slot, session)) {
+                wheel->count--;
+                wheel->levelCount[level]--;
+                moloch_session_wheel_insert(wheel, session, now);
+            }
+        }
+
+        MolochSessionHead_t *slot = &wheel->slots[now & MOLOCH_WHEEL_MASK];
+        while (DLL_POP_HEAD(tw_, slot, session)) {
+            wheel->count--;
+            wheel->levelCount[0]--;
+            moloch_session_timer_fire(session, now);
+        }
+    }
+}
+/******************************************************************************/
 void moloch_session_mark_for_close (MolochSession_t *session, int ses)
 {
     session->closingQ = 1;
@@ -238,6 +502,34 @@ void moloch_session_mark_for_close (MolochSession_t *session, int ses)
     if (session->tcp_next) {
         DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
     }
+
+    // Closing is usually sooner then the idle timeout
+    moloch_session_timer_schedule(session);
+}
+/******************************************************************************/
+/* Zeroed memory that lives as long as the session, freed all at once in
+ * moloch_session_free.  The first chunk is sized for the plugin array plus
+ * the first few field slots and hashes, so most sessions only have the one.
+ */
+void *moloch_session_arena_alloc(MolochSession_t *session, int size)
+{
+    MolochSessionArena_t *arena = session->arena;
+    void                 *mem;
+
+    size = (size + 7) & ~7;
+
+    if (!arena || arena->used + size > arena->size) {
+        int asize = MOLOCH_SESSION_ARENA_EXTRA + (arena?size:(int)sizeof(void *)*config.numPlugins);
+        arena = MOLOCH_SIZE_ALLOC0(arena, sizeof(MolochSessionArena_t) + asize);
+        arena->size = asize;
+        arena->next = session->arena;
+        session->arena = arena;
+        moloch_session_mem_add(session, sizeof(MolochSessionArena_t) + asize);
+    }
+
+    mem = (char *)arena->data + arena->used;
+    arena->used += size;
+    return mem;
 }
 /******************************************************************************/
 void moloch_session_free (MolochSession_t *session)
@@ -262,20 +554,28 @@ void moloch_session_free (MolochSession_t *session)
         free(session->parserInfo);
     }
 
-    if (session->pluginData)
-        MOLOCH_SIZE_FREE(pluginData, session->pluginData);
     moloch_field_free(session);
 
     moloch_packet_tcp_free(session);
 
+    MolochSessionArena_t *arena;
+    while ((arena = session->arena)) {
+        session->arena = arena->next;
+        MOLOCH_SIZE_FREE(arena, arena);
+    }
+
+    sessionMem[session->thread] -= session->memSize;
     MOLOCH_TYPE_FREE(MolochSession_t, session);
 }
 /******************************************************************************/
 LOCAL void moloch_session_save(MolochSession_t *session)
 {
-    if (session->h_next) {
-        HASH_REMOVE(h_, sessions[session->thread][session->ses], session);
-    }
+    if (session->bypassed)
+        moloch_packet_bypass_sync(session, TRUE);
+
+    ohash_remove(&sessions[session->thread][session->ses], session->h_hash, session);
+    bucketSessions[MOLOCH_SESSION_BUCKET(session->h_hash)]--;
+    moloch_session_timer_cancel(session);
 
     if (session->closingQ) {
         DLL_REMOVE(q_, &closingQ[session->thread], session);
@@ -305,7 +605,10 @@ LOCAL void moloch_session_save(MolochSession_t *session)
         return;
     }
 
+    uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
     moloch_db_save_session(session, TRUE);
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_DB, statsTsc);
+    MOLOCH_STATS_COUNT(MOLOCH_STATS_SAVES, 1);
     moloch_session_free(session);
 }
 /******************************************************************************/
@@ -333,7 +636,10 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
         session->rootId = "ROOT";
     }
 
+    uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
     moloch_db_save_session(session, FALSE);
+    MOLOCH_STATS_RECORD(MOLOCH_STATS_DB, statsTsc);
+    MOLOCH_STATS_COUNT(MOLOCH_STATS_SAVES, 1);
     g_array_set_size(session->filePosArray, 0);
     g_array_set_size(session->fileLenArray, 0);
     g_array_set_size(session->fileNumArray, 0);
@@ -348,6 +654,11 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
         session->saveTime = tv_sec + config.tcpSaveTimeout;
     }
 
+    // Most fields were freed by the save
+    session->memSize -= session->memFields;
+    sessionMem[session->thread] -= session->memFields;
+    session->memFields = 0;
+
     session->bytes[0] = 0;
     session->bytes[1] = 0;
     session->databytes[0] = 0;
@@ -363,7 +674,10 @@ gboolean moloch_session_decr_outstanding(MolochSession_t *session)
     if (session->needSave && session->outstandingQueries == 0) {
         needSave[session->thread]--;
         session->needSave = 0; /* Stop endless loop if plugins add tags */
+        uint64_t statsTsc = MOLOCH_STATS_SAMPLE();
         moloch_db_save_session(session, TRUE);
+        MOLOCH_STATS_RECORD(MOLOCH_STATS_DB, statsTsc);
+        MOLOCH_STATS_COUNT(MOLOCH_STATS_SAVES, 1);
         moloch_session_free(session);
         return FALSE;
     }
@@ -386,9 +700,9 @@ int moloch_session_cmd_outstanding()
     int count = 0;
     int t;
     for (t = 0; t < config.packetThreads; t++) {
-        if (DLL_COUNT(cmd_, &sessionCmds[t]))
+        if (sessionCmds[t].count)
             moloch_packet_thread_wake(t);
-        count += DLL_COUNT(cmd_, &sessionCmds[t]);
+        count += sessionCmds[t].count;
     }
     return count;
 }
@@ -403,31 +717,35 @@ int moloch_session_need_save_outstanding()
     return count;
 }
 /******************************************************************************/
+int moloch_session_thread_cmds(int thread)
+{
+    return sessionCmdsLeft[thread] || __atomic_load_n(&sessionCmds[thread].head, __ATOMIC_ACQUIRE) != NULL;
+}
+/******************************************************************************/
 int moloch_session_thread_outstanding(int thread)
 {
-    return DLL_COUNT(q_, &closingQ[thread]) + DLL_COUNT(cmd_, &sessionCmds[thread]);
+    return DLL_COUNT(q_, &closingQ[thread]) + sessionCmds[thread].count;
 }
 /******************************************************************************/
-MolochSession_t *moloch_session_find(int ses, char *sessionId)
+MolochSession_t *moloch_session_find(int ses, MolochSessionId_t *sessionId)
 {
     MolochSession_t *session;
 
     uint32_t hash = moloch_session_hash(sessionId);
-    int      thread = hash % config.packetThreads;
+    int      thread = MOLOCH_SESSION_THREAD(hash);
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session = ohash_find(&sessions[thread][ses], hash, sessionId);
     return session;
 }
 /******************************************************************************/
 // Should only be used by packet, lots of side effects
-MolochSession_t *moloch_session_find_or_create(int ses, char *sessionId, int *isNew)
+MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, MolochSessionId_t *sessionId, int *isNew)
 {
     MolochSession_t *session;
 
-    uint32_t hash = moloch_session_hash(sessionId);
-    int      thread = hash % config.packetThreads;
+    int      thread = MOLOCH_SESSION_THREAD(hash);
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session = ohash_find(&sessions[thread][ses], hash, sessionId);
 
     if (session) {
         if (!session->closingQ) {
@@ -441,20 +759,26 @@ MolochSession_t *moloch_session_find_or_create(int ses, char *sessionId, int *is
     session = MOLOCH_TYPE_ALLOC0(MolochSession_t);
     session->ses = ses;
 
-    memcpy(session->sessionId, sessionId, sessionId[0]);
+    session->sessionId = *sessionId;
+    session->h_hash = hash;
 
-    HASH_ADD_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    ohash_add(&sessions[thread][ses], hash, session);
+    bucketSessions[MOLOCH_SESSION_BUCKET(hash)]++;
     DLL_PUSH_TAIL(q_, &sessionsQ[thread][ses], session);
 
-    session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 100);
-    session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 100);
+    // Most sessions are a few packets, let the arrays grow when needed
+    session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 16);
+    session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 16);
     session->fileNumArray = g_array_new(FALSE, FALSE, 4);
-    session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*config.maxField);
-    session->maxFields = config.maxField;
     session->thread = thread;
-    DLL_INIT(td_, &session->tcpData);
+    moloch_session_mem_add(session, sizeof(MolochSession_t) + 16 * (sizeof(uint64_t) + sizeof(uint16_t)));
     if (config.numPlugins > 0)
-        session->pluginData = MOLOCH_SIZE_ALLOC0(pluginData, sizeof(void *)*config.numPlugins);
+        session->pluginData = moloch_session_arena_alloc(session, sizeof(void *)*config.numPlugins);
+
+    // Caller fills in the real times, until then treat the session as brand new
+    session->lastPacket.tv_sec = lastPacketSecs[thread][sessionId->pad[0]];
+    session->saveTime = lastPacketSecs[thread][sessionId->pad[0]] + config.tcpSaveTimeout;
+    moloch_session_timer_schedule(session);
 
     return session;
 }
@@ -465,22 +789,98 @@ uint32_t moloch_session_monitoring()
     int      i;
 
     for (i = 0; i < config.packetThreads; i++) {
-        count += HASH_COUNT(h_, sessions[i][SESSION_TCP]) + HASH_COUNT(h_, sessions[i][SESSION_UDP]) + HASH_COUNT(h_, sessions[i][SESSION_ICMP]);
+        count += OHASH_COUNT(sessions[i][SESSION_TCP]) + OHASH_COUNT(sessions[i][SESSION_UDP]) + OHASH_COUNT(sessions[i][SESSION_ICMP]);
     }
     return count;
 }
 /******************************************************************************/
+void moloch_session_mem_add(MolochSession_t *session, int size)
+{
+    session->memSize += size;
+    sessionMem[session->thread] += size;
+}
+/******************************************************************************/
+void moloch_session_mem_fields(MolochSession_t *session, int size)
+{
+    session->memFields += size;
+    moloch_session_mem_add(session, size);
+}
+/******************************************************************************/
+uint64_t moloch_session_mem_size()
+{
+    int64_t size = 0;
+    int     t;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        size += sessionMem[t];
+    }
+    return MAX(size, 0);
+}
+/******************************************************************************/
+/* The thread is over its share of maxSessionMemory.  Look at the least
+ * recently used sessions, if one of them is much bigger than the average
+ * it goes first, mid saved when most of it is fields so it can keep going,
+ * otherwise the oldest session is saved.
+ */
+LOCAL int moloch_session_evict(int thread)
+{
+    MolochSession_t *session, *oldest = 0, *largest = 0;
+    int              ses, i, num = 0;
+
+    for (ses = 0; ses < SESSION_MAX; ses++) {
+        num += DLL_COUNT(q_, &sessionsQ[thread][ses]);
+
+        i = 0;
+        DLL_FOREACH(q_, &sessionsQ[thread][ses], session) {
+            if (i == 0 && (!oldest || session->lastPacket.tv_sec < oldest->lastPacket.tv_sec))
+                oldest = session;
+            if (!largest || session->memSize > largest->memSize)
+                largest = session;
+            if (++i == MOLOCH_SESSION_EVICT_SCAN)
+                break;
+        }
+    }
+
+    if (!oldest)
+        return 0;
+
+    if (largest->memSize >= 8 * (sessionMem[thread] / num)) {
+        if (largest->memFields > largest->memSize / 2) {
+            moloch_session_mid_save(largest, lastPacketSecs[thread][MOLOCH_SESSION_POS(largest)]);
+            MOLOCH_STATS_COUNT(MOLOCH_STATS_EVICT_MIDSAVE, 1);
+        } else {
+            moloch_session_save(largest);
+            MOLOCH_STATS_COUNT(MOLOCH_STATS_EVICT_LARGEST, 1);
+        }
+        return 1;
+    }
+
+    moloch_session_save(oldest);
+    MOLOCH_STATS_COUNT(MOLOCH_STATS_EVICT_OLDEST, 1);
+    return 1;
+}
+/******************************************************************************/
 void moloch_session_process_commands(int thread)
 {
-    // Commands
-    MolochSesCmd_t *cmd = 0;
+    // Commands, take them all at once and put them back in order, at most
+    // 100 a call with the rest run before any newer ones next time
+    MolochSesCmd_t *cmd = sessionCmdsLeft[thread];
+    MolochSesCmd_t *next;
     int count;
-    for (count = 0; count < 100; count++) {
-        MOLOCH_LOCK(sessionCmds[thread].lock);
-        DLL_POP_HEAD(cmd_, &sessionCmds[thread], cmd);
-        MOLOCH_UNLOCK(sessionCmds[thread].lock);
-        if (!cmd)
-            break;
+
+    if (!cmd) {
+        MolochSesCmd_t *chain = __atomic_exchange_n(&sessionCmds[thread].head, NULL, __ATOMIC_ACQUIRE);
+
+        while (chain) {
+            next = chain->cmd_next;
+            chain->cmd_next = cmd;
+            cmd = chain;
+            chain = next;
+        }
+    }
+
+    for (count = 0; cmd && count < 100; count++, cmd = next) {
+        next = cmd->cmd_next;
 
         switch (cmd->cmd) {
         case MOLOCH_SES_CMD_ADD_TAG:
@@ -490,48 +890,47 @@ void moloch_session_process_commands(int thread)
         case MOLOCH_SES_CMD_FUNC:
             cmd->func(cmd->session, cmd->uw1, cmd->uw2);
             break;
+        case MOLOCH_SES_CMD_THREAD:
+            cmd->threadFunc(thread, cmd->uw1, cmd->uw2);
+            break;
         default:
             LOG ("Unknown cmd %d", cmd->cmd);
         }
         MOLOCH_TYPE_FREE(MolochSesCmd_t, cmd);
     }
+    sessionCmdsLeft[thread] = cmd;
+    if (count)
+        __sync_sub_and_fetch(&sessionCmds[thread].count, count);
 
-    // Closing Q
-    for (count = 0; count < 100; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(q_, &closingQ[thread]);
-
-        if (session && session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_save(session);
-        } else {
-            break;
-        }
-    }
-
-    // Sessions Idle Long Time
+    // Too many sessions, save the least recently used
     int ses;
     for (ses = 0; ses < SESSION_MAX; ses++) {
-        for (count = 0; count < 100; count++) {
-            MolochSession_t *session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]);
-
-            if (session && (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams ||
-                            ((uint64_t)session->lastPacket.tv_sec + config.timeouts[ses] < (uint64_t)lastPacketSecs[thread]))) {
+        for (count = 0; count < 100 && DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams; count++) {
+            moloch_session_save(DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]));
+            MOLOCH_STATS_COUNT(MOLOCH_STATS_EVICT_STREAMS, 1);
+        }
+    }
 
-                moloch_session_save(session);
-            } else {
+    if (config.maxSessionMemory) {
+        for (count = 0; count < 100 && sessionMem[thread] > (int64_t)(config.maxSessionMemory / config.packetThreads); count++) {
+            if (!moloch_session_evict(thread))
                 break;
-            }
         }
     }
 
-    // TCP Sessions Open Long Time
-    for (count = 0; count < 100; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(tcp_, &tcpWriteQ[thread]);
+    // A live packet stamped in the future mustn't run the wheel ahead of the wall clock
+    if (!config.pcapReadOffline) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        if (lastPacketSecs[thread][0] > tv.tv_sec + MOLOCH_WHEEL_LIVE_SLACK)
+            lastPacketSecs[thread][0] = tv.tv_sec;
+    }
 
-        if (session && (uint64_t)session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_mid_save(session, lastPacketSecs[thread]);
-        } else {
-            break;
-        }
+    // Timeouts, mid saves and closing sessions, each reader position on its own clock
+    int pos;
+    for (pos = 0; pos < wheelsNum[thread]; pos++) {
+        if (wheels[thread][pos])
+            moloch_session_wheel_advance(wheels[thread][pos], lastPacketSecs[thread][pos]);
     }
 }
 
@@ -559,7 +958,7 @@ int moloch_session_idle_seconds(int ses)
         if (!session)
             continue;
 
-        tmp = lastPacketSecs[t] - (session->lastPacket.tv_sec + config.timeouts[ses]);
+        tmp = lastPacketSecs[t][MOLOCH_SESSION_POS(session)] - (session->lastPacket.tv_sec + config.timeouts[ses]);
         if (tmp > idle)
             idle = tmp;
     }
@@ -569,14 +968,8 @@ int moloch_session_idle_seconds(int ses)
 /******************************************************************************/
 void moloch_session_init()
 {
-    uint32_t primes[] = {10007, 49999, 99991, 199799, 400009, 500009, 732209, 1092757, 1299827, 1500007, 1987411, 2999999};
-
-    int p;
-    for (p = 0; p < 12; p++) {
-        if (primes[p] >= config.maxStreams/2)
-            break;
-    }
-    if (p == 12) p = 11;
+    // Tables grow on their own, start small so idle threads don't waste memory
+    uint32_t size = MIN(config.maxStreams, 0x10000);
 
     tagsField = moloch_field_by_db("ta");
 
@@ -593,20 +986,28 @@ void moloch_session_init()
         NULL);
 
     if (config.debug)
-        LOG("session hash size %d", primes[p]);
+        LOG("session hash initial size %d", size);
+
+    int b;
+    for (b = 0; b < MOLOCH_SESSION_BUCKETS; b++) {
+        sessionThreadMap[b] = b * config.packetThreads / MOLOCH_SESSION_BUCKETS;
+    }
 
     int t;
     for (t = 0; t < config.packetThreads; t++) {
-        HASHP_INIT(h_, sessions[t][SESSION_UDP], primes[p], moloch_session_hash, moloch_session_cmp);
-        HASHP_INIT(h_, sessions[t][SESSION_TCP], primes[p], moloch_session_hash, moloch_session_cmp);
-        HASHP_INIT(h_, sessions[t][SESSION_ICMP], primes[p], moloch_session_hash, moloch_session_cmp);
+        ohash_init(&sessions[t][SESSION_UDP], size, moloch_session_cmp);
+        ohash_init(&sessions[t][SESSION_TCP], size, moloch_session_cmp);
+        ohash_init(&sessions[t][SESSION_ICMP], size, moloch_session_cmp);
         DLL_INIT(q_, &sessionsQ[t][SESSION_UDP]);
         DLL_INIT(q_, &sessionsQ[t][SESSION_TCP]);
         DLL_INIT(q_, &sessionsQ[t][SESSION_ICMP]);
         DLL_INIT(tcp_, &tcpWriteQ[t]);
         DLL_INIT(q_, &closingQ[t]);
-        DLL_INIT(cmd_, &sessionCmds[t]);
-        MOLOCH_LOCK_INIT(sessionCmds[t].lock);
+    }
+
+    wheelMaxTimeout = config.tcpSaveTimeout;
+    for (t = 0; t < SESSION_MAX; t++) {
+        wheelMaxTimeout = MAX(wheelMaxTimeout, config.timeouts[t]);
     }
 
     moloch_add_can_quit(moloch_session_cmd_outstanding, "session commands outstanding");
@@ -614,18 +1015,23 @@ void moloch_session_init()
     moloch_add_can_quit(moloch_session_need_save_outstanding, "session save outstanding");
 }
 /******************************************************************************/
-static void moloch_session_flush_close(MolochSession_t *session, gpointer UNUSED(uw1), gpointer UNUSED(uw2))
+static void moloch_session_flush_close(int thread, gpointer UNUSED(uw1), gpointer UNUSED(uw2))
 {
-    int thread = session->thread;
-    int i;
+    MolochSession_t *session;
+    int              i;
 
     for (i = 0; i < SESSION_MAX; i++) {
-        HASH_FORALL_POP_HEAD(h_, sessions[thread][i], session,
+        OHASH_FORALL_POP(sessions[thread][i], session,
             moloch_session_save(session);
         );
     }
 }
 /******************************************************************************/
+uint32_t moloch_session_bucket_sessions(int bucket)
+{
+    return bucketSessions[bucket];
+}
+/******************************************************************************/
 /* Only called on main thread. Wait for all packet threads to be empty and then 
  * start the save process on sessions.
  */
@@ -633,13 +1039,394 @@ void moloch_session_flush()
 {
     moloch_packet_flush();
 
-    static MolochSession_t fakeSessions[MOLOCH_MAX_PACKET_THREADS];
+    int thread;
+    for (thread = 0; thread < config.packetThreads; thread++) {
+        moloch_session_add_thread_cmd(thread, moloch_session_flush_close, NULL, NULL);
+    }
+}
+/******************************************************************************/
+/* Session checkpoints.  At shutdown each packet thread writes the sessions it
+ * can carry over to sessionCheckpoint instead of saving them, and at startup
+ * before the reader starts each thread picks its sessions back out of the
+ * file.  The file is a header then one length prefixed record per session.
+ * Sessions that are closing, waiting on tag lookups, using a parser without
+ * checkpoint support (only dns and tls have it), with plugin data or with
+ * certs are saved as usual.
+ */
+#define MOLOCH_CHECKPOINT_MAGIC   0x4d4c434b
+#define MOLOCH_CHECKPOINT_VERSION 2
+#define MOLOCH_CHECKPOINT_MAX     0x40000
+
+#define MOLOCH_CHECKPOINT_EXPORT_u64(b, x) do { BSB_EXPORT_u32(b, (uint64_t)(x) >> 32); BSB_EXPORT_u32(b, (x) & 0xffffffff); } while (0)
+#define MOLOCH_CHECKPOINT_IMPORT_u64(b, x) do { uint32_t hi_ = 0, lo_ = 0; BSB_IMPORT_u32(b, hi_); BSB_IMPORT_u32(b, lo_); (x) = (uint64_t)hi_ << 32 | lo_; } while (0)
+
+LOCAL FILE                 *checkpointFile;
+LOCAL MOLOCH_LOCK_DEFINE(checkpointFile);
+LOCAL volatile int          checkpointOutstanding;
+LOCAL volatile int          checkpointWritten;
+LOCAL volatile int          checkpointFailed;
+
+LOCAL char                 *restoreData;
+LOCAL gsize                 restoreLen;
+LOCAL volatile int          restoreOutstanding;
+LOCAL volatile int          restoreCount;
+
+/******************************************************************************/
+LOCAL int moloch_session_checkpoint_ok(MolochSession_t *session)
+{
+    int i;
+
+    if (session->closingQ || session->outstandingQueries || session->needSave)
+        return FALSE;
+
+    for (i = 0; session->pluginData && i < config.numPlugins; i++) {
+        if (session->pluginData[i])
+            return FALSE;
+    }
+    return TRUE;
+}
+/******************************************************************************/
+LOCAL int moloch_session_checkpoint_write(MolochSession_t *session, BSB *bsb)
+{
+    uint32_t i;
+
+    unsigned char *lenPtr = BSB_WORK_PTR(*bsb);
+    BSB_EXPORT_u32(*bsb, 0);
+    BSB_EXPORT_ptr(*bsb, &session->sessionId, sizeof(MolochSessionId_t));
+    BSB_EXPORT_u08(*bsb, session->ses);
+    BSB_EXPORT_u08(*bsb, session->protocol);
+    BSB_EXPORT_u08(*bsb, session->tcp_flags);
+    BSB_EXPORT_u08(*bsb, session->ip_tos);
+    BSB_EXPORT_u08(*bsb, session->haveTcpSession | session->stopSPI << 1 | session->stopTCP << 2 | session->midSave << 3);
+    BSB_EXPORT_u16(*bsb, session->port1);
+    BSB_EXPORT_u16(*bsb, session->port2);
+    BSB_EXPORT_u16(*bsb, session->stopSaving);
+    BSB_EXPORT_u08(*bsb, session->minSaving);
+    BSB_EXPORT_ptr(*bsb, session->tcpState, 2);
+    BSB_EXPORT_u08(*bsb, session->firstBytesLen[0]);
+    BSB_EXPORT_u08(*bsb, session->firstBytesLen[1]);
+    BSB_EXPORT_ptr(*bsb, session->firstBytes, 16);
+    BSB_EXPORT_u08(*bsb, session->consumed[0]);
+    BSB_EXPORT_u08(*bsb, session->consumed[1]);
+    BSB_EXPORT_ptr(*bsb, session->addr1.s6_addr, 16);
+    BSB_EXPORT_ptr(*bsb, session->addr2.s6_addr, 16);
+    BSB_EXPORT_u32(*bsb, session->firstPacket.tv_sec);
+    BSB_EXPORT_u32(*bsb, session->firstPacket.tv_usec);
+    BSB_EXPORT_u32(*bsb, session->lastPacket.tv_sec);
+    BSB_EXPORT_u32(*bsb, session->lastPacket.tv_usec);
+    BSB_EXPORT_u32(*bsb, session->saveTime);
+    for (i = 0; i < 2; i++) {
+        BSB_EXPORT_u32(*bsb, session->packets[i]);
+        BSB_EXPORT_u32(*bsb, session->tcpSeq[i]);
+        MOLOCH_CHECKPOINT_EXPORT_u64(*bsb, session->bytes[i]);
+        MOLOCH_CHECKPOINT_EXPORT_u64(*bsb, session->databytes[i]);
+        MOLOCH_CHECKPOINT_EXPORT_u64(*bsb, session->totalDatabytes[i]);
+    }
+
+    // Where the packets since the last save are, those files are still there
+    BSB_EXPORT_u32(*bsb, session->filePosArray->len);
+    for (i = 0; i < session->filePosArray->len; i++) {
+        MOLOCH_CHECKPOINT_EXPORT_u64(*bsb, g_array_index(session->filePosArray, uint64_t, i));
+        BSB_EXPORT_u16(*bsb, g_array_index(session->fileLenArray, uint16_t, i));
+    }
+    BSB_EXPORT_u32(*bsb, session->fileNumArray->len);
+    for (i = 0; i < session->fileNumArray->len; i++) {
+        BSB_EXPORT_u32(*bsb, g_array_index(session->fileNumArray, uint32_t, i));
+    }
+    BSB_EXPORT_u32(*bsb, session->lastFileNum);
+
+    // Keeps linking the records of a long session together
+    i = session->rootId?strlen(session->rootId):0;
+    BSB_EXPORT_u16(*bsb, i);
+    if (i)
+        BSB_EXPORT_ptr(*bsb, session->rootId, i);
+    BSB_EXPORT_u16(*bsb, session->segments);
+
+    if (BSB_IS_ERROR(*bsb) || !moloch_field_checkpoint(session, bsb) || !moloch_parsers_checkpoint(session, bsb))
+        return FALSE;
+
+    uint32_t len = BSB_WORK_PTR(*bsb) - lenPtr - 4;
+    lenPtr[0] = len >> 24;
+    lenPtr[1] = len >> 16;
+    lenPtr[2] = len >> 8;
+    lenPtr[3] = len;
+    return TRUE;
+}
+/******************************************************************************/
+LOCAL void moloch_session_checkpoint_cmd(int thread, gpointer UNUSED(uw1), gpointer UNUSED(uw2))
+{
+    MolochSession_t *session;
+    unsigned char   *buf = malloc(MOLOCH_CHECKPOINT_MAX);
+    int              i, written = 0;
+    BSB              bsb;
+
+    for (i = 0; i < SESSION_MAX; i++) {
+        OHASH_FORALL_POP(sessions[thread][i], session,
+            if (session->bypassed)
+                moloch_packet_bypass_sync(session, TRUE);
+
+            BSB_INIT(bsb, buf, MOLOCH_CHECKPOINT_MAX);
+            if (checkpointFailed || !moloch_session_checkpoint_ok(session) || !moloch_session_checkpoint_write(session, &bsb)) {
+                moloch_session_save(session);
+                continue;
+            }
+
+            // After a failed write nothing more goes in the file, restore stops at the short record
+            int ok;
+            MOLOCH_LOCK(checkpointFile);
+            ok = !checkpointFailed && fwrite(buf, 1, BSB_LENGTH(bsb), checkpointFile) == (size_t)BSB_LENGTH(bsb);
+            if (!ok && !checkpointFailed) {
+                LOG("ERROR - Couldn't write checkpoint file, saving the rest of the sessions instead: %s", strerror(errno));
+                checkpointFailed = 1;
+            }
+            MOLOCH_UNLOCK(checkpointFile);
+            if (!ok) {
+                moloch_session_save(session);
+                continue;
+            }
+            written++;
+
+            // Already out of the hash, drop it without a save
+            bucketSessions[MOLOCH_SESSION_BUCKET(session->h_hash)]--;
+            moloch_session_timer_cancel(session);
+            DLL_REMOVE(q_, &sessionsQ[thread][session->ses], session);
+            moloch_session_free(session);
+        );
+    }
+    free(buf);
+
+    __sync_add_and_fetch(&checkpointWritten, written);
+
+    // Last thread finishes the file
+    if (__sync_sub_and_fetch(&checkpointOutstanding, 1) == 0) {
+        char tmp[1024];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", config.sessionCheckpoint);
+        if (fclose(checkpointFile) != 0) {
+            LOG("ERROR - Couldn't close checkpoint file %s, some sessions may be lost: %s", tmp, strerror(errno));
+            checkpointFailed = 1;
+        }
+        checkpointFile = 0;
+
+        // Even a short file has the sessions that made it, they aren't saved anywhere else
+        if (rename(tmp, config.sessionCheckpoint) != 0) {
+            LOG("ERROR - Couldn't rename %s to %s: %s", tmp, config.sessionCheckpoint, strerror(errno));
+        } else if (checkpointFailed) {
+            LOG("ERROR - Checkpoint %s is incomplete, %d sessions written", config.sessionCheckpoint, checkpointWritten);
+        } else {
+            LOG("Checkpointed %d sessions to %s", checkpointWritten, config.sessionCheckpoint);
+        }
+    }
+}
+/******************************************************************************/
+LOCAL int moloch_session_checkpoint_outstanding()
+{
+    return checkpointOutstanding;
+}
+/******************************************************************************/
+/* Only called on main thread, instead of moloch_session_flush */
+LOCAL void moloch_session_checkpoint()
+{
+    char tmp[1024];
+
+    moloch_packet_flush();
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", config.sessionCheckpoint);
+    checkpointFile = fopen(tmp, "w");
+    if (!checkpointFile) {
+        LOG("ERROR - Couldn't open checkpoint file %s, saving sessions instead: %s", tmp, strerror(errno));
+        moloch_session_flush();
+        return;
+    }
+
+    unsigned char hdr[12];
+    BSB           bsb;
+    BSB_INIT(bsb, hdr, sizeof(hdr));
+    BSB_EXPORT_u32(bsb, MOLOCH_CHECKPOINT_MAGIC);
+    BSB_EXPORT_u32(bsb, MOLOCH_CHECKPOINT_VERSION);
+    BSB_EXPORT_u32(bsb, sizeof(MolochSessionId_t));
+    if (fwrite(hdr, 1, sizeof(hdr), checkpointFile) != sizeof(hdr)) {
+        LOG("ERROR - Couldn't write checkpoint file %s, saving sessions instead: %s", tmp, strerror(errno));
+        fclose(checkpointFile);
+        checkpointFile = 0;
+        unlink(tmp);
+        moloch_session_flush();
+        return;
+    }
+
+    checkpointOutstanding = config.packetThreads;
+    moloch_add_can_quit(moloch_session_checkpoint_outstanding, "session checkpoint outstanding");
+
+    int thread;
+    for (thread = 0; thread < config.packetThreads; thread++) {
+        moloch_session_add_thread_cmd(thread, moloch_session_checkpoint_cmd, NULL, NULL);
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_session_restore_read(MolochSession_t *session, BSB *bsb)
+{
+    uint32_t i, num = 0, value = 0;
+    int      flags = 0;
+    unsigned char *ptr;
+
+    BSB_IMPORT_u08(*bsb, session->protocol);
+    BSB_IMPORT_u08(*bsb, session->tcp_flags);
+    BSB_IMPORT_u08(*bsb, session->ip_tos);
+    BSB_IMPORT_u08(*bsb, flags);
+    session->haveTcpSession = flags & 1;
+    session->stopSPI = (flags >> 1) & 1;
+    session->stopTCP = (flags >> 2) & 1;
+    session->midSave = (flags >> 3) & 1;
+    BSB_IMPORT_u16(*bsb, session->port1);
+    BSB_IMPORT_u16(*bsb, session->port2);
+    BSB_IMPORT_u16(*bsb, session->stopSaving);
+    BSB_IMPORT_u08(*bsb, session->minSaving);
+    BSB_IMPORT_ptr(*bsb, ptr, 2);
+    if (ptr)
+        memcpy(session->tcpState, ptr, 2);
+    BSB_IMPORT_u08(*bsb, session->firstBytesLen[0]);
+    BSB_IMPORT_u08(*bsb, session->firstBytesLen[1]);
+    BSB_IMPORT_ptr(*bsb, ptr, 16);
+    if (ptr)
+        memcpy(session->firstBytes, ptr, 16);
+    BSB_IMPORT_u08(*bsb, session->consumed[0]);
+    BSB_IMPORT_u08(*bsb, session->consumed[1]);
+    BSB_IMPORT_ptr(*bsb, ptr, 16);
+    if (ptr)
+        memcpy(session->addr1.s6_addr, ptr, 16);
+    BSB_IMPORT_ptr(*bsb, ptr, 16);
+    if (ptr)
+        memcpy(session->addr2.s6_addr, ptr, 16);
+    BSB_IMPORT_u32(*bsb, session->firstPacket.tv_sec);
+    BSB_IMPORT_u32(*bsb, session->firstPacket.tv_usec);
+    BSB_IMPORT_u32(*bsb, session->lastPacket.tv_sec);
+    BSB_IMPORT_u32(*bsb, session->lastPacket.tv_usec);
+    BSB_IMPORT_u32(*bsb, session->saveTime);
+    for (i = 0; i < 2; i++) {
+        BSB_IMPORT_u32(*bsb, session->packets[i]);
+        BSB_IMPORT_u32(*bsb, session->tcpSeq[i]);
+        MOLOCH_CHECKPOINT_IMPORT_u64(*bsb, session->bytes[i]);
+        MOLOCH_CHECKPOINT_IMPORT_u64(*bsb, session->databytes[i]);
+        MOLOCH_CHECKPOINT_IMPORT_u64(*bsb, session->totalDatabytes[i]);
+    }
+
+    BSB_IMPORT_u32(*bsb, num);
+    for (i = 0; i < num && BSB_NOT_ERROR(*bsb); i++) {
+        uint64_t pos = 0;
+        uint16_t len = 0;
+        MOLOCH_CHECKPOINT_IMPORT_u64(*bsb, pos);
+        BSB_IMPORT_u16(*bsb, len);
+        g_array_append_val(session->filePosArray, pos);
+        g_array_append_val(session->fileLenArray, len);
+    }
+    BSB_IMPORT_u32(*bsb, num);
+    for (i = 0; i < num && BSB_NOT_ERROR(*bsb); i++) {
+        BSB_IMPORT_u32(*bsb, value);
+        g_array_append_val(session->fileNumArray, value);
+    }
+    BSB_IMPORT_u32(*bsb, session->lastFileNum);
+
+    BSB_IMPORT_u16(*bsb, num);
+    BSB_IMPORT_ptr(*bsb, ptr, num);
+    if (num && ptr)
+        session->rootId = g_strndup((char *)ptr, num);
+    BSB_IMPORT_u16(*bsb, session->segments);
+
+    if (BSB_IS_ERROR(*bsb))
+        return;
+
+    moloch_field_restore(session, bsb);
+    moloch_parsers_restore(session, bsb);
+}
+/******************************************************************************/
+LOCAL void moloch_session_restore_cmd(int thread, gpointer UNUSED(uw1), gpointer UNUSED(uw2))
+{
+    MolochSession_t *session;
+    int              count = 0;
+    BSB              bsb;
+
+    BSB_INIT(bsb, restoreData + 12, restoreLen - 12);
+    while (BSB_REMAINING(bsb) > 4) {
+        uint32_t           len = 0;
+        unsigned char     *rec;
+        MolochSessionId_t  sessionId;
+        int                ses = 0, isNew;
+
+        BSB_IMPORT_u32(bsb, len);
+        BSB_IMPORT_ptr(bsb, rec, len);
+        if (BSB_IS_ERROR(bsb) || len < sizeof(MolochSessionId_t) + 1)
+            break;
+
+        memcpy(&sessionId, rec, sizeof(MolochSessionId_t));
+        ses = rec[sizeof(MolochSessionId_t)];
+
+        uint32_t hash = moloch_session_hash(&sessionId);
+        if (MOLOCH_SESSION_THREAD(hash) != thread || ses >= SESSION_MAX)
+            continue;
+
+        session = moloch_session_find_or_create(ses, hash, &sessionId, &isNew);
+        if (!isNew)
+            continue;
+
+        BSB rbsb;
+        BSB_INIT(rbsb, rec + sizeof(MolochSessionId_t) + 1, len - sizeof(MolochSessionId_t) - 1);
+        moloch_session_restore_read(session, &rbsb);
+
+        // Same as after a SYN, so the tcp write timeout keeps working
+        if (session->haveTcpSession && !session->tcp_next) {
+            DLL_PUSH_TAIL(tcp_, &tcpWriteQ[thread], session);
+        }
+        moloch_session_timer_schedule(session);
+        count++;
+    }
+
+    __sync_add_and_fetch(&restoreCount, count);
+    __sync_sub_and_fetch(&restoreOutstanding, 1);
+}
+/******************************************************************************/
+/* Only called on main thread, before the reader starts */
+void moloch_session_restore()
+{
+    if (!config.sessionCheckpoint || config.pcapReadOffline)
+        return;
+
+    if (!g_file_get_contents(config.sessionCheckpoint, &restoreData, &restoreLen, NULL))
+        return;
+
+    // Whatever happens next, never restore the same sessions twice
+    unlink(config.sessionCheckpoint);
+
+    BSB      bsb;
+    uint32_t magic = 0, version = 0, idLen = 0;
+    BSB_INIT(bsb, restoreData, restoreLen);
+    BSB_IMPORT_u32(bsb, magic);
+    BSB_IMPORT_u32(bsb, version);
+    BSB_IMPORT_u32(bsb, idLen);
+    if (BSB_IS_ERROR(bsb) || magic != MOLOCH_CHECKPOINT_MAGIC || version != MOLOCH_CHECKPOINT_VERSION || idLen != sizeof(MolochSessionId_t)) {
+        LOG("WARNING - Ignoring checkpoint file %s, not from this version", config.sessionCheckpoint);
+        g_free(restoreData);
+        restoreData = 0;
+        return;
+    }
+
+    restoreOutstanding = config.packetThreads;
 
     int thread;
     for (thread = 0; thread < config.packetThreads; thread++) {
-        fakeSessions[thread].thread = thread;
-        moloch_session_add_cmd(&fakeSessions[thread], MOLOCH_SES_CMD_FUNC, NULL, NULL, moloch_session_flush_close);
+        moloch_session_add_thread_cmd(thread, moloch_session_restore_cmd, NULL, NULL);
+    }
+}
+/******************************************************************************/
+int moloch_session_restore_outstanding()
+{
+    if (restoreOutstanding)
+        return restoreOutstanding;
+
+    if (restoreData) {
+        LOG("Restored %d sessions from %s", restoreCount, config.sessionCheckpoint);
+        g_free(restoreData);
+        restoreData = 0;
     }
+    return 0;
 }
 /******************************************************************************/
 void moloch_session_exit()
@@ -660,5 +1447,8 @@ void moloch_session_exit()
             counts[SESSION_UDP],
             counts[SESSION_ICMP]);
 
-    moloch_session_flush();
+    if (config.sessionCheckpoint && !config.pcapReadOffline)
+        moloch_session_checkpoint();
+    else
+        moloch_session_flush();
 }
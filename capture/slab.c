@@ -0,0 +1,152 @@
+/******************************************************************************/
+/* slab.c  -- Typed slab allocators for the objects every session creates
+ *
+ * Each type gets its own slabs, so the objects of a type are packed together
+ * and a freed one is reused for the same type instead of splitting memory
+ * that weeks later can't be handed back.  Every thread keeps a cache of free
+ * objects per type and only takes the shared lock to refill an empty cache
+ * or hand back half of a full one, so an object freed on a different thread
+ * than the one that created it just makes its way back through the shared
+ * list.  Slabs are never returned to the system.
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+/******************************************************************************/
+typedef struct moloch_slab_obj {
+    struct moloch_slab_obj *slab_next;
+} MolochSlabObj_t;
+
+typedef struct {
+    MolochSlabObj_t        *slab_next;
+    int                     slab_count;
+} MolochSlabHead_t;
+
+#define MOLOCH_SLAB_CACHE  512
+#define MOLOCH_SLAB_SIZE   (64*1024)
+#define MOLOCH_SLAB_ROUND(s) (((s) + 15) & ~15)
+
+LOCAL const uint32_t            slabSizes[MOLOCH_SLAB_MAX] = {
+    MOLOCH_SLAB_ROUND(sizeof(MolochSession_t)),
+    MOLOCH_SLAB_ROUND(sizeof(MolochTcpData_t)),
+    MOLOCH_SLAB_ROUND(sizeof(MolochString_t)),
+    MOLOCH_SLAB_ROUND(sizeof(MolochInt_t)),
+    MOLOCH_SLAB_ROUND(sizeof(MolochField_t))
+};
+LOCAL const char               *slabNames[MOLOCH_SLAB_MAX] = {"session", "tcpdata", "string", "int", "field"};
+
+LOCAL __thread MolochSlabHead_t slabCache[MOLOCH_SLAB_MAX];
+LOCAL MolochSlabHead_t          slabFree[MOLOCH_SLAB_MAX];
+LOCAL uint32_t                  slabCount[MOLOCH_SLAB_MAX];
+LOCAL MOLOCH_LOCK_DEFINE(slabFree);
+
+/******************************************************************************/
+LOCAL void moloch_slab_refill(int slab)
+{
+    MolochSlabHead_t *cache = &slabCache[slab];
+    const int         size = slabSizes[slab];
+    const int         num = MOLOCH_SLAB_SIZE/size;
+    int               i;
+
+    MOLOCH_LOCK(slabFree);
+    for (i = 0; i < MOLOCH_SLAB_CACHE/2 && slabFree[slab].slab_next; i++) {
+        MolochSlabObj_t *obj = slabFree[slab].slab_next;
+        slabFree[slab].slab_next = obj->slab_next;
+        slabFree[slab].slab_count--;
+        obj->slab_next = cache->slab_next;
+        cache->slab_next = obj;
+        cache->slab_count++;
+    }
+
+    if (cache->slab_next) {
+        MOLOCH_UNLOCK(slabFree);
+        return;
+    }
+    slabCount[slab]++;
+    MOLOCH_UNLOCK(slabFree);
+
+    uint8_t *mem;
+    if (posix_memalign((void **)&mem, 64, MOLOCH_SLAB_SIZE)) {
+        LOG("ERROR - Couldn't allocate %s slab", slabNames[slab]);
+        exit(1);
+    }
+    for (i = num - 1; i >= 0; i--) {
+        MolochSlabObj_t *obj = (MolochSlabObj_t *)(mem + i * size);
+        obj->slab_next = cache->slab_next;
+        cache->slab_next = obj;
+        cache->slab_count++;
+    }
+}
+/******************************************************************************/
+void *moloch_slab_alloc(int slab, int zero)
+{
+    MolochSlabHead_t *cache = &slabCache[slab];
+
+    if (unlikely(!cache->slab_next))
+        moloch_slab_refill(slab);
+
+    MolochSlabObj_t *obj = cache->slab_next;
+    cache->slab_next = obj->slab_next;
+    cache->slab_count--;
+
+    if (zero)
+        memset(obj, 0, slabSizes[slab]);
+
+    return obj;
+}
+/******************************************************************************/
+void moloch_slab_free(int slab, void *mem)
+{
+    MolochSlabHead_t *cache = &slabCache[slab];
+    MolochSlabObj_t  *obj = mem;
+
+    obj->slab_next = cache->slab_next;
+    cache->slab_next = obj;
+    cache->slab_count++;
+
+    if (likely(cache->slab_count <= MOLOCH_SLAB_CACHE))
+        return;
+
+    // Cache is full, give half to the other threads
+    MolochSlabObj_t *last = cache->slab_next;
+    int i;
+    for (i = 1; i < MOLOCH_SLAB_CACHE/2; i++) {
+        last = last->slab_next;
+    }
+
+    MOLOCH_LOCK(slabFree);
+    MolochSlabObj_t *first = cache->slab_next;
+    cache->slab_next = last->slab_next;
+    last->slab_next = slabFree[slab].slab_next;
+    slabFree[slab].slab_next = first;
+    slabFree[slab].slab_count += MOLOCH_SLAB_CACHE/2;
+    MOLOCH_UNLOCK(slabFree);
+    cache->slab_count -= MOLOCH_SLAB_CACHE/2;
+}
+/******************************************************************************/
+void moloch_slab_exit()
+{
+    int slab;
+
+    if (!config.debug)
+        return;
+
+    for (slab = 0; slab < MOLOCH_SLAB_MAX; slab++) {
+        LOG("%s slabs: %u size: %u objects: %u", slabNames[slab], slabCount[slab], slabSizes[slab], slabCount[slab] * (MOLOCH_SLAB_SIZE/slabSizes[slab]));
+    }
+}
@@ -0,0 +1,266 @@
+/******************************************************************************/
+/* stats.c  -- Per thread counters and stage latency histograms
+ *
+ * Every thread that records something gets its own MolochStatsThread_t, so
+ * recording is just an increment with no locks or atomics.  Latencies are
+ * sampled, only one of every statsSample calls reads the tsc, and go into
+ * log linear histograms with 4 buckets per power of 2, like HDR histograms
+ * with 2 bits of precision.  The main thread reads everything without
+ * locking when building the json, a slightly stale count is fine here.
+ *
+ * The json is served over http on the statsSocket unix socket, written to
+ * statsFile every statsInterval seconds and once more at exit.
+ *
+ *   curl --unix-socket /data/moloch/stats.sock http://localhost/
+ *
+ * Copyright 2012-2016 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_STATS_MAX_THREADS (MOLOCH_MAX_PACKET_THREADS + MOLOCH_MAX_READER_THREADS + 16)
+
+__thread MolochStatsThread_t *statsThread;
+__thread uint32_t             statsSampleCount;
+
+LOCAL MolochStatsThread_t    *statsThreads[MOLOCH_STATS_MAX_THREADS];
+LOCAL int                     statsThreadsNum;
+LOCAL MOLOCH_LOCK_DEFINE(statsThreads);
+
+LOCAL uint64_t                startTsc;
+LOCAL struct timeval          startTime;
+LOCAL int                     statsSocket = -1;
+
+LOCAL const char             *stageNames[MOLOCH_STATS_MAX] = {"queue", "parse", "session", "parsers", "writer", "db"};
+LOCAL const char             *counterNames[MOLOCH_STATS_COUNTERS] = {"packets", "bytes", "sessions", "saves", "dedups", "bypassed", "evictMaxStreams", "evictOldest", "evictLargest", "evictMidSave"};
+
+/******************************************************************************/
+MolochStatsThread_t *moloch_stats_thread_init()
+{
+    MolochStatsThread_t *st = MOLOCH_TYPE_ALLOC0(MolochStatsThread_t);
+
+    if (pthread_getname_np(pthread_self(), st->name, sizeof(st->name)) != 0)
+        snprintf(st->name, sizeof(st->name), "unknown");
+
+    MOLOCH_LOCK(statsThreads);
+    if (statsThreadsNum < MOLOCH_STATS_MAX_THREADS) {
+        statsThreads[statsThreadsNum++] = st;
+    } else {
+        LOG("WARNING - Too many threads for stats, not reporting %s", st->name);
+    }
+    MOLOCH_UNLOCK(statsThreads);
+
+    statsThread = st;
+    return st;
+}
+/******************************************************************************/
+void moloch_stats_record(int stage, uint64_t start)
+{
+    uint64_t now = moloch_stats_tsc();
+    uint64_t delta = (now > start)?now - start:0;
+    int      bucket;
+
+    if (delta < 4) {
+        bucket = delta;
+    } else {
+        int msb = 63 - __builtin_clzll(delta);
+        bucket = msb * 4 + ((delta >> (msb - 2)) & 3) - 4;
+    }
+
+    MolochStatsThread_t *st = statsThread?statsThread:moloch_stats_thread_init();
+    st->hist[stage][bucket]++;
+    st->histCount[stage]++;
+    st->histSum[stage] += delta;
+    if (delta > st->histMax[stage])
+        st->histMax[stage] = delta;
+}
+/******************************************************************************/
+/* Lower bound of a bucket in tsc ticks */
+LOCAL uint64_t moloch_stats_bucket_value(int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+
+    int msb = (bucket + 4) / 4;
+    return (uint64_t)(4 + (bucket + 4) % 4) << (msb - 2);
+}
+/******************************************************************************/
+LOCAL uint64_t moloch_stats_percentile(uint64_t *hist, uint64_t count, double pct)
+{
+    uint64_t want = count * pct;
+    uint64_t seen = 0;
+    int      b;
+
+    for (b = 0; b < MOLOCH_STATS_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return moloch_stats_bucket_value(b);
+    }
+    return 0;
+}
+/******************************************************************************/
+GString *moloch_stats_json()
+{
+    struct timeval now;
+    int            t, s, c, b;
+
+    gettimeofday(&now, NULL);
+    double secs = (now.tv_sec - startTime.tv_sec) + (now.tv_usec - startTime.tv_usec)/1000000.0;
+    double nsPerTick = (secs > 0)?secs * 1000000000.0 / (moloch_stats_tsc() - startTsc):1.0;
+
+    GString *json = g_string_sized_new(8192);
+    g_string_append_printf(json, "{\"time\": %ld, \"uptime\": %.3f, \"sample\": %u, \"sessionMemory\": %" PRIu64 ", \"threads\": [",
+                           (long)now.tv_sec, secs, config.statsSample, moloch_session_mem_size());
+
+    MOLOCH_LOCK(statsThreads);
+    int num = statsThreadsNum;
+    MOLOCH_UNLOCK(statsThreads);
+
+    for (t = 0; t < num; t++) {
+        MolochStatsThread_t *st = statsThreads[t];
+        g_string_append_printf(json, "%s\n{\"name\": \"%s\"", (t?",":""), st->name);
+        for (c = 0; c < MOLOCH_STATS_COUNTERS; c++) {
+            g_string_append_printf(json, ", \"%s\": %" PRIu64, counterNames[c], st->counters[c]);
+        }
+        g_string_append(json, ", \"stages\": {");
+        int first = 1;
+        for (s = 0; s < MOLOCH_STATS_MAX; s++) {
+            // Copy so the percentiles are at least consistent with each other
+            uint64_t hist[MOLOCH_STATS_BUCKETS];
+            uint64_t count = 0;
+            for (b = 0; b < MOLOCH_STATS_BUCKETS; b++) {
+                hist[b] = st->hist[s][b];
+                count += hist[b];
+            }
+            if (count == 0)
+                continue;
+
+            g_string_append_printf(json, "%s\"%s\": {\"count\": %" PRIu64 ", \"meanNs\": %.0f, \"p50Ns\": %.0f, \"p90Ns\": %.0f, \"p99Ns\": %.0f, \"p999Ns\": %.0f, \"maxNs\": %.0f}",
+                (first?"":", "), stageNames[s], count,
+                st->histSum[s] * nsPerTick / count,
+                moloch_stats_percentile(hist, count, 0.50) * nsPerTick,
+                moloch_stats_percentile(hist, count, 0.90) * nsPerTick,
+                moloch_stats_percentile(hist, count, 0.99) * nsPerTick,
+                moloch_stats_percentile(hist, count, 0.999) * nsPerTick,
+                st->histMax[s] * nsPerTick);
+            first = 0;
+        }
+        g_string_append(json, "}}");
+    }
+    g_string_append(json, "\n], ");
+    moloch_packet_load_json(json);
+    g_string_append(json, "}\n");
+    return json;
+}
+/******************************************************************************/
+LOCAL void moloch_stats_write_file()
+{
+    char     tmp[1024];
+    GString *json = moloch_stats_json();
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", config.statsFile);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        LOG("ERROR - Couldn't open stats file %s: %s", tmp, strerror(errno));
+        g_string_free(json, TRUE);
+        return;
+    }
+    fwrite(json->str, 1, json->len, fp);
+    fclose(fp);
+    if (rename(tmp, config.statsFile) != 0)
+        LOG("ERROR - Couldn't rename %s to %s: %s", tmp, config.statsFile, strerror(errno));
+    g_string_free(json, TRUE);
+}
+/******************************************************************************/
+LOCAL gboolean moloch_stats_file_gfunc (gpointer UNUSED(user_data))
+{
+    moloch_stats_write_file();
+    return TRUE;
+}
+/******************************************************************************/
+/* Called once the client has sent its request, we don't care what it was */
+LOCAL gboolean moloch_stats_client_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    char buf[1024];
+    int  rc = read(fd, buf, sizeof(buf));
+    (void)rc;
+
+    GString *json = moloch_stats_json();
+    char     hdr[200];
+    int      hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", (uint32_t)json->len);
+
+    if (write(fd, hdr, hlen) == hlen) {
+        rc = write(fd, json->str, json->len);
+    }
+    g_string_free(json, TRUE);
+    close(fd);
+    return FALSE;
+}
+/******************************************************************************/
+LOCAL gboolean moloch_stats_accept_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    int client = accept(fd, NULL, NULL);
+    if (client >= 0) {
+        moloch_watch_fd(client, MOLOCH_GIO_READ_COND, moloch_stats_client_cb, NULL);
+    }
+    return TRUE;
+}
+/******************************************************************************/
+void moloch_stats_init()
+{
+    startTsc = moloch_stats_tsc();
+    gettimeofday(&startTime, NULL);
+
+    if (config.statsSocket) {
+        struct sockaddr_un addr;
+
+        if (strlen(config.statsSocket) >= sizeof(addr.sun_path)) {
+            LOG("ERROR - statsSocket path too long %s", config.statsSocket);
+            exit(1);
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, config.statsSocket);
+        unlink(config.statsSocket);
+
+        statsSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (statsSocket < 0 || bind(statsSocket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(statsSocket, 5) != 0) {
+            LOG("ERROR - Couldn't listen on statsSocket %s: %s", config.statsSocket, strerror(errno));
+            exit(1);
+        }
+        moloch_watch_fd(statsSocket, MOLOCH_GIO_READ_COND, moloch_stats_accept_cb, NULL);
+    }
+
+    if (config.statsFile) {
+        g_timeout_add_seconds(config.statsInterval, moloch_stats_file_gfunc, 0);
+    }
+}
+/******************************************************************************/
+void moloch_stats_exit()
+{
+    if (config.statsFile) {
+        moloch_stats_write_file();
+    }
+
+    if (statsSocket >= 0) {
+        close(statsSocket);
+        unlink(config.statsSocket);
+    }
+}
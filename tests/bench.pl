@@ -0,0 +1,237 @@
+#!/usr/bin/perl
+# Offline replay benchmark for moloch-capture
+#
+# Builds one pcap out of the test pcaps (or the ones given), repeated --loops
+# times with timestamps rewritten so time only moves forward and the addresses
+# of every loop changed so each loop is a fresh set of sessions.  That pcap is
+# then run thru moloch-capture with the null writer and no ES at each
+# packetThreads count, and the statsFile json is used to report throughput
+# and the time spent in each stage.
+
+use strict;
+use JSON;
+use Time::HiRes qw(time);
+
+$main::loops = 10;
+$main::threads = "1,2,4";
+$main::sample = 64;
+$main::keep = 0;
+$main::capture = "../capture/moloch-capture";
+$main::pcap = "/tmp/moloch-bench.pcap";
+$main::stats = "/tmp/moloch-bench.json";
+$main::ini = "/tmp/moloch-bench.ini";
+
+################################################################################
+sub readPcap {
+    my ($filename) = @_;
+
+    open(my $fh, "<:raw", $filename) or die "Can't open $filename";
+    local $/;
+    my $data = <$fh>;
+    close($fh);
+
+    return undef if (length($data) < 24);
+
+    my ($l32, $l16, $nano);
+    my $magic = unpack("V", $data);
+    if ($magic == 0xa1b2c3d4 || $magic == 0xa1b23c4d) {
+        ($l32, $l16) = ("V", "v");
+    } elsif ($magic == 0xd4c3b2a1 || $magic == 0x4d3cb2a1) {
+        ($l32, $l16) = ("N", "n");
+    } else {
+        return undef;
+    }
+    $nano = ($magic == 0xa1b23c4d || $magic == 0x4d3cb2a1);
+
+    my $linktype = unpack($l32, substr($data, 20, 4));
+    my @packets;
+    my $pos = 24;
+    while ($pos + 16 <= length($data)) {
+        my ($sec, $usec, $caplen, $len) = unpack("$l32$l32$l32$l32", substr($data, $pos, 16));
+        last if ($pos + 16 + $caplen > length($data));
+        $usec = int($usec / 1000) if ($nano);
+        push(@packets, [$sec, $usec, $len, substr($data, $pos + 16, $caplen)]);
+        $pos += 16 + $caplen;
+    }
+    return {linktype => $linktype, packets => \@packets};
+}
+
+################################################################################
+# Change the 2nd and 3rd bytes of both addresses so every loop is new sessions
+sub rewriteAddresses {
+    my ($data, $key) = @_;
+    my $off = 12;
+
+    return if ($key == 0);
+
+    my $ethertype = unpack("n", substr($$data, $off, 2));
+    while ($ethertype == 0x8100 || $ethertype == 0x88a8) {
+        $off += 4;
+        return if ($off + 2 > length($$data));
+        $ethertype = unpack("n", substr($$data, $off, 2));
+    }
+    $off += 2;
+
+    my $xor = pack("n", $key);
+    if ($ethertype == 0x0800 && $off + 20 <= length($$data)) {
+        substr($$data, $off + 13, 2) ^= $xor;
+        substr($$data, $off + 17, 2) ^= $xor;
+
+        # Fix the ip header checksum
+        my $hlen = (unpack("C", substr($$data, $off, 1)) & 0xf) * 4;
+        return if ($hlen < 20 || $off + $hlen > length($$data));
+        substr($$data, $off + 10, 2) = "\0\0";
+        my $sum = 0;
+        $sum += $_ for unpack("n*", substr($$data, $off, $hlen));
+        $sum = ($sum & 0xffff) + ($sum >> 16) while ($sum >> 16);
+        substr($$data, $off + 10, 2) = pack("n", ~$sum & 0xffff);
+    } elsif ($ethertype == 0x86dd && $off + 40 <= length($$data)) {
+        substr($$data, $off + 10, 2) ^= $xor;
+        substr($$data, $off + 26, 2) ^= $xor;
+    }
+}
+
+################################################################################
+sub buildPcap {
+    my (@files) = @_;
+    my @pcaps;
+
+    foreach my $file (@files) {
+        my $pcap = readPcap($file);
+        if (!$pcap || $pcap->{linktype} != 1 || scalar(@{$pcap->{packets}}) == 0) {
+            print "Skipping $file, only ethernet pcaps are used\n";
+            next;
+        }
+        push(@pcaps, $pcap);
+    }
+    die "No pcap files to use" if (scalar(@pcaps) == 0);
+
+    open(my $out, ">:raw", $main::pcap) or die "Can't create $main::pcap";
+    print $out pack("VvvVVVV", 0xa1b2c3d4, 2, 4, 0, 0, 0xffff, 1);
+
+    my $clock = 1451606400;
+    my ($packets, $bytes) = (0, 0);
+    for (my $loop = 0; $loop < $main::loops; $loop++) {
+        foreach my $pcap (@pcaps) {
+            my $shift = $clock - $pcap->{packets}->[0]->[0];
+            foreach my $packet (@{$pcap->{packets}}) {
+                my $data = $packet->[3];
+                rewriteAddresses(\$data, $loop & 0xffff);
+                my $sec = $packet->[0] + $shift;
+                $clock = $sec if ($sec > $clock);
+                print $out pack("VVVV", $sec, $packet->[1], length($data), $packet->[2]), $data;
+                $packets++;
+                $bytes += length($data);
+            }
+            $clock++;
+        }
+    }
+    close($out);
+    printf("Built %s: %d packets, %.1f MB from %d pcaps x %d loops\n\n", $main::pcap, $packets, $bytes/1000000.0, scalar(@pcaps), $main::loops);
+}
+
+################################################################################
+sub writeIni {
+    my ($threads) = @_;
+
+    open(my $in, "<", "config.test.ini") or die "Can't open config.test.ini";
+    open(my $out, ">", $main::ini) or die "Can't create $main::ini";
+    print $out $_ while (<$in>);
+    close($in);
+
+    print $out "\n[bench]\n";
+    print $out "packetThreads=$threads\n";
+    print $out "pcapWriteMethod=null\n";
+    print $out "statsFile=$main::stats\n";
+    print $out "statsSample=$main::sample\n";
+    print $out "statsInterval=3600\n";
+    close($out);
+}
+
+################################################################################
+sub runCapture {
+    my ($threads) = @_;
+
+    writeIni($threads);
+    unlink($main::stats);
+
+    my $start = time();
+    system("$main::capture -c $main::ini -n bench -r $main::pcap --dryrun --nospi --quiet > /dev/null 2>&1") == 0 or die "$main::capture failed";
+    my $secs = time() - $start;
+
+    open(my $fh, "<", $main::stats) or die "No stats file $main::stats written";
+    local $/;
+    my $stats = from_json(<$fh>);
+    close($fh);
+
+    # Sum the counters over threads, the stages are merged weighted by count
+    my (%counters, %stages);
+    foreach my $thread (@{$stats->{threads}}) {
+        foreach my $counter ("packets", "bytes", "sessions", "saves") {
+            $counters{$counter} += $thread->{$counter};
+        }
+        while (my ($name, $stage) = each %{$thread->{stages}}) {
+            my $s = $stages{$name} ||= {count => 0, total => 0, p99Ns => 0, maxNs => 0};
+            $s->{count} += $stage->{count};
+            $s->{total} += $stage->{count} * $stage->{meanNs};
+            $s->{p99Ns} = $stage->{p99Ns} if ($stage->{p99Ns} > $s->{p99Ns});
+            $s->{maxNs} = $stage->{maxNs} if ($stage->{maxNs} > $s->{maxNs});
+        }
+    }
+
+    # Use capture's own uptime so startup (geo files, parsers) isn't counted
+    my $uptime = $stats->{uptime} || $secs;
+    printf("packetThreads %d: %.2fs  %.0f packets/s  %.0f sessions/s  %.1f MB/s\n",
+           $threads, $uptime, $counters{packets}/$uptime, $counters{sessions}/$uptime, $counters{bytes}/$uptime/1000000.0);
+    foreach my $name ("queue", "parse", "session", "parsers", "writer", "db") {
+        my $s = $stages{$name};
+        next if (!$s || $s->{count} == 0);
+        printf("    %-8s samples %9d  mean %8.0fns  p99 %8.0fns  max %10.0fns\n",
+               $name, $s->{count}, $s->{total}/$s->{count}, $s->{p99Ns}, $s->{maxNs});
+    }
+    print "\n";
+}
+
+################################################################################
+while (scalar (@ARGV) > 0) {
+    if ($ARGV[0] eq "--loops") {
+        shift @ARGV;
+        $main::loops = shift @ARGV;
+    } elsif ($ARGV[0] eq "--threads") {
+        shift @ARGV;
+        $main::threads = shift @ARGV;
+    } elsif ($ARGV[0] eq "--sample") {
+        shift @ARGV;
+        $main::sample = shift @ARGV;
+    } elsif ($ARGV[0] eq "--capture") {
+        shift @ARGV;
+        $main::capture = shift @ARGV;
+    } elsif ($ARGV[0] eq "--keep") {
+        $main::keep = 1;
+        shift @ARGV;
+    } elsif ($ARGV[0] =~ /^-/) {
+        print "$0 [OPTIONS] <pcap files>\n";
+        print "Options:\n";
+        print "  --loops <num>       Times to repeat the pcaps with new addresses, default 10\n";
+        print "  --threads <list>    Comma seperated packetThreads to run with, default 1,2,4\n";
+        print "  --sample <num>      statsSample to use, default 64\n";
+        print "  --capture <path>    moloch-capture to run, default ../capture/moloch-capture\n";
+        print "  --keep              Keep the generated pcap, ini and stats files\n";
+        print "\n";
+        print "Default is to use all the pcap/*.pcap files\n";
+        exit 0;
+    } else {
+        last;
+    }
+}
+
+my @files = (scalar(@ARGV) > 0)?@ARGV:glob("pcap/*.pcap");
+buildPcap(@files);
+
+foreach my $threads (split(/,/, $main::threads)) {
+    runCapture($threads);
+}
+
+if (!$main::keep) {
+    unlink($main::pcap, $main::ini, $main::stats);
+}
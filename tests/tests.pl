@@ -88,6 +88,74 @@ sub doTests {
     }
 }
 ################################################################################
+# Copy a pcap moving every packet $shift seconds
+sub shiftPcap {
+    my ($in, $out, $shift) = @_;
+
+    open(my $fh, "<:raw", $in) or die "Can't open $in";
+    my $data = do { local $/; <$fh> };
+    close($fh);
+
+    my $magic = unpack("V", $data);
+    my $l32 = ($magic == 0xa1b2c3d4 || $magic == 0xa1b23c4d)?"V":"N";
+    my $pos = 24;
+    while ($pos + 16 <= length($data)) {
+        my ($sec, $usec, $caplen) = unpack("$l32$l32$l32", substr($data, $pos, 12));
+        substr($data, $pos, 4) = pack($l32, $sec + $shift);
+        $pos += 16 + $caplen;
+    }
+
+    open($fh, ">:raw", $out) or die "Can't create $out";
+    print $fh $data;
+    close($fh);
+}
+################################################################################
+# One line per saved session record without the times, sorted
+sub replaySummary {
+    my (@files) = @_;
+
+    my $cmd = "../capture/moloch-capture --tests -c /tmp/moloch-replay.ini -n replay " . join(" ", map {"-r $_"} @files) . " 2>&1 1>/dev/null";
+    print "$cmd\n" if ($main::debug);
+
+    my $json = from_json(`$cmd`, {relaxed => 1});
+    my @lines;
+    foreach my $packet (@{$json->{packets}}) {
+        my $body = $packet->{body};
+        push(@lines, "$body->{a1}:$body->{p1} $body->{a2}:$body->{p2} $body->{pr} $body->{pa}");
+    }
+    return [sort @lines];
+}
+################################################################################
+# Two copies of each pcap a month apart read at the same time by different
+# reader threads must give the same records as reading them one at a time
+sub doReplay {
+    my @files = @ARGV;
+    @files = glob ("pcap/*.pcap") if ($#files == -1);
+
+    open(my $in, "<", "config.test.ini") or die "Can't open config.test.ini";
+    open(my $out, ">", "/tmp/moloch-replay.ini") or die "Can't create /tmp/moloch-replay.ini";
+    print $out $_ while (<$in>);
+    print $out "\n[replay]\nofflineReaderThreads=2\n";
+    close($in);
+    close($out);
+
+    plan tests => scalar @files;
+
+    foreach my $filename (@files) {
+        shiftPcap($filename, "/tmp/moloch-replay-old.pcap", -30*24*60*60);
+        shiftPcap($filename, "/tmp/moloch-replay-new.pcap", 0);
+
+        my $apart = replaySummary("/tmp/moloch-replay-old.pcap");
+        push(@{$apart}, @{replaySummary("/tmp/moloch-replay-new.pcap")});
+        @{$apart} = sort @{$apart};
+
+        my $together = replaySummary("/tmp/moloch-replay-old.pcap", "/tmp/moloch-replay-new.pcap");
+        eq_or_diff($together, $apart, "$filename", { context => 3 });
+    }
+
+    unlink("/tmp/moloch-replay.ini", "/tmp/moloch-replay-old.pcap", "/tmp/moloch-replay-new.pcap");
+}
+################################################################################
 sub doFix {
     my $data = do { local $/; <> };
     my $json = from_json($data, {relaxed => 1});
@@ -281,7 +349,7 @@ while (scalar (@ARGV) > 0) {
     } elsif ($ARGV[0] eq "--valgrind") {
         $main::valgrind = 1;
         shift @ARGV;
-    } elsif ($ARGV[0] =~ /^--(viewer|fix|make|capture|viewernostart|viewerstart|viewerhang|help)$/) {
+    } elsif ($ARGV[0] =~ /^--(viewer|fix|make|capture|replay|viewernostart|viewerstart|viewerhang|help)$/) {
         $main::cmd = $ARGV[0];
         shift @ARGV;
     } elsif ($ARGV[0] =~ /^-/) {
@@ -306,9 +374,13 @@ if ($main::cmd eq "--fix") {
     print "Commands:\n";
     print "  --help        This help\n";
     print "  --make        Create a .test file for each .pcap file on command line\n";
+    print "  --replay      Check two copies of each .pcap a month apart read at the same time\n";
     print "  --viewer      viewer tests\n";
     print "                This will init local ES, import data, start a viewer, run tests\n";
     print " [default]      Run each .pcap file thru ../capture/moloch-capture and compare to .test file\n";
+} elsif ($main::cmd eq "--replay") {
+    doGeo();
+    doReplay();
 } elsif ($main::cmd =~ "^--viewer") {
     doGeo();
     setpgrp $$, 0;